@@ -1,10 +1,18 @@
+#include <errno.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 #include "printf.h"
 
 #include "ansipixel.h"
@@ -15,36 +23,109 @@ typedef uint16_t AP_CharPixel;
 #define AP_CharPixel(up, down) (*(AP_CharPixel*)(AP_Color[2]){(up), (down)})
 #define AP_CharPixel_data(p) ((AP_Color*)&p)
 
+// The up and down colours of a cell, in memory order. They are copied in
+// and out with memcpy, reading them through a pointer of the other type
+// breaks strict aliasing
 typedef uint64_t AP_CharPixelRgb;
-#define AP_CharPixelRgb(up, down) \
-    (*(AP_CharPixelRgb*)(AP_ColorRgb[2]){(up), (down)})
-#define AP_CharPixelRgb_data(p) ((AP_ColorRgb*)&p)
-
+static inline AP_CharPixelRgb AP_CharPixelRgb_make(
+    AP_ColorRgb up, AP_ColorRgb down)
+{
+    AP_ColorRgb colors[2] = { up, down };
+    AP_CharPixelRgb p;
+    memcpy(&p, colors, sizeof(p));
+    return p;
+}
+static inline AP_ColorRgb AP_CharPixelRgb_color(AP_CharPixelRgb p, int i) {
+    AP_ColorRgb c;
+    memcpy(&c, (uint8_t*)&p + i * sizeof(c), sizeof(c));
+    return c;
+}
+static inline void AP_CharPixelRgb_setColor(
+    AP_CharPixelRgb* p, int i, AP_ColorRgb c)
+{
+    memcpy((uint8_t*)p + i * sizeof(c), &c, sizeof(c));
+}
+#define AP_CharPixelRgb(up, down) AP_CharPixelRgb_make((up), (down))
+#define AP_CharPixelRgb_fg(p) AP_CharPixelRgb_color((p), 0)
+#define AP_CharPixelRgb_bg(p) AP_CharPixelRgb_color((p), 1)
+
+// The last byte of the up colour of a cell, which AP_ColorRgb sets to 1 for
+// a half block. Cells fitted by AP_BufferRgb_blitBlocks keep their glyph
+// there: a flag for the glyph set and the pattern of sub-pixels drawn with
+// the foreground colour, bit y*2+x for the sub-pixel at (y, x)
+#define AP_CharPixelRgb_glyph(p) (((uint8_t*)&p)[3])
+#define AP_GLYPH_HALF 1
+#define AP_GLYPH_QUADRANT 0x40
+#define AP_GLYPH_SEXTANT 0x80
+static const char* AP_glyph(uint8_t glyph);
+
+// oldBuffer holds what is actually on screen. A cell is copied into it only
+// when its draw command is emitted.
+// dirtyRows has one bit per text row, set by the write APIs when a cell in
+// that row changes and cleared once the row on screen matches buffer. Only
+// dirty rows are diffed against oldBuffer on draw.
+// redraw forces every visible cell to be emitted on the next draw.
+// Changes closer than threshold to what is on screen are skipped until the
+// distance accumulated in error reaches errorLimit.
+// If budget is not 0, a draw only sends the most visible changes that fit in
+// budget bytes. age counts the draws a changed cell has been held back.
+// In a text mode a cell holds a character index and a grey palette colour,
+// 0 when greys is 0.
+// With motion, content that moved is scrolled or shifted on screen before
+// the diff, see AP_compensateMotion.
+// palette holds the colours of the 256 indices once they were redefined,
+// NULL for the xterm palette. paletteSend marks entries that still have to
+// be sent to the terminal.
+// repaints counts the draws that sent every cell because that was
+// estimated to take fewer bytes than the diff, see AP_Buffer_estimate.
+// With dither, AP_Buffer_blitRgb offsets pixels by AP_DITHER before
+// converting them, ditherRows holds the two offset rows of a cell.
 typedef struct {
     bool updated;
+    bool redraw;
+    bool motion;
+    bool dither;
+    AP_ColorRgb* ditherRows;
+    size_t repaints;
     size_t height, width;
     size_t termheight, termwidth;
+    AP_ColorRgb* palette;
+    uint64_t paletteSend[4];
+    AP_Text text;
+    int greys;
+    unsigned threshold, errorLimit;
+    uint16_t* error;
+    size_t budget;
+    uint8_t* age;
+    uint64_t* dirtyRows;
     AP_CharPixel* oldBuffer;
     AP_CharPixel* buffer;
 } AP_Buffer;
 #define AP_Buffer(b) ((AP_Buffer*)(b))
-static void AP_Buffer_updateOldBuffer(AP_Buffer* buf);
 
 typedef struct {
     bool updated;
+    bool redraw;
+    bool motion;
+    size_t repaints;
     size_t height, width;
     size_t termheight, termwidth;
+    unsigned threshold, errorLimit;
+    uint16_t* error;
+    size_t budget;
+    uint8_t* age;
+    uint64_t* dirtyRows;
     AP_CharPixelRgb* oldBuffer;
     AP_CharPixelRgb* buffer;
 } AP_BufferRgb;
 #define AP_BufferRgb(b) ((AP_BufferRgb*)(b))
-static void AP_BufferRgb_updateOldBuffer(AP_BufferRgb* buf);
 
 typedef struct {
     enum {
         RESETCOLOR,
-        MOVE, DRAW, DRAWRGB, PRINT, CLEAR, NL,
+        MOVE, DRAW, DRAWRGB, DRAWTEXT, PRINT, CLEAR, NL,
         SHOWCURSOR,
+        BLANK, SCROLL, SHIFT,
         SKIP, END,
     } type;
     union {
@@ -52,10 +133,21 @@ typedef struct {
         struct { size_t y, x; } MOVE;
         AP_CharPixel DRAW;
         AP_CharPixelRgb DRAWRGB;
-        int PRINT; // value not used
+        // setColor is cleared when the grey is already set
+        struct { AP_CharPixel cell; AP_Text text; bool setColor; } DRAWTEXT;
+        uint8_t PRINT; // glyph drawn with the current colours
         int CLEAR; // value not used
         int NL; // value not used
         bool SHOWCURSOR; // show or hide cursor
+        // background that scrolled and shifted in cells get, black or the
+        // default colours
+        bool BLANK;
+        // rows top to bottom move up by n, down when n is negative. Leaves
+        // the cursor at the top left
+        struct { size_t top, bottom; int n; } SCROLL;
+        // row y moves left by n columns, right when n is negative. Leaves
+        // the cursor at the start of the row
+        struct { size_t y; int n; } SHIFT;
         int SKIP; // value not used
         int END; // value not used
     };
@@ -67,6 +159,8 @@ static char* AP_DrawCommand_ansiSequence(
     AP_DrawCommand* command, char* strbuf, size_t size);
 #define CSI "\e["
 #define HALFBLOCK "▀"
+#define RAMP " .:-=+*#%@"
+#define AP_TEXT_BLANK(cell) (!AP_CharPixel_data(cell)[0])
 
 // array has to be freed
 // end of array indicated by AP_DrawCommand.type == END
@@ -74,6 +168,70 @@ static AP_DrawCommand* AP_DrawCommand_compileCommand(AP_Buffer* buf);
 static AP_DrawCommand* AP_DrawCommand_compileCommandRgb(AP_BufferRgb* buf);
 static AP_DrawCommand* AP_DrawCommand_optimizeCommand(AP_DrawCommand* commands);
 
+#define AP_bitsetWords(n) (((n) + 63) / 64)
+#define AP_bitset_set(set, i) ((set)[(i) / 64] |= (uint64_t)1 << ((i) % 64))
+#define AP_bitset_get(set, i) (((set)[(i) / 64] >> ((i) % 64)) & 1)
+#define AP_lowBits(n) ((n) >= 64 ? UINT64_MAX : ((uint64_t)1 << (n)) - 1)
+static void AP_bitset_fill(uint64_t* set, size_t n);
+
+// Splits the n sub-pixels of a cell into the two colours that leave the
+// least squared error. Returns the pattern of sub-pixels that get fg
+static uint8_t AP_fitCell(
+    const AP_ColorRgb* px, int n, AP_ColorRgb* fg, AP_ColorRgb* bg);
+
+// luma 0-255 of n pixels
+static void AP_luma(const AP_ColorRgb* px, uint8_t* luma, size_t n);
+// bit i of the result is set when luma[i] > thresholds[i % 16]
+// n has to be <= 64
+static uint64_t AP_thresholdMask(
+    const uint8_t* luma, const uint8_t* thresholds, size_t n);
+
+// perceptual distance between two colours, 0 to about 800
+static unsigned AP_colorDistance(AP_ColorRgb a, AP_ColorRgb b);
+static unsigned AP_CharPixel_distance(
+    AP_CharPixel a, AP_CharPixel b, const AP_ColorRgb* palette);
+static unsigned AP_CharPixelRgb_distance(AP_CharPixelRgb a, AP_CharPixelRgb b);
+
+// bit i of the result is set when cell i differs between a and b
+// n has to be <= 64
+static uint64_t AP_diffMask16(const uint16_t* a, const uint16_t* b, size_t n);
+static uint64_t AP_diffMask64(const uint64_t* a, const uint64_t* b, size_t n);
+
+// Motion compensation for buffers of cellSize byte cells, see the
+// implementation. Appends at most rows + 2 commands to data and returns
+// how many
+static size_t AP_compensateMotion(
+    void* oldBuffer, const void* buffer, size_t cellSize, size_t width,
+    size_t rows, size_t cols, bool shiftRows, uint64_t* dirtyRows,
+    uint16_t* error, uint8_t* age, const void* blank, bool black,
+    AP_DrawCommand* data);
+
+// a changed cell competing for the byte budget of a draw
+// priority is its visual error plus AP_AGE_WEIGHT per frame it has waited
+typedef struct {
+    uint32_t row, col;
+    uint16_t priority, cost;
+    bool keep;
+} AP_Candidate;
+#define AP_AGE_WEIGHT 16
+static int size_t_digits(size_t n);
+static size_t AP_DrawCommand_length(AP_DrawCommand* command);
+// keeps the highest priority candidates whose summed cost fits the budget
+static void AP_Candidate_select(AP_Candidate* c, size_t n, size_t budget);
+static size_t AP_Buffer_estimate(
+    AP_Buffer* buf, const uint64_t* masks, size_t words, size_t rows,
+    size_t cols);
+static size_t AP_BufferRgb_estimate(
+    AP_BufferRgb* buf, const uint64_t* masks, size_t words, size_t rows,
+    size_t cols);
+static void AP_fillMasks(
+    uint64_t* masks, size_t words, size_t rows, size_t cols);
+
+static void AP_String_appendCommands(AP_String* s, AP_DrawCommand* commands);
+static void AP_Buffer_appendPalette(AP_Buffer* buf, AP_String* out);
+
+// waits with poll when stdout is non-blocking and full
+// gives up on errors other than EINTR and EAGAIN
 #define flushprint(str, len) \
     do { \
         char* s = (str); \
@@ -82,7 +240,14 @@ static AP_DrawCommand* AP_DrawCommand_optimizeCommand(AP_DrawCommand* commands);
         while (l - i > 0) { \
             int a = write(STDOUT_FILENO, s + i, l - i); \
             if (a == -1) { \
-                continue; \
+                if (errno == EAGAIN || errno == EWOULDBLOCK) { \
+                    poll(&(struct pollfd){ STDOUT_FILENO, POLLOUT, 0 }, 1, -1); \
+                    continue; \
+                } \
+                if (errno == EINTR) { \
+                    continue; \
+                } \
+                break; \
             } \
             i += a; \
         } \
@@ -90,20 +255,58 @@ static AP_DrawCommand* AP_DrawCommand_optimizeCommand(AP_DrawCommand* commands);
 
 // IMPLEMENTATIONS
 
+void AP_String_reserve(AP_String* s, size_t extra) {
+    if (s->len + extra <= s->capacity) {
+        return;
+    }
+    size_t capacity = s->capacity ? s->capacity : 1024;
+    while (capacity < s->len + extra) {
+        capacity *= 2;
+    }
+    s->data = realloc(s->data, capacity);
+    s->capacity = capacity;
+}
+
+void AP_String_append(AP_String* s, const char* data, size_t len) {
+    AP_String_reserve(s, len);
+    memcpy(s->data + s->len, data, len);
+    s->len += len;
+}
+
+void AP_String_del(AP_String* s) {
+    free(s->data);
+    *s = (AP_String){ 0 };
+}
+
+static void AP_String_appendCommands(AP_String* s, AP_DrawCommand* commands) {
+    AP_String_reserve(s, 1);
+    for (AP_DrawCommand* c = commands; c->type != END; c++) {
+        char* end = AP_DrawCommand_ansiSequence(
+            c, s->data + s->len, s->capacity - s->len);
+        if (!end) {
+            AP_String_reserve(s, s->capacity - s->len + 1);
+            c--;
+            continue;
+        }
+        s->len = end - s->data;
+    }
+}
+
 struct AP_Buffer* AP_Buffer_new(size_t height, size_t width) {
     AP_Buffer* b = malloc(sizeof(*b));
     struct winsize w;
     ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
-    size_t l = (height/2 + height%2)*width;
-    AP_CharPixel* oldBuffer = malloc(l * sizeof(AP_CharPixel));
-    memset(oldBuffer, UINT8_MAX, l * sizeof(AP_CharPixel));
+    size_t rows = height/2 + height%2;
+    size_t l = rows*width;
     (*b) = (AP_Buffer){
         .updated = true,
+        .redraw = true,
         .height = height,
         .width = width,
         .termheight = w.ws_row,
         .termwidth = w.ws_col,
-        .oldBuffer = oldBuffer,
+        .dirtyRows = calloc(AP_bitsetWords(rows), sizeof(uint64_t)),
+        .oldBuffer = calloc(l, sizeof(AP_CharPixel)),
         .buffer = calloc(l, sizeof(AP_CharPixel)),
     };
 
@@ -112,6 +315,11 @@ struct AP_Buffer* AP_Buffer_new(size_t height, size_t width) {
 
 void AP_Buffer_del(struct AP_Buffer* buf) {
     AP_Buffer* buffer = AP_Buffer(buf);
+    free(buffer->error);
+    free(buffer->age);
+    free(buffer->palette);
+    free(buffer->ditherRows);
+    free(buffer->dirtyRows);
     free(buffer->oldBuffer);
     free(buffer->buffer);
     free(buffer);
@@ -140,51 +348,414 @@ void AP_Buffer_setPixel(
     bool subpixel = y % 2;
     AP_CharPixel* charPixel = &buffer->buffer[index];
     AP_Color originalColor = AP_CharPixel_data(*charPixel)[subpixel];
+    if (originalColor == color) {
+        return;
+    }
     AP_CharPixel_data(*charPixel)[subpixel] = color;
-    buffer->updated = buffer->updated || originalColor != color;
+    AP_bitset_set(buffer->dirtyRows, y / 2);
+    buffer->updated = true;
+}
+
+// 8x8 Bayer matrix. A pixel at (y, x) on screen is offset by
+// AP_DITHER[y % 8][x % 8] on every channel, a spread of about one step of
+// the 6x6x6 cube, before it is mapped to the nearest colour. The pattern
+// doesn't move with the content, so pixels that stay the same are mapped
+// the same on every frame. Rows hold the offsets as bytes of 8 pixels,
+// twice, so 4 pixels from any column can be loaded at once. Positive and
+// negative offsets are kept apart for saturating adds and subtracts
+#define AP_DITHER_STEP 40
+static uint32_t AP_ditherAdd[8][16];
+static uint32_t AP_ditherSub[8][16];
+
+static void AP_initDither() {
+    static const uint8_t bayer[8][8] = {
+        {  0, 32,  8, 40,  2, 34, 10, 42 },
+        { 48, 16, 56, 24, 50, 18, 58, 26 },
+        { 12, 44,  4, 36, 14, 46,  6, 38 },
+        { 60, 28, 52, 20, 62, 30, 54, 22 },
+        {  3, 35, 11, 43,  1, 33,  9, 41 },
+        { 51, 19, 59, 27, 49, 17, 57, 25 },
+        { 15, 47,  7, 39, 13, 45,  5, 37 },
+        { 63, 31, 55, 23, 61, 29, 53, 21 },
+    };
+    for (int y = 0; y < 8; y++) {
+        for (int x = 0; x < 16; x++) {
+            int offset = (2 * bayer[y][x % 8] + 1) * AP_DITHER_STEP / 128 -
+                AP_DITHER_STEP / 2;
+            uint8_t add = offset > 0 ? offset : 0;
+            uint8_t sub = offset < 0 ? -offset : 0;
+            // the fourth byte is the flag of AP_ColorRgb
+            AP_ditherAdd[y][x] = add | add << 8 | add << 16;
+            AP_ditherSub[y][x] = sub | sub << 8 | sub << 16;
+        }
+    }
+}
+
+// dest gets the w pixels of src offset for screen row y from column x
+static void AP_ditherRow(
+    const AP_ColorRgb* src,
+    AP_ColorRgb* dest,
+    size_t w,
+    size_t y,
+    size_t x)
+{
+    const uint32_t* add = AP_ditherAdd[y % 8];
+    const uint32_t* sub = AP_ditherSub[y % 8];
+    size_t j = 0;
+#if defined(__SSE2__)
+    for (; j + 4 <= w; j += 4) {
+        size_t k = (x + j) % 8;
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + j));
+        v = _mm_adds_epu8(v, _mm_loadu_si128((const __m128i*)(add + k)));
+        v = _mm_subs_epu8(v, _mm_loadu_si128((const __m128i*)(sub + k)));
+        _mm_storeu_si128((__m128i*)(dest + j), v);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; j + 4 <= w; j += 4) {
+        size_t k = (x + j) % 8;
+        uint8x16_t v = vld1q_u8((const uint8_t*)(src + j));
+        v = vqaddq_u8(v, vld1q_u8((const uint8_t*)(add + k)));
+        v = vqsubq_u8(v, vld1q_u8((const uint8_t*)(sub + k)));
+        vst1q_u8((uint8_t*)(dest + j), v);
+    }
+#endif
+    for (; j < w; j++) {
+        size_t k = (x + j) % 8;
+        const uint8_t* p = (const uint8_t*)(src + j);
+        uint8_t* d = (uint8_t*)(dest + j);
+        int a = add[k] & 0xff, s = sub[k] & 0xff;
+        for (int c = 0; c < 3; c++) {
+            int v = p[c] + a - s;
+            d[c] = v < 0 ? 0 : v > 255 ? 255 : v;
+        }
+        d[3] = p[3];
+    }
+}
+
+// Copies whole text rows at a time. A row is marked dirty if any of its
+// cells changed, which is accumulated while the row is written.
+static inline void AP_Buffer_blitImpl(
+    AP_Buffer* buffer,
+    const void* src,
+    size_t stride,
+    size_t y,
+    size_t x,
+    size_t h,
+    size_t w,
+    bool rgb)
+{
+    #define pixel(row, j) (rgb ? \
+        AP_rgbTo256(((const AP_ColorRgb*)(row))[j]) : \
+        ((const AP_Color*)(row))[j])
+    #define srcRow(py) (rgb ? \
+        (const void*)((const AP_ColorRgb*)src + ((py) - y) * stride) : \
+        (const void*)((const AP_Color*)src + ((py) - y) * stride))
+
+    if (y >= buffer->height || x >= buffer->width) {
+        return;
+    }
+    h = h < buffer->height - y ? h : buffer->height - y;
+    w = w < buffer->width - x ? w : buffer->width - x;
+
+    for (size_t py = y; py < y + h; py = py / 2 * 2 + 2) {
+        size_t row = py / 2;
+        const void* up = py % 2 ? NULL : srcRow(py);
+        const void* down = py % 2 ? srcRow(py) :
+            py + 1 < y + h ? srcRow(py + 1) : NULL;
+        if (rgb && buffer->dither) {
+            AP_ColorRgb* rows = buffer->ditherRows;
+            if (up) {
+                AP_ditherRow(up, rows, w, row * 2, x);
+                up = rows;
+            }
+            if (down) {
+                AP_ditherRow(down, rows + w, w, row * 2 + 1, x);
+                down = rows + w;
+            }
+        }
+        AP_CharPixel* cells = buffer->buffer + row * buffer->width + x;
+
+        AP_CharPixel changed = 0;
+        for (size_t j = 0; j < w; j++) {
+            AP_CharPixel old = cells[j];
+            AP_CharPixel c = AP_CharPixel(
+                up ? pixel(up, j) : AP_CharPixel_data(old)[0],
+                down ? pixel(down, j) : AP_CharPixel_data(old)[1]);
+            changed |= c ^ old;
+            cells[j] = c;
+        }
+        if (changed) {
+            AP_bitset_set(buffer->dirtyRows, row);
+            buffer->updated = true;
+        }
+    }
+
+    #undef pixel
+    #undef srcRow
+}
+
+void AP_Buffer_blit(
+    struct AP_Buffer* buf,
+    const AP_Color* src,
+    size_t stride,
+    size_t y,
+    size_t x,
+    size_t h,
+    size_t w)
+{
+    AP_Buffer_blitImpl(AP_Buffer(buf), src, stride, y, x, h, w, false);
+}
+
+void AP_BufferRgb_blitBlocks(
+    struct AP_BufferRgb* buf,
+    AP_Glyphs glyphs,
+    const AP_ColorRgb* src,
+    size_t stride,
+    size_t row,
+    size_t col,
+    size_t rows,
+    size_t cols)
+{
+    AP_BufferRgb* buffer = AP_BufferRgb(buf);
+    size_t bufRows = buffer->height/2 + buffer->height%2;
+    if (row >= bufRows || col >= buffer->width) {
+        return;
+    }
+    rows = rows < bufRows - row ? rows : bufRows - row;
+    cols = cols < buffer->width - col ? cols : buffer->width - col;
+
+    int n = 2 * glyphs;
+    uint8_t set = glyphs == AP_GLYPHS_QUADRANT ?
+        AP_GLYPH_QUADRANT : AP_GLYPH_SEXTANT;
+    for (size_t i = 0; i < rows; i++) {
+        AP_CharPixelRgb* cells = buffer->buffer + (row + i) * buffer->width + col;
+        const AP_ColorRgb* block = src + i * glyphs * stride;
+
+        AP_CharPixelRgb changed = 0;
+        for (size_t j = 0; j < cols; j++) {
+            AP_ColorRgb px[6];
+            for (int k = 0; k < n; k++) {
+                px[k] = block[(k / 2) * stride + 2 * j + k % 2];
+            }
+            AP_ColorRgb fg, bg;
+            uint8_t pattern = AP_fitCell(px, n, &fg, &bg);
+            AP_CharPixelRgb c = AP_CharPixelRgb(fg, bg);
+            AP_CharPixelRgb_glyph(c) = set | pattern;
+            changed |= c ^ cells[j];
+            cells[j] = c;
+        }
+        if (changed) {
+            AP_bitset_set(buffer->dirtyRows, row + i);
+            buffer->updated = true;
+        }
+    }
 }
 
-void AP_Buffer_draw(struct AP_Buffer* buf) {
+void AP_Buffer_setText(struct AP_Buffer* buf, AP_Text text, int greys) {
     AP_Buffer* buffer = AP_Buffer(buf);
-    if (!buffer->updated) {
+    buffer->text = text;
+    buffer->greys = greys < 2 ? 0 : greys > 24 ? 24 : greys;
+    AP_Buffer_refresh(buf);
+}
+
+// Ramp characters are picked by the average luma of a cell. Braille dots
+// are set where the luma is above an ordered dither threshold, so the
+// share of dots follows the brightness
+void AP_Buffer_blitText(
+    struct AP_Buffer* buf,
+    const AP_ColorRgb* src,
+    size_t stride,
+    size_t row,
+    size_t col,
+    size_t rows,
+    size_t cols)
+{
+    // dither thresholds for the 2x4 dots, repeated for 8 cells
+    static const uint8_t dither[4][16] = {
+        #define T(a, b) 16 + 32*a, 16 + 32*b
+        #define R(a, b) { T(a, b), T(a, b), T(a, b), T(a, b), \
+            T(a, b), T(a, b), T(a, b), T(a, b) }
+        R(0, 4), R(6, 2), R(1, 5), R(7, 3),
+        #undef R
+        #undef T
+    };
+    // braille dot bit for sub-pixel (y, x)
+    static const uint8_t dot[4][2] = { { 0, 3 }, { 1, 4 }, { 2, 5 }, { 6, 7 } };
+
+    AP_Buffer* buffer = AP_Buffer(buf);
+    size_t bufRows = buffer->height/2 + buffer->height%2;
+    if (row >= bufRows || col >= buffer->width || !buffer->text) {
         return;
     }
+    rows = rows < bufRows - row ? rows : bufRows - row;
+    cols = cols < buffer->width - col ? cols : buffer->width - col;
+
+    size_t tw = AP_Text_width(buffer->text);
+    size_t th = AP_Text_height(buffer->text);
+    uint8_t* luma = malloc(th * tw * cols);
+    for (size_t i = 0; i < rows; i++) {
+        for (size_t y = 0; y < th; y++) {
+            AP_luma(src + (i * th + y) * stride,
+                luma + y * tw * cols, tw * cols);
+        }
 
-    AP_DrawCommand* commands = AP_DrawCommand_compileCommand(buffer);
-    commands = AP_DrawCommand_optimizeCommand(commands);
+        AP_CharPixel* cells = buffer->buffer + (row + i) * buffer->width + col;
+        AP_CharPixel changed = 0;
+        for (size_t j = 0; j < cols; j += 32) {
+            size_t n = cols - j < 32 ? cols - j : 32;
+            uint64_t masks[4];
+            if (buffer->text == AP_TEXT_BRAILLE) {
+                for (size_t y = 0; y < 4; y++) {
+                    masks[y] = AP_thresholdMask(
+                        luma + y * 2 * cols + 2 * j, dither[y], 2 * n);
+                }
+            }
 
-    const size_t deltaCapacity = 1024;
-    size_t capacity = 1024;
-    size_t len = 0;
-    char* strbuf = calloc(capacity, 1);
-    char* strbuf_toAppend = strbuf;
-    for (AP_DrawCommand* c = commands; c->type != END; c++) {
-        strbuf_toAppend = AP_DrawCommand_ansiSequence(
-            c, strbuf_toAppend, capacity - len);
-        if (!strbuf_toAppend) {
-            strbuf = realloc(strbuf, capacity += deltaCapacity);
-            strbuf_toAppend = strbuf + len;
-            c--;
-            continue;
+            for (size_t k = 0; k < n; k++) {
+                uint8_t glyph;
+                unsigned sum = 0, count = 0;
+                if (buffer->text == AP_TEXT_BRAILLE) {
+                    glyph = 0;
+                    for (size_t y = 0; y < 4; y++) {
+                        for (size_t x = 0; x < 2; x++) {
+                            if (masks[y] >> (2 * k + x) & 1) {
+                                glyph |= 1 << dot[y][x];
+                                sum += luma[y * 2 * cols + 2 * (j + k) + x];
+                                count++;
+                            }
+                        }
+                    }
+                } else {
+                    sum = luma[j + k] + luma[cols + j + k];
+                    count = 2;
+                    glyph = sum * (sizeof(RAMP) - 1) / 512;
+                }
+
+                // dots get the grey of their average brightness
+                AP_Color grey = 0;
+                if (buffer->greys && count) {
+                    unsigned level = (sum / count * (buffer->greys - 1) + 127) / 255;
+                    grey = 232 + level * 23 / (buffer->greys - 1);
+                }
+                AP_CharPixel c = AP_CharPixel(glyph, glyph ? grey : 0);
+                changed |= c ^ cells[j + k];
+                cells[j + k] = c;
+            }
+        }
+        if (changed) {
+            AP_bitset_set(buffer->dirtyRows, row + i);
+            buffer->updated = true;
         }
-        len = strbuf_toAppend - strbuf;
     }
+    free(luma);
+}
 
-    flushprint(strbuf, len);
+void AP_Buffer_blitRgb(
+    struct AP_Buffer* buf,
+    const AP_ColorRgb* src,
+    size_t stride,
+    size_t y,
+    size_t x,
+    size_t h,
+    size_t w)
+{
+    AP_Buffer_blitImpl(AP_Buffer(buf), src, stride, y, x, h, w, true);
+}
 
-    free(strbuf);
-    free(commands);
-    AP_Buffer_updateOldBuffer(buffer);
+void AP_Buffer_setThreshold(
+    struct AP_Buffer* buf,
+    unsigned threshold,
+    unsigned errorLimit)
+{
+    AP_Buffer* buffer = AP_Buffer(buf);
+    size_t l = (buffer->height/2 + buffer->height%2) * buffer->width;
+    free(buffer->error);
+    buffer->error = threshold ? calloc(l, sizeof(*buffer->error)) : NULL;
+    buffer->threshold = threshold;
+    buffer->errorLimit = errorLimit < UINT16_MAX ? errorLimit : UINT16_MAX;
+}
+
+void AP_Buffer_setBudget(struct AP_Buffer* buf, size_t bytes) {
+    AP_Buffer* buffer = AP_Buffer(buf);
+    size_t l = (buffer->height/2 + buffer->height%2) * buffer->width;
+    free(buffer->age);
+    buffer->age = bytes ? calloc(l, sizeof(*buffer->age)) : NULL;
+    buffer->budget = bytes;
 }
 
-static void AP_Buffer_updateOldBuffer(AP_Buffer* buf) {
-    if (buf->updated) {
-        memcpy(
-            buf->oldBuffer,
-            buf->buffer,
-            (buf->height/2 + buf->height%2) * buf->width *
-                sizeof(*buf->oldBuffer));
+void AP_Buffer_setMotion(struct AP_Buffer* buf, bool motion) {
+    AP_Buffer(buf)->motion = motion;
+}
+
+void AP_Buffer_setDither(struct AP_Buffer* buf, bool dither) {
+    AP_Buffer* buffer = AP_Buffer(buf);
+    if (dither && !buffer->ditherRows) {
+        AP_initDither();
+        buffer->ditherRows = malloc(2 * buffer->width * sizeof(AP_ColorRgb));
     }
+    buffer->dither = dither;
+}
+
+void AP_Buffer_setPalette(
+    struct AP_Buffer* buf,
+    const AP_ColorRgb* colors,
+    int first,
+    int n)
+{
+    AP_Buffer* buffer = AP_Buffer(buf);
+    if (!buffer->palette) {
+        buffer->palette = malloc(256 * sizeof(*buffer->palette));
+        for (int i = 0; i < 256; i++) {
+            buffer->palette[i] = AP_256ToRgb(i);
+        }
+    }
+    for (int i = first; i < first + n && i < 256; i++) {
+        if (buffer->palette[i] != colors[i - first]) {
+            buffer->palette[i] = colors[i - first];
+            AP_bitset_set(buffer->paletteSend, i);
+            buffer->updated = true;
+        }
+    }
+}
+
+size_t AP_Buffer_repaints(struct AP_Buffer* buf) {
+    return AP_Buffer(buf)->repaints;
+}
+
+bool AP_Buffer_pending(struct AP_Buffer* buf) {
+    return AP_Buffer(buf)->updated;
+}
+
+void AP_Buffer_refresh(struct AP_Buffer* buf) {
+    AP_Buffer* buffer = AP_Buffer(buf);
+    buffer->redraw = true;
+    buffer->updated = true;
+}
+
+size_t AP_Buffer_encode(struct AP_Buffer* buf, AP_String* out) {
+    AP_Buffer* buffer = AP_Buffer(buf);
+    if (!buffer->updated) {
+        return 0;
+    }
+
+    AP_DrawCommand* commands = AP_DrawCommand_compileCommand(buffer);
+    commands = AP_DrawCommand_optimizeCommand(commands);
+
+    size_t len = out->len;
+    AP_Buffer_appendPalette(buffer, out);
+    AP_String_appendCommands(out, commands);
+
+    free(commands);
+    buffer->redraw = false;
+    return out->len - len;
+}
+
+size_t AP_Buffer_draw(struct AP_Buffer* buf) {
+    AP_String str = { 0 };
+    size_t len = AP_Buffer_encode(buf, &str);
+    flushprint(str.data, str.len);
+    AP_String_del(&str);
+    return len;
 }
 
 struct AP_BufferRgb* AP_BufferRgb_new(size_t height, size_t width) {
@@ -193,10 +764,13 @@ struct AP_BufferRgb* AP_BufferRgb_new(size_t height, size_t width) {
     ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
     (*b) = (AP_BufferRgb){
         .updated = false,
+        .redraw = false,
         .height = height,
         .width = width,
         .termheight = w.ws_row,
         .termwidth = w.ws_col,
+        .dirtyRows = calloc(
+            AP_bitsetWords(height/2 + height%2), sizeof(uint64_t)),
         .oldBuffer = calloc(
             (height/2 + height%2)*width, sizeof(AP_CharPixelRgb)),
         .buffer = calloc(
@@ -208,6 +782,9 @@ struct AP_BufferRgb* AP_BufferRgb_new(size_t height, size_t width) {
 
 void AP_BufferRgb_del(struct AP_BufferRgb* buf) {
     AP_BufferRgb* buffer = AP_BufferRgb(buf);
+    free(buffer->error);
+    free(buffer->age);
+    free(buffer->dirtyRows);
     free(buffer->oldBuffer);
     free(buffer->buffer);
     free(buffer);
@@ -222,7 +799,7 @@ AP_ColorRgb AP_BufferRgb_getPixel(
     size_t index = (y / 2) * buffer->width + x;
     bool subpixel = y % 2;
     AP_CharPixelRgb* charPixel = &buffer->buffer[index];
-    return AP_CharPixelRgb_data(*charPixel)[subpixel];
+    return AP_CharPixelRgb_color(*charPixel, subpixel);
 }
 
 void AP_BufferRgb_setPixel(
@@ -239,51 +816,116 @@ void AP_BufferRgb_setPixel(
     size_t index = (y / 2) * buffer->width + x;
     bool subpixel = y % 2;
     AP_CharPixelRgb* charPixel = &buffer->buffer[index];
-    AP_ColorRgb originalColor = AP_CharPixelRgb_data(*charPixel)[subpixel];
-    AP_CharPixelRgb_data(*charPixel)[subpixel] = color;
-    buffer->updated = buffer->updated || originalColor != color;
+    AP_ColorRgb originalColor = AP_CharPixelRgb_color(*charPixel, subpixel);
+    if (originalColor == color) {
+        return;
+    }
+    AP_CharPixelRgb_setColor(charPixel, subpixel, color);
+    AP_bitset_set(buffer->dirtyRows, y / 2);
+    buffer->updated = true;
 }
 
-void AP_BufferRgb_draw(struct AP_BufferRgb* buf) {
+void AP_BufferRgb_blit(
+    struct AP_BufferRgb* buf,
+    const AP_ColorRgb* src,
+    size_t stride,
+    size_t y,
+    size_t x,
+    size_t h,
+    size_t w)
+{
     AP_BufferRgb* buffer = AP_BufferRgb(buf);
-    if (!buffer->updated) {
+    if (y >= buffer->height || x >= buffer->width) {
         return;
     }
+    h = h < buffer->height - y ? h : buffer->height - y;
+    w = w < buffer->width - x ? w : buffer->width - x;
+
+    for (size_t py = y; py < y + h; py = py / 2 * 2 + 2) {
+        size_t row = py / 2;
+        const AP_ColorRgb* up = py % 2 ? NULL : src + (py - y) * stride;
+        const AP_ColorRgb* down = py % 2 ? src + (py - y) * stride :
+            py + 1 < y + h ? src + (py + 1 - y) * stride : NULL;
+        AP_CharPixelRgb* cells = buffer->buffer + row * buffer->width + x;
+
+        AP_CharPixelRgb changed = 0;
+        for (size_t j = 0; j < w; j++) {
+            AP_CharPixelRgb old = cells[j];
+            AP_CharPixelRgb c = AP_CharPixelRgb(
+                up ? up[j] : AP_CharPixelRgb_fg(old),
+                down ? down[j] : AP_CharPixelRgb_bg(old));
+            changed |= c ^ old;
+            cells[j] = c;
+        }
+        if (changed) {
+            AP_bitset_set(buffer->dirtyRows, row);
+            buffer->updated = true;
+        }
+    }
+}
 
-    AP_DrawCommand* commands = AP_DrawCommand_compileCommandRgb(buffer);
-    commands = AP_DrawCommand_optimizeCommand(commands);
+void AP_BufferRgb_setThreshold(
+    struct AP_BufferRgb* buf,
+    unsigned threshold,
+    unsigned errorLimit)
+{
+    AP_BufferRgb* buffer = AP_BufferRgb(buf);
+    size_t l = (buffer->height/2 + buffer->height%2) * buffer->width;
+    free(buffer->error);
+    buffer->error = threshold ? calloc(l, sizeof(*buffer->error)) : NULL;
+    buffer->threshold = threshold;
+    buffer->errorLimit = errorLimit < UINT16_MAX ? errorLimit : UINT16_MAX;
+}
 
-    const size_t deltaCapacity = 1024;
-    size_t capacity = 1024;
-    size_t len = 0;
-    char* strbuf = calloc(capacity, 1);
-    char* strbuf_toAppend = strbuf;
-    for (AP_DrawCommand* c = commands; c->type != END; c++) {
-        strbuf_toAppend = AP_DrawCommand_ansiSequence(
-            c, strbuf_toAppend, capacity - len);
-        if (!strbuf_toAppend) {
-            strbuf = realloc(strbuf, capacity += deltaCapacity);
-            strbuf_toAppend = strbuf + len;
-            c--;
-        }
-        len = strbuf_toAppend - strbuf;
+void AP_BufferRgb_setBudget(struct AP_BufferRgb* buf, size_t bytes) {
+    AP_BufferRgb* buffer = AP_BufferRgb(buf);
+    size_t l = (buffer->height/2 + buffer->height%2) * buffer->width;
+    free(buffer->age);
+    buffer->age = bytes ? calloc(l, sizeof(*buffer->age)) : NULL;
+    buffer->budget = bytes;
+}
+
+void AP_BufferRgb_setMotion(struct AP_BufferRgb* buf, bool motion) {
+    AP_BufferRgb(buf)->motion = motion;
+}
+
+size_t AP_BufferRgb_repaints(struct AP_BufferRgb* buf) {
+    return AP_BufferRgb(buf)->repaints;
+}
+
+bool AP_BufferRgb_pending(struct AP_BufferRgb* buf) {
+    return AP_BufferRgb(buf)->updated;
+}
+
+void AP_BufferRgb_refresh(struct AP_BufferRgb* buf) {
+    AP_BufferRgb* buffer = AP_BufferRgb(buf);
+    buffer->redraw = true;
+    buffer->updated = true;
+}
+
+size_t AP_BufferRgb_encode(struct AP_BufferRgb* buf, AP_String* out) {
+    AP_BufferRgb* buffer = AP_BufferRgb(buf);
+    if (!buffer->updated) {
+        return 0;
     }
 
-    flushprint(strbuf, len);
+    AP_DrawCommand* commands = AP_DrawCommand_compileCommandRgb(buffer);
+    commands = AP_DrawCommand_optimizeCommand(commands);
+
+    size_t len = out->len;
+    AP_String_appendCommands(out, commands);
 
-    free(strbuf);
     free(commands);
-    AP_BufferRgb_updateOldBuffer(buffer);
+    buffer->redraw = false;
+    return out->len - len;
 }
 
-static void AP_BufferRgb_updateOldBuffer(AP_BufferRgb* buf) {
-    if (buf->updated) {
-        memcpy(
-            buf->oldBuffer,
-            buf->buffer,
-            (buf->height/2 + buf->height%2) * buf->width *
-                sizeof(*buf->oldBuffer));
-    }
+size_t AP_BufferRgb_draw(struct AP_BufferRgb* buf) {
+    AP_String str = { 0 };
+    size_t len = AP_BufferRgb_encode(buf, &str);
+    flushprint(str.data, str.len);
+    AP_String_del(&str);
+    return len;
 }
 
 static int size_t_digits (size_t n) {
@@ -356,34 +998,52 @@ static char* AP_DrawCommand_ansiSequence(
         case DRAWRGB: {
             // foreground: CSI 38;2;{r};{g};{b}m
             // background: CSI 48;2;{r};{g};{b}m
-            AP_ColorRgb front = AP_CharPixelRgb_data(command->DRAWRGB)[0];
-            AP_ColorRgb back = AP_CharPixelRgb_data(command->DRAWRGB)[1];
-            size_t len = (sizeof(CSI) - 1 + 8) * 2 +
-                size_t_digits(AP_ColorRgb_r(front)) +
-                size_t_digits(AP_ColorRgb_g(front)) +
-                size_t_digits(AP_ColorRgb_b(front)) +
-                size_t_digits(AP_ColorRgb_r(back)) +
-                size_t_digits(AP_ColorRgb_g(back)) +
-                size_t_digits(AP_ColorRgb_b(back)) +
-                sizeof(HALFBLOCK);
+            AP_ColorRgb front = AP_CharPixelRgb_fg(command->DRAWRGB);
+            AP_ColorRgb back = AP_CharPixelRgb_bg(command->DRAWRGB);
+            const char* glyph = AP_glyph(AP_CharPixelRgb_glyph(command->DRAWRGB));
+            size_t len = AP_DrawCommand_length(command) + 1;
             if (len > size) {
                 return NULL;
             }
-            sprintf(strbuf, CSI "38;2;%u;%u;%um" CSI "48;2;%u;%u;%um" HALFBLOCK,
+            sprintf(strbuf, CSI "38;2;%u;%u;%um" CSI "48;2;%u;%u;%um%s",
                 AP_ColorRgb_r(front),
                 AP_ColorRgb_g(front),
                 AP_ColorRgb_b(front),
                 AP_ColorRgb_r(back),
                 AP_ColorRgb_g(back),
-                AP_ColorRgb_b(back));
+                AP_ColorRgb_b(back),
+                glyph);
             return strbuf + len - 1;
         }
+        case DRAWTEXT: {
+            size_t len = AP_DrawCommand_length(command) + 1;
+            if (len > size) {
+                return NULL;
+            }
+            char* end = strbuf;
+            AP_CharPixel cell = command->DRAWTEXT.cell;
+            if (command->DRAWTEXT.setColor) {
+                end += sprintf(end, CSI "38;5;%um", AP_CharPixel_data(cell)[1]);
+            }
+            uint8_t glyph = AP_CharPixel_data(cell)[0];
+            if (command->DRAWTEXT.text == AP_TEXT_RAMP || !glyph) {
+                *end++ = RAMP[glyph];
+            } else {
+                // U+2800 + dots
+                *end++ = 0xe2;
+                *end++ = 0xa0 | glyph >> 6;
+                *end++ = 0x80 | (glyph & 0x3f);
+            }
+            *end = 0;
+            return end;
+        }
         case PRINT: {
-            size_t len = sizeof(HALFBLOCK);
+            const char* glyph = AP_glyph(command->PRINT);
+            size_t len = strlen(glyph) + 1;
             if (len > size) {
                 return NULL;
             }
-            strcpy(strbuf, HALFBLOCK);
+            strcpy(strbuf, glyph);
             return strbuf + len - 1;
         }
         case CLEAR: {
@@ -414,6 +1074,39 @@ static char* AP_DrawCommand_ansiSequence(
             sprintf(strbuf, CSI "?25%c", command->SHOWCURSOR ? 'h' : 'l');
             return strbuf + len - 1;
         }
+        case BLANK: {
+            // CSI 48;5;16m or CSI 0m
+            const char* sequence = command->BLANK ? CSI "48;5;16m" : CSI "0m";
+            size_t len = strlen(sequence) + 1;
+            if (len > size) {
+                return NULL;
+            }
+            strcpy(strbuf, sequence);
+            return strbuf + len - 1;
+        }
+        case SCROLL: {
+            // margins, scroll up or down, reset margins:
+            // CSI {top};{bottom}r CSI {n}S CSI r
+            int n = command->SCROLL.n;
+            int len = snprintf(strbuf, size, CSI "%zu;%zur" CSI "%d%c" CSI "r",
+                command->SCROLL.top + 1, command->SCROLL.bottom + 1,
+                n > 0 ? n : -n, n > 0 ? 'S' : 'T');
+            if (len < 0 || (size_t)len >= size) {
+                return NULL;
+            }
+            return strbuf + len;
+        }
+        case SHIFT: {
+            // delete or insert characters at the start of the row:
+            // CSI {y};1H CSI {n}P or CSI {n}@
+            int n = command->SHIFT.n;
+            int len = snprintf(strbuf, size, CSI "%zu;1H" CSI "%d%c",
+                command->SHIFT.y + 1, n > 0 ? n : -n, n > 0 ? 'P' : '@');
+            if (len < 0 || (size_t)len >= size) {
+                return NULL;
+            }
+            return strbuf + len;
+        }
         case SKIP:
         case END: {
             return strbuf;
@@ -422,6 +1115,794 @@ static char* AP_DrawCommand_ansiSequence(
     return strbuf;
 }
 
+static void AP_bitset_fill(uint64_t* set, size_t n) {
+    for (size_t w = 0; w < AP_bitsetWords(n); w++) {
+        set[w] = AP_lowBits(n - w * 64);
+    }
+}
+
+static unsigned AP_colorDistance(AP_ColorRgb a, AP_ColorRgb b) {
+    // "redmean" weighted euclidean distance
+    int rmean = (AP_ColorRgb_r(a) + AP_ColorRgb_r(b)) / 2;
+    int dr = AP_ColorRgb_r(a) - AP_ColorRgb_r(b);
+    int dg = AP_ColorRgb_g(a) - AP_ColorRgb_g(b);
+    int db = AP_ColorRgb_b(a) - AP_ColorRgb_b(b);
+    unsigned d2 = (((512 + rmean) * dr * dr) >> 8) +
+        4 * dg * dg +
+        (((767 - rmean) * db * db) >> 8);
+    return sqrtf(d2);
+}
+
+// palette is what the indices stand for, NULL for the xterm palette
+static unsigned AP_CharPixel_distance(
+    AP_CharPixel a,
+    AP_CharPixel b,
+    const AP_ColorRgb* palette)
+{
+    #define color(c) (palette ? palette[c] : AP_256ToRgb(c))
+    unsigned up = AP_colorDistance(
+        color(AP_CharPixel_data(a)[0]), color(AP_CharPixel_data(b)[0]));
+    unsigned down = AP_colorDistance(
+        color(AP_CharPixel_data(a)[1]), color(AP_CharPixel_data(b)[1]));
+    #undef color
+    return up > down ? up : down;
+}
+
+static unsigned AP_CharPixelRgb_distance(AP_CharPixelRgb a, AP_CharPixelRgb b) {
+    unsigned up = AP_colorDistance(
+        AP_CharPixelRgb_fg(a), AP_CharPixelRgb_fg(b));
+    unsigned down = AP_colorDistance(
+        AP_CharPixelRgb_bg(a), AP_CharPixelRgb_bg(b));
+    unsigned d = up > down ? up : down;
+    // a different glyph moves the edge between the two colours
+    if (AP_CharPixelRgb_glyph(a) != AP_CharPixelRgb_glyph(b)) {
+        unsigned ea = AP_colorDistance(
+            AP_CharPixelRgb_fg(a), AP_CharPixelRgb_bg(a));
+        unsigned eb = AP_colorDistance(
+            AP_CharPixelRgb_fg(b), AP_CharPixelRgb_bg(b));
+        d = d > ea ? d : ea;
+        d = d > eb ? d : eb;
+    }
+    return d;
+}
+
+static const char* AP_glyph(uint8_t glyph) {
+    static const char* quadrants[16] = {
+        " ", "▘", "▝", "▀", "▖", "▌", "▞", "▛",
+        "▗", "▚", "▐", "▜", "▄", "▙", "▟", "█",
+    };
+    // U+1FB00 onwards skips the patterns that exist as other blocks
+    static const char* sextants[64] = {
+        " ", "🬀", "🬁", "🬂", "🬃", "🬄", "🬅", "🬆",
+        "🬇", "🬈", "🬉", "🬊", "🬋", "🬌", "🬍", "🬎",
+        "🬏", "🬐", "🬑", "🬒", "🬓", "▌", "🬔", "🬕",
+        "🬖", "🬗", "🬘", "🬙", "🬚", "🬛", "🬜", "🬝",
+        "🬞", "🬟", "🬠", "🬡", "🬢", "🬣", "🬤", "🬥",
+        "🬦", "🬧", "▐", "🬨", "🬩", "🬪", "🬫", "🬬",
+        "🬭", "🬮", "🬯", "🬰", "🬱", "🬲", "🬳", "🬴",
+        "🬵", "🬶", "🬷", "🬸", "🬹", "🬺", "🬻", "█",
+    };
+    if (glyph & AP_GLYPH_SEXTANT) {
+        return sextants[glyph & 0x3f];
+    }
+    if (glyph & AP_GLYPH_QUADRANT) {
+        return quadrants[glyph & 0xf];
+    }
+    return HALFBLOCK;
+}
+
+static uint8_t AP_fitCell(
+    const AP_ColorRgb* px,
+    int n,
+    AP_ColorRgb* fg,
+    AP_ColorRgb* bg)
+{
+    static const float inverse[7] = {
+        0, 1, 1 / 2.f, 1 / 3.f, 1 / 4.f, 1 / 5.f, 1 / 6.f };
+
+    // Minimising the squared error around the mean of both sides is the
+    // same as maximising |S1|^2 / n1 + |S0|^2 / n0 for the channel sums S1
+    // and S0 of each side. The last sub-pixel is always on the bg side,
+    // which leaves 2^(n-1) patterns whose sums are built incrementally
+    int patterns = 1 << (n - 1);
+    float r1[32], g1[32], b1[32], inv1[32], inv0[32];
+    float tr = 0, tg = 0, tb = 0;
+    for (int k = 0; k < n; k++) {
+        tr += AP_ColorRgb_r(px[k]);
+        tg += AP_ColorRgb_g(px[k]);
+        tb += AP_ColorRgb_b(px[k]);
+    }
+    r1[0] = g1[0] = b1[0] = 0;
+    inv1[0] = 0;
+    inv0[0] = inverse[n];
+    for (int m = 1; m < patterns; m++) {
+        int low = __builtin_ctz(m);
+        int rest = m & (m - 1);
+        r1[m] = r1[rest] + AP_ColorRgb_r(px[low]);
+        g1[m] = g1[rest] + AP_ColorRgb_g(px[low]);
+        b1[m] = b1[rest] + AP_ColorRgb_b(px[low]);
+        inv1[m] = inverse[__builtin_popcount(m)];
+        inv0[m] = inverse[n - __builtin_popcount(m)];
+    }
+
+    float score[32];
+    int m = 0;
+#if defined(__SSE2__)
+    __m128 vtr = _mm_set1_ps(tr), vtg = _mm_set1_ps(tg), vtb = _mm_set1_ps(tb);
+    for (; m + 4 <= patterns; m += 4) {
+        __m128 r = _mm_loadu_ps(r1 + m);
+        __m128 g = _mm_loadu_ps(g1 + m);
+        __m128 b = _mm_loadu_ps(b1 + m);
+        __m128 s1 = _mm_add_ps(_mm_add_ps(
+            _mm_mul_ps(r, r), _mm_mul_ps(g, g)), _mm_mul_ps(b, b));
+        r = _mm_sub_ps(vtr, r);
+        g = _mm_sub_ps(vtg, g);
+        b = _mm_sub_ps(vtb, b);
+        __m128 s0 = _mm_add_ps(_mm_add_ps(
+            _mm_mul_ps(r, r), _mm_mul_ps(g, g)), _mm_mul_ps(b, b));
+        _mm_storeu_ps(score + m, _mm_add_ps(
+            _mm_mul_ps(s1, _mm_loadu_ps(inv1 + m)),
+            _mm_mul_ps(s0, _mm_loadu_ps(inv0 + m))));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t vtr = vdupq_n_f32(tr);
+    float32x4_t vtg = vdupq_n_f32(tg);
+    float32x4_t vtb = vdupq_n_f32(tb);
+    for (; m + 4 <= patterns; m += 4) {
+        float32x4_t r = vld1q_f32(r1 + m);
+        float32x4_t g = vld1q_f32(g1 + m);
+        float32x4_t b = vld1q_f32(b1 + m);
+        float32x4_t s1 = vfmaq_f32(vfmaq_f32(vmulq_f32(r, r), g, g), b, b);
+        r = vsubq_f32(vtr, r);
+        g = vsubq_f32(vtg, g);
+        b = vsubq_f32(vtb, b);
+        float32x4_t s0 = vfmaq_f32(vfmaq_f32(vmulq_f32(r, r), g, g), b, b);
+        vst1q_f32(score + m, vaddq_f32(
+            vmulq_f32(s1, vld1q_f32(inv1 + m)),
+            vmulq_f32(s0, vld1q_f32(inv0 + m))));
+    }
+#endif
+    for (; m < patterns; m++) {
+        float s1 = r1[m] * r1[m] + g1[m] * g1[m] + b1[m] * b1[m];
+        float dr = tr - r1[m], dg = tg - g1[m], db = tb - b1[m];
+        float s0 = dr * dr + dg * dg + db * db;
+        score[m] = s1 * inv1[m] + s0 * inv0[m];
+    }
+
+    int best = 0;
+    for (m = 1; m < patterns; m++) {
+        if (score[m] > score[best]) {
+            best = m;
+        }
+    }
+
+    float i0 = inv0[best];
+    *bg = AP_ColorRgb(
+        (uint8_t)((tr - r1[best]) * i0 + 0.5f),
+        (uint8_t)((tg - g1[best]) * i0 + 0.5f),
+        (uint8_t)((tb - b1[best]) * i0 + 0.5f));
+    if (!best) {
+        // a single colour, fg is not visible
+        *fg = *bg;
+        return 0;
+    }
+    float i1 = inv1[best];
+    *fg = AP_ColorRgb(
+        (uint8_t)(r1[best] * i1 + 0.5f),
+        (uint8_t)(g1[best] * i1 + 0.5f),
+        (uint8_t)(b1[best] * i1 + 0.5f));
+    if (*fg == *bg) {
+        return 0;
+    }
+    return best;
+}
+
+static uint64_t AP_diffMask16(const uint16_t* a, const uint16_t* b, size_t n) {
+    uint64_t mask = 0;
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= n; i += 16) {
+        __m128i eq0 = _mm_cmpeq_epi16(
+            _mm_loadu_si128((const __m128i*)(a + i)),
+            _mm_loadu_si128((const __m128i*)(b + i)));
+        __m128i eq1 = _mm_cmpeq_epi16(
+            _mm_loadu_si128((const __m128i*)(a + i + 8)),
+            _mm_loadu_si128((const __m128i*)(b + i + 8)));
+        uint64_t eq = (uint16_t)_mm_movemask_epi8(_mm_packs_epi16(eq0, eq1));
+        mask |= (~eq & 0xffff) << i;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    static const uint16_t weights[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint16x8_t w = vld1q_u16(weights);
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t eq = vceqq_u16(vld1q_u16(a + i), vld1q_u16(b + i));
+        uint64_t bits = vaddvq_u16(vandq_u16(eq, w));
+        mask |= (~bits & 0xff) << i;
+    }
+#endif
+    for (; i < n; i++) {
+        mask |= (uint64_t)(a[i] != b[i]) << i;
+    }
+    return mask;
+}
+
+static uint64_t AP_diffMask64(const uint64_t* a, const uint64_t* b, size_t n) {
+    uint64_t mask = 0;
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 2 <= n; i += 2) {
+        __m128i eq = _mm_cmpeq_epi32(
+            _mm_loadu_si128((const __m128i*)(a + i)),
+            _mm_loadu_si128((const __m128i*)(b + i)));
+        // both 32 bit halves have to match
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        uint64_t bits = _mm_movemask_pd(_mm_castsi128_pd(eq));
+        mask |= (~bits & 3) << i;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    static const uint64_t weights[2] = { 1, 2 };
+    uint64x2_t w = vld1q_u64(weights);
+    for (; i + 2 <= n; i += 2) {
+        uint64x2_t eq = vceqq_u64(vld1q_u64(a + i), vld1q_u64(b + i));
+        uint64_t bits = vaddvq_u64(vandq_u64(eq, w));
+        mask |= (~bits & 3) << i;
+    }
+#endif
+    for (; i < n; i++) {
+        mask |= (uint64_t)(a[i] != b[i]) << i;
+    }
+    return mask;
+}
+
+// cells of new that equal the cells of old n columns to the right
+static size_t AP_countShifted(
+    const void* old,
+    const void* new,
+    size_t cellSize,
+    size_t cols,
+    int n)
+{
+    size_t from = n > 0 ? 0 : -n;
+    size_t to = n > 0 ? cols - n : cols;
+    size_t count = 0;
+    for (size_t j = from; j < to; j += 64) {
+        size_t len = to - j < 64 ? to - j : 64;
+        uint64_t diff = cellSize == sizeof(uint16_t) ?
+            AP_diffMask16((const uint16_t*)old + j + n,
+                (const uint16_t*)new + j, len) :
+            AP_diffMask64((const uint64_t*)old + j + n,
+                (const uint64_t*)new + j, len);
+        count += len - __builtin_popcountll(diff);
+    }
+    return count;
+}
+
+// Moves rows top to bottom of cells up by n like SU, down like SD when n is
+// negative, and fills the rows that come in with blank, zeros if NULL
+static void AP_scrollCells(
+    void* cells,
+    size_t cellSize,
+    size_t width,
+    size_t top,
+    size_t bottom,
+    int n,
+    const void* blank)
+{
+    uint8_t* c = cells;
+    size_t rowBytes = width * cellSize;
+    size_t moved = bottom - top + 1 - (n > 0 ? n : -n);
+    size_t first = n > 0 ? top + moved : top;
+    if (n > 0) {
+        memmove(c + top * rowBytes, c + (top + n) * rowBytes, moved * rowBytes);
+    } else {
+        memmove(c + (top - n) * rowBytes, c + top * rowBytes, moved * rowBytes);
+    }
+    for (size_t i = first; i < first + (n > 0 ? n : -n); i++) {
+        for (size_t j = 0; j < width; j++) {
+            if (blank) {
+                memcpy(c + i * rowBytes + j * cellSize, blank, cellSize);
+            } else {
+                memset(c + i * rowBytes + j * cellSize, 0, cellSize);
+            }
+        }
+    }
+}
+
+// Moves the first cols cells of a row left by n like DCH, right like ICH
+// when n is negative, and fills the cells that come in like AP_scrollCells
+static void AP_shiftCells(
+    void* row,
+    size_t cellSize,
+    size_t cols,
+    int n,
+    const void* blank)
+{
+    uint8_t* c = row;
+    size_t m = n > 0 ? n : -n;
+    size_t first = n > 0 ? cols - m : 0;
+    if (n > 0) {
+        memmove(c, c + m * cellSize, (cols - m) * cellSize);
+    } else {
+        memmove(c + m * cellSize, c, (cols - m) * cellSize);
+    }
+    for (size_t j = first; j < first + m; j++) {
+        if (blank) {
+            memcpy(c + j * cellSize, blank, cellSize);
+        } else {
+            memset(c + j * cellSize, 0, cellSize);
+        }
+    }
+}
+
+// Pans and scrolling move most rows of a frame without changing them.
+// The vertical shift that makes the most cells of the dirty rows of buffer
+// equal to cells of oldBuffer, minus the ones that already are, scrolls
+// them with margins (DECSTBM) and SU or SD. With shiftRows, the columns
+// all dirty rows move by most are then found the same way, and rows that
+// gain from it are shifted with DCH or ICH. That moves the rest of the
+// terminal row too, so it is only done for buffers as wide as the terminal.
+// oldBuffer, error and age are moved like the screen. Cells that come in
+// get the background set by BLANK, black or the default one in text modes,
+// which blank is the cell value of. Moved rows are marked dirty
+static size_t AP_compensateMotion(
+    void* oldBuffer,
+    const void* buffer,
+    size_t cellSize,
+    size_t width,
+    size_t rows,
+    size_t cols,
+    bool shiftRows,
+    uint64_t* dirtyRows,
+    uint16_t* error,
+    uint8_t* age,
+    const void* blank,
+    bool black,
+    AP_DrawCommand* data)
+{
+    uint8_t* old = oldBuffer;
+    const uint8_t* new = buffer;
+    size_t rowBytes = width * cellSize;
+    size_t n = 0;
+
+    size_t top = SIZE_MAX, bottom = 0;
+    for (size_t i = 0; i < rows; i++) {
+        if (AP_bitset_get(dirtyRows, i)) {
+            top = top < i ? top : i;
+            bottom = i;
+        }
+    }
+    if (top == SIZE_MAX) {
+        return 0;
+    }
+
+    // A scroll has to keep more cells than it breaks, by at least two rows
+    // worth, or it loses to diffing: cells that match in place are not
+    // drawn either, even in rows that changed
+    size_t region = bottom - top + 1;
+    int maxScroll = region / 2 < 32 ? region / 2 : 32;
+    if (maxScroll >= 1) {
+        long inPlace = 0;
+        for (size_t i = top; i <= bottom; i++) {
+            inPlace += AP_countShifted(old + i * rowBytes, new + i * rowBytes,
+                cellSize, cols, 0);
+        }
+        int best = 0;
+        long bestGain = 2 * (long)cols - 1;
+        for (int s = -maxScroll; s <= maxScroll; s++) {
+            if (!s) {
+                continue;
+            }
+            long kept = 0;
+            for (size_t i = top; i <= bottom; i++) {
+                long k = (long)i + s;
+                if (k >= (long)top && k <= (long)bottom) {
+                    kept += AP_countShifted(old + k * rowBytes,
+                        new + i * rowBytes, cellSize, cols, 0);
+                }
+            }
+            if (kept - inPlace > bestGain) {
+                best = s;
+                bestGain = kept - inPlace;
+            }
+        }
+
+        if (best) {
+            data[n++] = AP_DrawCommand(BLANK, black);
+            data[n++] = AP_DrawCommand(SCROLL, { top, bottom, best });
+            AP_scrollCells(old, cellSize, width, top, bottom, best, blank);
+            if (error) {
+                AP_scrollCells(error, sizeof(*error), width,
+                    top, bottom, best, NULL);
+            }
+            if (age) {
+                AP_scrollCells(age, sizeof(*age), width,
+                    top, bottom, best, NULL);
+            }
+            for (size_t i = top; i <= bottom; i++) {
+                AP_bitset_set(dirtyRows, i);
+            }
+        }
+    }
+
+    int maxShift = cols / 4 < 32 ? cols / 4 : 32;
+    if (!shiftRows || !maxShift) {
+        return n;
+    }
+    int best = 0;
+    size_t bestCount = 0, inPlace = 0;
+    for (int s = -maxShift; s <= maxShift; s++) {
+        size_t count = 0;
+        for (size_t i = top; i <= bottom; i++) {
+            if (AP_bitset_get(dirtyRows, i)) {
+                count += AP_countShifted(old + i * rowBytes,
+                    new + i * rowBytes, cellSize, cols, s);
+            }
+        }
+        if (!s) {
+            inPlace = count;
+        }
+        if (count > bestCount || (count == bestCount && !s)) {
+            best = s;
+            bestCount = count;
+        }
+    }
+    // same margin as scrolling
+    if (!best || bestCount < inPlace + 2 * cols) {
+        return n;
+    }
+
+    bool blanked = n > 0;
+    for (size_t i = top; i <= bottom; i++) {
+        // a shift costs about as much as two cells
+        if (!AP_bitset_get(dirtyRows, i) ||
+            AP_countShifted(old + i * rowBytes, new + i * rowBytes,
+                cellSize, cols, best) <
+            AP_countShifted(old + i * rowBytes, new + i * rowBytes,
+                cellSize, cols, 0) + 2)
+        {
+            continue;
+        }
+        if (!blanked) {
+            data[n++] = AP_DrawCommand(BLANK, black);
+            blanked = true;
+        }
+        data[n++] = AP_DrawCommand(SHIFT, { i, best });
+        AP_shiftCells(old + i * rowBytes, cellSize, cols, best, blank);
+        if (error) {
+            AP_shiftCells(error + i * width, sizeof(*error), cols, best, NULL);
+        }
+        if (age) {
+            AP_shiftCells(age + i * width, sizeof(*age), cols, best, NULL);
+        }
+    }
+    return n;
+}
+
+static void AP_luma(const AP_ColorRgb* px, uint8_t* luma, size_t n) {
+    // (77 r + 150 g + 29 b) / 256
+    size_t i = 0;
+#if defined(__SSE2__)
+    __m128i low = _mm_set1_epi32(0xff);
+    __m128i wr = _mm_set1_epi32(77);
+    __m128i wg = _mm_set1_epi32(150);
+    __m128i wb = _mm_set1_epi32(29);
+    for (; i + 8 <= n; i += 8) {
+        __m128i y[2];
+        for (int h = 0; h < 2; h++) {
+            __m128i p = _mm_loadu_si128((const __m128i*)(px + i + 4 * h));
+            // products fit the low 16 bits of each 32 bit lane
+            __m128i r = _mm_mullo_epi16(_mm_and_si128(p, low), wr);
+            __m128i g = _mm_mullo_epi16(
+                _mm_and_si128(_mm_srli_epi32(p, 8), low), wg);
+            __m128i b = _mm_mullo_epi16(
+                _mm_and_si128(_mm_srli_epi32(p, 16), low), wb);
+            y[h] = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(r, g), b), 8);
+        }
+        __m128i y16 = _mm_packs_epi32(y[0], y[1]);
+        _mm_storel_epi64((__m128i*)(luma + i), _mm_packus_epi16(y16, y16));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; i + 8 <= n; i += 8) {
+        uint8x8x4_t p = vld4_u8((const uint8_t*)(px + i));
+        uint16x8_t y = vmull_u8(p.val[0], vdup_n_u8(77));
+        y = vmlal_u8(y, p.val[1], vdup_n_u8(150));
+        y = vmlal_u8(y, p.val[2], vdup_n_u8(29));
+        vst1_u8(luma + i, vshrn_n_u16(y, 8));
+    }
+#endif
+    for (; i < n; i++) {
+        luma[i] = (77 * AP_ColorRgb_r(px[i]) + 150 * AP_ColorRgb_g(px[i]) +
+            29 * AP_ColorRgb_b(px[i])) >> 8;
+    }
+}
+
+static uint64_t AP_thresholdMask(
+    const uint8_t* luma,
+    const uint8_t* thresholds,
+    size_t n)
+{
+    uint64_t mask = 0;
+    size_t i = 0;
+#if defined(__SSE2__)
+    // unsigned compare through the signed one
+    __m128i bias = _mm_set1_epi8((char)0x80);
+    __m128i t = _mm_xor_si128(
+        _mm_loadu_si128((const __m128i*)thresholds), bias);
+    for (; i + 16 <= n; i += 16) {
+        __m128i l = _mm_xor_si128(
+            _mm_loadu_si128((const __m128i*)(luma + i)), bias);
+        uint64_t bits = (uint16_t)_mm_movemask_epi8(_mm_cmpgt_epi8(l, t));
+        mask |= bits << i;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    static const uint8_t weights[16] = {
+        1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t w = vld1q_u8(weights);
+    uint8x16_t t = vld1q_u8(thresholds);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t gt = vandq_u8(vcgtq_u8(vld1q_u8(luma + i), t), w);
+        uint64_t bits = vaddv_u8(vget_low_u8(gt)) |
+            (uint64_t)vaddv_u8(vget_high_u8(gt)) << 8;
+        mask |= bits << i;
+    }
+#endif
+    for (; i < n; i++) {
+        mask |= (uint64_t)(luma[i] > thresholds[i % 16]) << i;
+    }
+    return mask;
+}
+
+static size_t AP_DrawCommand_length(AP_DrawCommand* command) {
+    // has to match AP_DrawCommand_ansiSequence
+    switch (command->type) {
+        case MOVE:
+            return sizeof(CSI) - 1 +
+                size_t_digits(command->MOVE.y + 1) + 1 +
+                size_t_digits(command->MOVE.x + 1) + 1;
+        case DRAW:
+            return (sizeof(CSI) - 1 + 6) * 2 +
+                size_t_digits(AP_CharPixel_data(command->DRAW)[0]) +
+                size_t_digits(AP_CharPixel_data(command->DRAW)[1]) +
+                sizeof(HALFBLOCK) - 1;
+        case DRAWRGB: {
+            AP_ColorRgb front = AP_CharPixelRgb_fg(command->DRAWRGB);
+            AP_ColorRgb back = AP_CharPixelRgb_bg(command->DRAWRGB);
+            return (sizeof(CSI) - 1 + 8) * 2 +
+                size_t_digits(AP_ColorRgb_r(front)) +
+                size_t_digits(AP_ColorRgb_g(front)) +
+                size_t_digits(AP_ColorRgb_b(front)) +
+                size_t_digits(AP_ColorRgb_r(back)) +
+                size_t_digits(AP_ColorRgb_g(back)) +
+                size_t_digits(AP_ColorRgb_b(back)) +
+                strlen(AP_glyph(AP_CharPixelRgb_glyph(command->DRAWRGB)));
+        }
+        case DRAWTEXT: {
+            AP_CharPixel cell = command->DRAWTEXT.cell;
+            return (command->DRAWTEXT.setColor ?
+                    sizeof(CSI) - 1 + 6 +
+                    size_t_digits(AP_CharPixel_data(cell)[1]) : 0) +
+                (command->DRAWTEXT.text == AP_TEXT_RAMP ||
+                    AP_TEXT_BLANK(cell) ? 1 : 3);
+        }
+        default:
+            return 0;
+    }
+}
+
+static void AP_Candidate_select(AP_Candidate* c, size_t n, size_t budget) {
+    #define NBUCKETS 1024
+    #define bucket(p) ((p) < NBUCKETS * 4 ? (p) >> 2 : NBUCKETS - 1)
+
+    size_t total = 0;
+    for (size_t i = 0; i < n; i++) {
+        total += c[i].cost;
+        c[i].keep = true;
+    }
+    if (total <= budget) {
+        return;
+    }
+
+    // find the lowest priority bucket that still (partly) fits
+    size_t* costs = calloc(NBUCKETS, sizeof(*costs));
+    for (size_t i = 0; i < n; i++) {
+        costs[bucket(c[i].priority)] += c[i].cost;
+    }
+    size_t cutoff = NBUCKETS;
+    size_t left = budget;
+    while (cutoff > 0 && costs[cutoff - 1] <= left) {
+        left -= costs[--cutoff];
+    }
+    free(costs);
+
+    // cells in the cutoff bucket are taken in screen order while they fit
+    for (size_t i = 0; i < n; i++) {
+        size_t b = bucket(c[i].priority);
+        if (b >= cutoff) {
+            continue;
+        }
+        if (b == cutoff - 1 && c[i].cost <= left) {
+            left -= c[i].cost;
+            continue;
+        }
+        c[i].keep = false;
+    }
+
+    #undef bucket
+    #undef NBUCKETS
+}
+
+// Walks the set bits of a 64 cell change mask run by run
+// start and len describe the current run of changed cells
+#define AP_forEachRun(mask, start, len) \
+    for (uint64_t _m = (mask); \
+        _m && ((start) = __builtin_ctzll(_m), \
+            (len) = ~(_m >> (start)) ? \
+                (size_t)__builtin_ctzll(~(_m >> (start))) : 64 - (start), \
+            1); \
+        _m &= ~AP_lowBits((start) + (len)))
+
+static void AP_Buffer_limitToBudget(
+    AP_Buffer* buf,
+    uint64_t* masks,
+    size_t words,
+    size_t rows,
+    uint64_t* stale)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < rows * words; i++) {
+        n += __builtin_popcountll(masks[i]);
+    }
+    if (!n) {
+        return;
+    }
+
+    AP_Candidate* candidates = malloc(n * sizeof(*candidates));
+    n = 0;
+    for (size_t i = 0; i < rows; i++) {
+        for (size_t w = 0; w < words; w++) {
+            for (uint64_t bits = masks[i * words + w]; bits; bits &= bits - 1) {
+                size_t j = w * 64 + __builtin_ctzll(bits);
+                size_t index = i * buf->width + j;
+                // characters are only ordered by how long they waited
+                unsigned priority = AP_AGE_WEIGHT * buf->age[index] +
+                    (buf->text ? 0 : AP_CharPixel_distance(
+                        buf->oldBuffer[index], buf->buffer[index],
+                        buf->palette));
+                AP_DrawCommand draw = buf->text ?
+                    AP_DrawCommand(DRAWTEXT,
+                        { buf->buffer[index], buf->text, buf->greys > 0 }) :
+                    AP_DrawCommand(DRAW, buf->buffer[index]);
+                candidates[n++] = (AP_Candidate){
+                    .row = i,
+                    .col = j,
+                    .priority = priority,
+                    .cost = AP_DrawCommand_length(&draw) +
+                        AP_DrawCommand_length(
+                            &AP_DrawCommand(MOVE, { i, j })),
+                };
+            }
+        }
+    }
+
+    AP_Candidate_select(candidates, n, buf->budget);
+
+    for (size_t c = 0; c < n; c++) {
+        size_t i = candidates[c].row;
+        size_t j = candidates[c].col;
+        uint8_t* age = &buf->age[i * buf->width + j];
+        if (candidates[c].keep) {
+            *age = 0;
+            continue;
+        }
+        *age += *age < UINT8_MAX;
+        masks[i * words + j / 64] &= ~((uint64_t)1 << (j % 64));
+        AP_bitset_set(stale, i);
+    }
+    free(candidates);
+}
+
+// Roughly the bytes the cells of masks take once optimized, every cell of
+// the rows*cols in view when masks is NULL. A cell drawn right after one
+// with the same colours is a PRINT. A cell that doesn't follow the one
+// drawn before it needs a MOVE, or NL at the start of the next row
+static size_t AP_Buffer_estimate(
+    AP_Buffer* buf,
+    const uint64_t* masks,
+    size_t words,
+    size_t rows,
+    size_t cols)
+{
+    size_t bytes = 0;
+    size_t cursorY = 0, cursorX = 0;
+    bool drawn = false;
+    AP_CharPixel last = 0;
+    for (size_t i = 0; i < rows; i++) {
+        const AP_CharPixel* new = buf->buffer + i * buf->width;
+        for (size_t w = 0; w < words; w++) {
+            uint64_t mask = masks ? masks[i * words + w] :
+                AP_lowBits(cols - w * 64 < 64 ? cols - w * 64 : 64);
+            for (uint64_t bits = mask; bits; bits &= bits - 1) {
+                size_t j = w * 64 + __builtin_ctzll(bits);
+                if (cursorY != i || cursorX != j) {
+                    bytes += !j && cursorY + 1 == i ? sizeof(CSI "E") - 1 :
+                        AP_DrawCommand_length(&AP_DrawCommand(MOVE, { i, j }));
+                }
+                cursorY = i;
+                cursorX = j + 1;
+
+                AP_Color grey = AP_CharPixel_data(new[j])[1];
+                AP_DrawCommand draw = buf->text ?
+                    AP_DrawCommand(DRAWTEXT, { new[j], buf->text,
+                        grey && !AP_TEXT_BLANK(new[j]) &&
+                        (!drawn || AP_CharPixel_data(last)[1] != grey) }) :
+                    AP_DrawCommand(DRAW, new[j]);
+                bytes += !buf->text && drawn && last == new[j] ?
+                    sizeof(HALFBLOCK) - 1 : AP_DrawCommand_length(&draw);
+                // blanks don't set the grey
+                if (!buf->text || (grey && !AP_TEXT_BLANK(new[j]))) {
+                    last = new[j];
+                    drawn = true;
+                }
+            }
+        }
+    }
+    return bytes;
+}
+
+static size_t AP_BufferRgb_estimate(
+    AP_BufferRgb* buf,
+    const uint64_t* masks,
+    size_t words,
+    size_t rows,
+    size_t cols)
+{
+    size_t bytes = 0;
+    size_t cursorY = 0, cursorX = 0;
+    bool drawn = false;
+    AP_CharPixelRgb last = 0;
+    for (size_t i = 0; i < rows; i++) {
+        const AP_CharPixelRgb* new = buf->buffer + i * buf->width;
+        for (size_t w = 0; w < words; w++) {
+            uint64_t mask = masks ? masks[i * words + w] :
+                AP_lowBits(cols - w * 64 < 64 ? cols - w * 64 : 64);
+            for (uint64_t bits = mask; bits; bits &= bits - 1) {
+                size_t j = w * 64 + __builtin_ctzll(bits);
+                if (cursorY != i || cursorX != j) {
+                    bytes += !j && cursorY + 1 == i ? sizeof(CSI "E") - 1 :
+                        AP_DrawCommand_length(&AP_DrawCommand(MOVE, { i, j }));
+                }
+                cursorY = i;
+                cursorX = j + 1;
+
+                // only the colours have to match, PRINT keeps the glyph
+                AP_CharPixelRgb color = new[j];
+                AP_CharPixelRgb_glyph(color) = 0;
+                bytes += drawn && last == color ?
+                    strlen(AP_glyph(AP_CharPixelRgb_glyph(new[j]))) :
+                    AP_DrawCommand_length(&AP_DrawCommand(DRAWRGB, new[j]));
+                last = color;
+                drawn = true;
+            }
+        }
+    }
+    return bytes;
+}
+
+// select every cell of the rows*cols in view
+static void AP_fillMasks(
+    uint64_t* masks,
+    size_t words,
+    size_t rows,
+    size_t cols)
+{
+    for (size_t i = 0; i < rows; i++) {
+        for (size_t w = 0; w < words; w++) {
+            masks[i * words + w] =
+                AP_lowBits(cols - w * 64 < 64 ? cols - w * 64 : 64);
+        }
+    }
+}
+
 static AP_DrawCommand* AP_DrawCommand_compileCommand(AP_Buffer* buf) {
     #define resize() \
         do { \
@@ -436,35 +1917,208 @@ static AP_DrawCommand* AP_DrawCommand_compileCommand(AP_Buffer* buf) {
     size_t len = 0;
     AP_DrawCommand* data = malloc(capacity * sizeof(*data));
 
-    data[len++] = AP_DrawCommand(MOVE, { 0, 0 });
-    for (int i = 0; i < buf->height / 2 + buf->height % 2; i++) {
-        for (int j = 0; j < buf->width; j++) {
-            if (i >= buf->termheight || j >= buf->termwidth) {
-                break;
+    size_t rows = buf->height / 2 + buf->height % 2;
+    rows = rows < buf->termheight ? rows : buf->termheight;
+    size_t cols = buf->width < buf->termwidth ? buf->width : buf->termwidth;
+    size_t words = AP_bitsetWords(cols);
+    // distances between characters are not perceptual
+    bool lossy = buf->threshold && !buf->redraw && !buf->text;
+
+    // masks of cells to draw, stale marks rows left different from buffer
+    uint64_t* masks = calloc(rows * words + 1, sizeof(*masks));
+    uint64_t* stale = calloc(AP_bitsetWords(rows) + 1, sizeof(*stale));
+
+    if (buf->redraw && buf->error) {
+        memset(buf->error, 0, (buf->height/2 + buf->height%2) * buf->width *
+            sizeof(*buf->error));
+    }
+
+    // move what is on screen along with the frame before diffing it
+    AP_DrawCommand* motion = NULL;
+    size_t moved = 0;
+    if (buf->motion && !buf->redraw) {
+        AP_CharPixel blank = buf->text ?
+            AP_CharPixel(0, 0) : AP_CharPixel(16, 16);
+        motion = malloc((rows + 2) * sizeof(*motion));
+        moved = AP_compensateMotion(buf->oldBuffer, buf->buffer,
+            sizeof(AP_CharPixel), buf->width, rows, cols,
+            buf->width >= buf->termwidth, buf->dirtyRows, buf->error,
+            buf->age, &blank, !buf->text, motion);
+    }
+
+    for (size_t i = 0; i < rows; i++) {
+        if (!buf->redraw && !AP_bitset_get(buf->dirtyRows, i)) {
+            continue;
+        }
+
+        AP_CharPixel* old = buf->oldBuffer + i * buf->width;
+        AP_CharPixel* new = buf->buffer + i * buf->width;
+        uint16_t* error = lossy ? buf->error + i * buf->width : NULL;
+        for (size_t j = 0; j < cols; j += 64) {
+            size_t n = cols - j < 64 ? cols - j : 64;
+            uint64_t mask = buf->redraw ?
+                AP_lowBits(n) : AP_diffMask16(old + j, new + j, n);
+
+            // leave cells alone that are close to what is on screen
+            for (uint64_t bits = lossy ? mask : 0; bits; bits &= bits - 1) {
+                size_t k = j + __builtin_ctzll(bits);
+                unsigned d = AP_CharPixel_distance(
+                    old[k], new[k], buf->palette);
+                unsigned e = error[k] + d;
+                if (d < buf->threshold && e < buf->errorLimit) {
+                    error[k] = e;
+                    mask &= ~((uint64_t)1 << (k - j));
+                    AP_bitset_set(stale, i);
+                    continue;
+                }
+                error[k] = 0;
             }
+            masks[i * words + j / 64] = mask;
+        }
+    }
 
-            size_t index = i * buf->width + j;
-            // This conditional causes initial black screen not to be drawn
-            // if (buf->oldBuffer[index] == buf->buffer[index]) {
-            //     continue;
-            // }
-            if (buf->oldBuffer[index] == buf->buffer[index] &&
-                buf->oldBuffer[index] != UINT16_MAX) {
-                continue;
+    // A cut or a flash changes most cells, and sending every cell in order
+    // can then take fewer bytes than moving the cursor around the ones
+    // that stayed. Only estimated when at least a quarter changed
+    bool repaint = false;
+    if (!buf->redraw) {
+        size_t changed = 0;
+        for (size_t k = 0; k < rows * words; k++) {
+            changed += __builtin_popcountll(masks[k]);
+        }
+        if (changed >= rows * cols / 4) {
+            size_t all = AP_Buffer_estimate(buf, NULL, words, rows, cols);
+            repaint = all < AP_Buffer_estimate(buf, masks, words, rows, cols) &&
+                (!buf->budget || all <= buf->budget);
+        }
+    }
+    if (repaint) {
+        AP_fillMasks(masks, words, rows, cols);
+        memset(stale, 0, AP_bitsetWords(rows) * sizeof(*stale));
+        for (size_t i = 0; i < rows; i++) {
+            if (buf->error) {
+                memset(buf->error + i * buf->width, 0,
+                    cols * sizeof(*buf->error));
+            }
+            if (buf->age) {
+                memset(buf->age + i * buf->width, 0, cols * sizeof(*buf->age));
+            }
+        }
+        buf->repaints++;
+    } else if (buf->budget && !buf->redraw) {
+        AP_Buffer_limitToBudget(buf, masks, words, rows, stale);
+    }
+
+    size_t cursorY = 0, cursorX = 0;
+    data[len++] = AP_DrawCommand(MOVE, { 0, 0 });
+    for (size_t m = 0; m < moved; m++) {
+        resize();
+        data[len++] = motion[m];
+        // the first draw has to move the cursor
+        cursorY = SIZE_MAX;
+    }
+    free(motion);
+    if (buf->text && !moved) {
+        // characters use the default background, which BLANK sets too
+        resize();
+        data[len++] = AP_DrawCommand(RESETCOLOR, 0);
+    }
+    for (size_t i = 0; i < rows; i++) {
+        AP_CharPixel* old = buf->oldBuffer + i * buf->width;
+        AP_CharPixel* new = buf->buffer + i * buf->width;
+        for (size_t w = 0; w < words; w++) {
+            size_t j = w * 64;
+            size_t start, runLen;
+            AP_forEachRun(masks[i * words + w], start, runLen) {
+                if (cursorY != i || cursorX != j + start) {
+                    resize();
+                    data[len++] = AP_DrawCommand(MOVE, { i, j + start });
+                }
+                for (size_t k = j + start; k < j + start + runLen; k++) {
+                    resize();
+                    data[len++] = buf->text ?
+                        AP_DrawCommand(DRAWTEXT, { new[k], buf->text, true }) :
+                        AP_DrawCommand(DRAW, new[k]);
+                    old[k] = new[k];
+                }
+                cursorY = i;
+                cursorX = j + start + runLen;
             }
-            resize();
-            data[len++] = AP_DrawCommand(MOVE, { i, j });
-            resize();
-            data[len++] = AP_DrawCommand(DRAW, buf->buffer[index]);
         }
     }
 
+    // visible rows are clean unless some of their cells were held back
+    bool pending = false;
+    for (size_t w = 0; w < AP_bitsetWords(rows); w++) {
+        buf->dirtyRows[w] &= ~AP_lowBits(rows - w * 64);
+        buf->dirtyRows[w] |= stale[w];
+        pending = pending || stale[w];
+    }
+    buf->updated = pending;
+    free(masks);
+    free(stale);
+
+    resize();
     data[len] = AP_DrawCommand(END, 0);
     return data;
 
     #undef resize
 }
 
+static void AP_BufferRgb_limitToBudget(
+    AP_BufferRgb* buf,
+    uint64_t* masks,
+    size_t words,
+    size_t rows,
+    uint64_t* stale)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < rows * words; i++) {
+        n += __builtin_popcountll(masks[i]);
+    }
+    if (!n) {
+        return;
+    }
+
+    AP_Candidate* candidates = malloc(n * sizeof(*candidates));
+    n = 0;
+    for (size_t i = 0; i < rows; i++) {
+        for (size_t w = 0; w < words; w++) {
+            for (uint64_t bits = masks[i * words + w]; bits; bits &= bits - 1) {
+                size_t j = w * 64 + __builtin_ctzll(bits);
+                size_t index = i * buf->width + j;
+                unsigned priority = AP_AGE_WEIGHT * buf->age[index] +
+                    AP_CharPixelRgb_distance(buf->oldBuffer[index], buf->buffer[index]);
+                candidates[n++] = (AP_Candidate){
+                    .row = i,
+                    .col = j,
+                    .priority = priority,
+                    .cost = AP_DrawCommand_length(
+                            &AP_DrawCommand(DRAWRGB, buf->buffer[index])) +
+                        AP_DrawCommand_length(
+                            &AP_DrawCommand(MOVE, { i, j })),
+                };
+            }
+        }
+    }
+
+    AP_Candidate_select(candidates, n, buf->budget);
+
+    for (size_t c = 0; c < n; c++) {
+        size_t i = candidates[c].row;
+        size_t j = candidates[c].col;
+        uint8_t* age = &buf->age[i * buf->width + j];
+        if (candidates[c].keep) {
+            *age = 0;
+            continue;
+        }
+        *age += *age < UINT8_MAX;
+        masks[i * words + j / 64] &= ~((uint64_t)1 << (j % 64));
+        AP_bitset_set(stale, i);
+    }
+    free(candidates);
+}
+
 static AP_DrawCommand* AP_DrawCommand_compileCommandRgb(AP_BufferRgb* buf) {
     #define resize() \
         do { \
@@ -479,24 +2133,138 @@ static AP_DrawCommand* AP_DrawCommand_compileCommandRgb(AP_BufferRgb* buf) {
     size_t len = 0;
     AP_DrawCommand* data = malloc(capacity * sizeof(*data));
 
-    data[len++] = AP_DrawCommand(MOVE, { 0, 0 });
-    for (int i = 0; i < buf->height / 2 + buf->height % 2; i++) {
-        for (int j = 0; j < buf->width; j++) {
-            if (i >= buf->termheight || j >= buf->termwidth) {
-                break;
+    size_t rows = buf->height / 2 + buf->height % 2;
+    rows = rows < buf->termheight ? rows : buf->termheight;
+    size_t cols = buf->width < buf->termwidth ? buf->width : buf->termwidth;
+    size_t words = AP_bitsetWords(cols);
+    bool lossy = buf->threshold && !buf->redraw;
+
+    // masks of cells to draw, stale marks rows left different from buffer
+    uint64_t* masks = calloc(rows * words + 1, sizeof(*masks));
+    uint64_t* stale = calloc(AP_bitsetWords(rows) + 1, sizeof(*stale));
+
+    if (buf->redraw && buf->error) {
+        memset(buf->error, 0, (buf->height/2 + buf->height%2) * buf->width *
+            sizeof(*buf->error));
+    }
+
+    // move what is on screen along with the frame before diffing it
+    AP_DrawCommand* motion = NULL;
+    size_t moved = 0;
+    if (buf->motion && !buf->redraw) {
+        AP_CharPixelRgb blank = AP_CharPixelRgb(
+            AP_ColorRgb(0, 0, 0), AP_ColorRgb(0, 0, 0));
+        motion = malloc((rows + 2) * sizeof(*motion));
+        moved = AP_compensateMotion(buf->oldBuffer, buf->buffer,
+            sizeof(AP_CharPixelRgb), buf->width, rows, cols,
+            buf->width >= buf->termwidth, buf->dirtyRows, buf->error,
+            buf->age, &blank, true, motion);
+    }
+
+    for (size_t i = 0; i < rows; i++) {
+        if (!buf->redraw && !AP_bitset_get(buf->dirtyRows, i)) {
+            continue;
+        }
+
+        AP_CharPixelRgb* old = buf->oldBuffer + i * buf->width;
+        AP_CharPixelRgb* new = buf->buffer + i * buf->width;
+        uint16_t* error = lossy ? buf->error + i * buf->width : NULL;
+        for (size_t j = 0; j < cols; j += 64) {
+            size_t n = cols - j < 64 ? cols - j : 64;
+            uint64_t mask = buf->redraw ?
+                AP_lowBits(n) : AP_diffMask64(old + j, new + j, n);
+
+            // leave cells alone that are close to what is on screen
+            for (uint64_t bits = lossy ? mask : 0; bits; bits &= bits - 1) {
+                size_t k = j + __builtin_ctzll(bits);
+                unsigned d = AP_CharPixelRgb_distance(old[k], new[k]);
+                unsigned e = error[k] + d;
+                if (d < buf->threshold && e < buf->errorLimit) {
+                    error[k] = e;
+                    mask &= ~((uint64_t)1 << (k - j));
+                    AP_bitset_set(stale, i);
+                    continue;
+                }
+                error[k] = 0;
             }
+            masks[i * words + j / 64] = mask;
+        }
+    }
 
-            size_t index = i * buf->width + j;
-            if (buf->oldBuffer[index] == buf->buffer[index]) {
-                continue;
+    // A cut or a flash changes most cells, and sending every cell in order
+    // can then take fewer bytes than moving the cursor around the ones
+    // that stayed. Only estimated when at least a quarter changed
+    bool repaint = false;
+    if (!buf->redraw) {
+        size_t changed = 0;
+        for (size_t k = 0; k < rows * words; k++) {
+            changed += __builtin_popcountll(masks[k]);
+        }
+        if (changed >= rows * cols / 4) {
+            size_t all = AP_BufferRgb_estimate(buf, NULL, words, rows, cols);
+            repaint = all < AP_BufferRgb_estimate(buf, masks, words, rows, cols) &&
+                (!buf->budget || all <= buf->budget);
+        }
+    }
+    if (repaint) {
+        AP_fillMasks(masks, words, rows, cols);
+        memset(stale, 0, AP_bitsetWords(rows) * sizeof(*stale));
+        for (size_t i = 0; i < rows; i++) {
+            if (buf->error) {
+                memset(buf->error + i * buf->width, 0,
+                    cols * sizeof(*buf->error));
+            }
+            if (buf->age) {
+                memset(buf->age + i * buf->width, 0, cols * sizeof(*buf->age));
             }
-            resize();
-            data[len++] = AP_DrawCommand(MOVE, { i, j });
-            resize();
-            data[len++] = AP_DrawCommand(DRAWRGB, buf->buffer[index]);
         }
+        buf->repaints++;
+    } else if (buf->budget && !buf->redraw) {
+        AP_BufferRgb_limitToBudget(buf, masks, words, rows, stale);
     }
 
+    size_t cursorY = 0, cursorX = 0;
+    data[len++] = AP_DrawCommand(MOVE, { 0, 0 });
+    for (size_t m = 0; m < moved; m++) {
+        resize();
+        data[len++] = motion[m];
+        cursorY = SIZE_MAX;
+    }
+    free(motion);
+    for (size_t i = 0; i < rows; i++) {
+        AP_CharPixelRgb* old = buf->oldBuffer + i * buf->width;
+        AP_CharPixelRgb* new = buf->buffer + i * buf->width;
+        for (size_t w = 0; w < words; w++) {
+            size_t j = w * 64;
+            size_t start, runLen;
+            AP_forEachRun(masks[i * words + w], start, runLen) {
+                if (cursorY != i || cursorX != j + start) {
+                    resize();
+                    data[len++] = AP_DrawCommand(MOVE, { i, j + start });
+                }
+                for (size_t k = j + start; k < j + start + runLen; k++) {
+                    resize();
+                    data[len++] = AP_DrawCommand(DRAWRGB, new[k]);
+                    old[k] = new[k];
+                }
+                cursorY = i;
+                cursorX = j + start + runLen;
+            }
+        }
+    }
+
+    // visible rows are clean unless some of their cells were held back
+    bool pending = false;
+    for (size_t w = 0; w < AP_bitsetWords(rows); w++) {
+        buf->dirtyRows[w] &= ~AP_lowBits(rows - w * 64);
+        buf->dirtyRows[w] |= stale[w];
+        pending = pending || stale[w];
+    }
+    buf->updated = pending;
+    free(masks);
+    free(stale);
+
+    resize();
     data[len] = AP_DrawCommand(END, 0);
     return data;
 
@@ -504,17 +2272,21 @@ static AP_DrawCommand* AP_DrawCommand_compileCommandRgb(AP_BufferRgb* buf) {
 }
 
 // Rules:
-// 1. Consecutive draws on the same line remove MOVE
+// 1. Remove a MOVE to where the draws before it left the cursor, and use
+//    NL for one to the start of the next row
 // 2. Replace DRAW with PRINT if same color
+// 3. Only set the grey of DRAWTEXT when it changes
+// 4. Forget the colours and cursor position after scrolling and shifting
 // 
 // TODO: More rules?
 // FIXME: Is this really useful? Benchmarks shows seems not that useful
 static AP_DrawCommand* AP_DrawCommand_optimizeCommand(
     AP_DrawCommand* commands)
 {
+    // where the cursor is, y is SIZE_MAX while that is not known
     struct Pos {
         size_t y, x;
-    } lastMovPos = { 0, 0 };
+    } cursor = { SIZE_MAX, SIZE_MAX };
     struct LastCharPixel {
         bool init;
         AP_CharPixel color;
@@ -523,48 +2295,83 @@ static AP_DrawCommand* AP_DrawCommand_optimizeCommand(
         bool init;
         AP_CharPixelRgb color;
     } lastCharPixelRgb = { .init = false };
+    struct LastGrey {
+        bool init;
+        AP_Color color;
+    } lastGrey = { .init = false };
 
     for (AP_DrawCommand* c = commands; c->type != END; c++) {
+        // every draw leaves the cursor on the next cell
+        if (c->type == DRAW || c->type == DRAWRGB || c->type == DRAWTEXT ||
+            c->type == PRINT)
+        {
+            cursor.x++;
+        }
         switch (c->type) {
             case MOVE: {
-                if (c->MOVE.y == lastMovPos.y &&
-                    c->MOVE.x == lastMovPos.x + 1)
-                {
-                    lastMovPos = *(struct Pos*)&c->MOVE;
+                struct Pos to = { c->MOVE.y, c->MOVE.x };
+                if (to.y == cursor.y && to.x == cursor.x) {
                     *c = AP_DrawCommand(SKIP, 0);
-                    break;
-                }
-                if (c->MOVE.x == 0 && c->MOVE.y - lastMovPos.y == 1) {
-                    lastMovPos = *(struct Pos*)&c->MOVE;
+                } else if (to.x == 0 && cursor.y != SIZE_MAX &&
+                    to.y == cursor.y + 1)
+                {
                     *c = AP_DrawCommand(NL, 0);
-                    break;
                 }
+                cursor = to;
                 break;
             }
             case DRAW: {
                 if (!lastCharPixel.init) {
                     lastCharPixel.color = c->DRAW;
-                    lastCharPixelRgb.init = true;
+                    lastCharPixel.init = true;
                     break;
                 }
                 if (lastCharPixel.color == c->DRAW) {
-                    *c = AP_DrawCommand(PRINT, 0);
+                    *c = AP_DrawCommand(PRINT, AP_GLYPH_HALF);
                     break;
                 }
                 lastCharPixel.color = c->DRAW;
                 break;
             }
             case DRAWRGB: {
+                // only the colours have to match, PRINT keeps the glyph
+                AP_CharPixelRgb color = c->DRAWRGB;
+                AP_CharPixelRgb_glyph(color) = 0;
                 if (!lastCharPixelRgb.init) {
-                    lastCharPixelRgb.color = c->DRAWRGB;
+                    lastCharPixelRgb.color = color;
                     lastCharPixelRgb.init = true;
                     break;
                 }
-                if (lastCharPixelRgb.color == c->DRAWRGB) {
-                    *c = AP_DrawCommand(PRINT, 0);
+                if (lastCharPixelRgb.color == color) {
+                    *c = AP_DrawCommand(
+                        PRINT, AP_CharPixelRgb_glyph(c->DRAWRGB));
+                    break;
+                }
+                lastCharPixelRgb.color = color;
+                break;
+            }
+            case DRAWTEXT: {
+                // blanks don't need a colour
+                AP_Color grey = AP_CharPixel_data(c->DRAWTEXT.cell)[1];
+                if (!grey || AP_TEXT_BLANK(c->DRAWTEXT.cell) ||
+                    (lastGrey.init && lastGrey.color == grey))
+                {
+                    c->DRAWTEXT.setColor = false;
                     break;
                 }
-                lastCharPixelRgb.color = c->DRAWRGB;
+                lastGrey.color = grey;
+                lastGrey.init = true;
+                break;
+            }
+            case BLANK: {
+                lastCharPixel.init = false;
+                lastCharPixelRgb.init = false;
+                lastGrey.init = false;
+                break;
+            }
+            case SCROLL:
+            case SHIFT: {
+                cursor = (struct Pos){ SIZE_MAX, SIZE_MAX };
                 break;
             }
             default:
@@ -574,46 +2381,134 @@ static AP_DrawCommand* AP_DrawCommand_optimizeCommand(
     return commands;
 }
 
+void AP_Buffer_syncScreen(struct AP_Buffer* buf, struct AP_BufferRgb* src) {
+    AP_Buffer* b = AP_Buffer(buf);
+    AP_BufferRgb* s = AP_BufferRgb(src);
+    size_t rows = b->height/2 + b->height%2;
+    for (size_t i = 0; i < rows * b->width; i++) {
+        // the screen keeps the exact colour, which is at least as close
+        AP_CharPixelRgb c = s->oldBuffer[i];
+        b->oldBuffer[i] = AP_CharPixel(AP_rgbTo256(AP_CharPixelRgb_fg(c)),
+            AP_rgbTo256(AP_CharPixelRgb_bg(c)));
+        // half blocks can't take over the sub-pixels of other glyphs
+        if (AP_CharPixelRgb_glyph(s->oldBuffer[i]) > AP_GLYPH_HALF) {
+            b->redraw = true;
+        }
+    }
+    AP_bitset_fill(b->dirtyRows, rows);
+    b->updated = true;
+}
+
+void AP_BufferRgb_syncScreen(struct AP_BufferRgb* buf, struct AP_Buffer* src) {
+    AP_BufferRgb* b = AP_BufferRgb(buf);
+    AP_Buffer* s = AP_Buffer(src);
+    size_t rows = b->height/2 + b->height%2;
+    for (size_t i = 0; i < rows * b->width; i++) {
+        AP_Color* c = AP_CharPixel_data(s->oldBuffer[i]);
+        b->oldBuffer[i] = AP_CharPixelRgb(AP_256ToRgb(c[0]), AP_256ToRgb(c[1]));
+    }
+    AP_bitset_fill(b->dirtyRows, rows);
+    b->updated = true;
+}
+
 void AP_clearScreen(struct AP_Buffer* buf) {
     char sequence[5];
-    AP_DrawCommand_ansiSequence(&AP_DrawCommand(CLEAR, 0), sequence, 5);
-    flushprint(sequence, sizeof(sequence));
+    char* end = AP_DrawCommand_ansiSequence(
+        &AP_DrawCommand(CLEAR, 0), sequence, 5);
+    flushprint(sequence, end - sequence);
 
     if (!buf) { return; }
 
     AP_Buffer* b = AP_Buffer(buf);
     b->updated = true;
-    free(b->oldBuffer);
-    size_t h = b->height;
-    size_t w = b->width;
-    b->oldBuffer = calloc((h/2 + h%2)*w, sizeof(AP_CharPixel));
+    size_t rows = b->height/2 + b->height%2;
+    memset(b->oldBuffer, 0, rows * b->width * sizeof(AP_CharPixel));
+    AP_bitset_fill(b->dirtyRows, rows);
 }
 
 void AP_clearScreenRgb(struct AP_BufferRgb* buf) {
     char sequence[5];
-    AP_DrawCommand_ansiSequence(&AP_DrawCommand(CLEAR, 0), sequence, 5);
-    flushprint(sequence, sizeof(sequence));
+    char* end = AP_DrawCommand_ansiSequence(
+        &AP_DrawCommand(CLEAR, 0), sequence, 5);
+    flushprint(sequence, end - sequence);
 
     if (!buf) { return; }
 
     AP_BufferRgb* b = AP_BufferRgb(buf);
     b->updated = true;
-    free(b->oldBuffer);
-    size_t h = b->height;
-    size_t w = b->width;
-    b->oldBuffer = calloc((h/2 + h%2)*w, sizeof(AP_CharPixelRgb));
+    size_t rows = b->height/2 + b->height%2;
+    memset(b->oldBuffer, 0, rows * b->width * sizeof(AP_CharPixelRgb));
+    AP_bitset_fill(b->dirtyRows, rows);
+}
+
+void AP_encodeMove(AP_String* out, size_t y, size_t x) {
+    AP_DrawCommand commands[] = {
+        AP_DrawCommand(MOVE, { y, x }),
+        AP_DrawCommand(END, 0),
+    };
+    AP_String_appendCommands(out, commands);
+}
+
+void AP_encodeClear(AP_String* out) {
+    AP_DrawCommand commands[] = {
+        AP_DrawCommand(CLEAR, 0),
+        AP_DrawCommand(END, 0),
+    };
+    AP_String_appendCommands(out, commands);
+}
+
+void AP_encodeResetColor(AP_String* out) {
+    AP_DrawCommand commands[] = {
+        AP_DrawCommand(RESETCOLOR, 0),
+        AP_DrawCommand(END, 0),
+    };
+    AP_String_appendCommands(out, commands);
+}
+
+// one OSC 4 for all the entries that changed since the last draw
+static void AP_Buffer_appendPalette(AP_Buffer* buf, AP_String* out) {
+    bool first = true;
+    for (int i = 0; i < 256; i++) {
+        if (!AP_bitset_get(buf->paletteSend, i)) {
+            continue;
+        }
+        AP_ColorRgb c = buf->palette[i];
+        uint8_t channels[3] = {
+            AP_ColorRgb_r(c), AP_ColorRgb_g(c), AP_ColorRgb_b(c),
+        };
+        char entry[32];
+        int len = snprintf(entry, sizeof(entry), "%s;%d;rgb:",
+            first ? "\e]4" : "", i);
+        for (int k = 0; k < 3; k++) {
+            entry[len++] = "0123456789abcdef"[channels[k] >> 4];
+            entry[len++] = "0123456789abcdef"[channels[k] & 15];
+            entry[len++] = '/';
+        }
+        AP_String_append(out, entry, len - 1);
+        first = false;
+    }
+    if (!first) {
+        AP_String_append(out, "\e\\", 2);
+    }
+    memset(buf->paletteSend, 0, sizeof(buf->paletteSend));
+}
+
+void AP_encodeResetPalette(AP_String* out) {
+    AP_String_append(out, "\e]104\e\\", 7);
 }
 
 void AP_resettextcolor() {
     char sequence[5];
-    AP_DrawCommand_ansiSequence(&AP_DrawCommand(RESETCOLOR, 0), sequence, 5);
-    flushprint(sequence, sizeof(sequence));
+    char* end = AP_DrawCommand_ansiSequence(
+        &AP_DrawCommand(RESETCOLOR, 0), sequence, 5);
+    flushprint(sequence, end - sequence);
 }
 
 void AP_showcursor(bool show) {
     char sequence[7];
-    AP_DrawCommand_ansiSequence(&AP_DrawCommand(SHOWCURSOR, show), sequence, 7);
-    flushprint(sequence, sizeof(sequence));
+    char* end = AP_DrawCommand_ansiSequence(
+        &AP_DrawCommand(SHOWCURSOR, show), sequence, 7);
+    flushprint(sequence, end - sequence);
 }
 
 void AP_move(size_t y, size_t x) {
@@ -621,8 +2516,9 @@ void AP_move(size_t y, size_t x) {
         size_t_digits(y + 1) + 1 +
         size_t_digits(x + 1) + 1;
     char sequence[len];
-    AP_DrawCommand_ansiSequence(&AP_DrawCommand(MOVE, { y, x }), sequence, len);
-    flushprint(sequence, sizeof(sequence));
+    char* end = AP_DrawCommand_ansiSequence(
+        &AP_DrawCommand(MOVE, { y, x }), sequence, len);
+    flushprint(sequence, end - sequence);
 }
 
 // algorithm from tmux
@@ -638,6 +2534,32 @@ static int colour_to_6cube(int v) {
     return ((v - 35) / 40);
 }
 
+AP_ColorRgb AP_256ToRgb(AP_Color color) {
+    // xterm default palette
+    static const uint8_t system[16][3] = {
+        { 0x00, 0x00, 0x00 }, { 0xcd, 0x00, 0x00 },
+        { 0x00, 0xcd, 0x00 }, { 0xcd, 0xcd, 0x00 },
+        { 0x00, 0x00, 0xee }, { 0xcd, 0x00, 0xcd },
+        { 0x00, 0xcd, 0xcd }, { 0xe5, 0xe5, 0xe5 },
+        { 0x7f, 0x7f, 0x7f }, { 0xff, 0x00, 0x00 },
+        { 0x00, 0xff, 0x00 }, { 0xff, 0xff, 0x00 },
+        { 0x5c, 0x5c, 0xff }, { 0xff, 0x00, 0xff },
+        { 0x00, 0xff, 0xff }, { 0xff, 0xff, 0xff },
+    };
+    static const int q2c[6] = { 0x00, 0x5f, 0x87, 0xaf, 0xd7, 0xff };
+
+    if (color < 16) {
+        return AP_ColorRgb(
+            system[color][0], system[color][1], system[color][2]);
+    }
+    if (color >= 232) {
+        uint8_t grey = 8 + 10 * (color - 232);
+        return AP_ColorRgb(grey, grey, grey);
+    }
+    color -= 16;
+    return AP_ColorRgb(q2c[color / 36], q2c[color / 6 % 6], q2c[color % 6]);
+}
+
 AP_Color AP_rgbTo256(AP_ColorRgb rgb) {
     uint8_t r = AP_ColorRgb_r(rgb);
     uint8_t g = AP_ColorRgb_g(rgb);
@@ -4,6 +4,15 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// growable byte string that frames are encoded into
+typedef struct {
+    char* data;
+    size_t len, capacity;
+} AP_String;
+void AP_String_reserve(AP_String* s, size_t extra);
+void AP_String_append(AP_String* s, const char* data, size_t len);
+void AP_String_del(AP_String* s); // frees data, not s itself
+
 struct AP_Buffer;
 typedef uint8_t AP_Color;
 
@@ -12,7 +21,37 @@ void AP_Buffer_del(struct AP_Buffer* buf);
 AP_Color AP_Buffer_getPixel(struct AP_Buffer* buf, size_t y, size_t x);
 void AP_Buffer_setPixel(
     struct AP_Buffer* buf, size_t y, size_t x, AP_Color color);
-void AP_Buffer_draw(struct AP_Buffer* buf);
+// copy a h*w block of pixels from src, whose rows are stride pixels apart,
+// to the pixel rectangle starting at (y, x). Pixels outside are clipped
+void AP_Buffer_blit(
+    struct AP_Buffer* buf, const AP_Color* src, size_t stride,
+    size_t y, size_t x, size_t h, size_t w);
+// Changed cells whose colour is closer than threshold (perceptual distance,
+// 0 to about 800) to what is on screen are not redrawn until the distance
+// accumulated over frames reaches errorLimit. 0 disables it
+void AP_Buffer_setThreshold(
+    struct AP_Buffer* buf, unsigned threshold, unsigned errorLimit);
+// Limit a draw to about bytes by sending the most visible changes first.
+// The rest is carried over to later draws. 0 disables it. Full redraws
+// are not limited
+void AP_Buffer_setBudget(struct AP_Buffer* buf, size_t bytes);
+// Before diffing, find content that moved up, down or sideways and move
+// it on screen with scroll margins and character insertion and deletion
+// instead of redrawing it. Cells that come in are black
+void AP_Buffer_setMotion(struct AP_Buffer* buf, bool motion);
+// Draws that sent every cell in view instead of the changed ones, because
+// after a cut or a flash that takes fewer bytes than moving the cursor
+// around the cells that stayed
+size_t AP_Buffer_repaints(struct AP_Buffer* buf);
+// Whether the next draw has anything to send: cells changed since the last
+// draw, cells held back by a threshold or the budget, or a refresh
+bool AP_Buffer_pending(struct AP_Buffer* buf);
+void AP_Buffer_refresh(struct AP_Buffer* buf); // redraw every cell on next draw
+// append the sequences that bring the screen up to date to out, and
+// return the number of bytes appended
+size_t AP_Buffer_encode(struct AP_Buffer* buf, AP_String* out);
+// returns number of bytes written to the terminal
+size_t AP_Buffer_draw(struct AP_Buffer* buf);
 
 struct AP_BufferRgb;
 typedef uint32_t AP_ColorRgb;
@@ -26,12 +65,81 @@ void AP_BufferRgb_del(struct AP_BufferRgb* buf);
 AP_ColorRgb AP_BufferRgb_getPixel(struct AP_BufferRgb* buf, size_t y, size_t x);
 void AP_BufferRgb_setPixel(
     struct AP_BufferRgb* buf, size_t y, size_t x, AP_ColorRgb color);
-void AP_BufferRgb_draw(struct AP_BufferRgb* buf);
+void AP_BufferRgb_blit(
+    struct AP_BufferRgb* buf, const AP_ColorRgb* src, size_t stride,
+    size_t y, size_t x, size_t h, size_t w);
+void AP_BufferRgb_setThreshold(
+    struct AP_BufferRgb* buf, unsigned threshold, unsigned errorLimit);
+void AP_BufferRgb_setBudget(struct AP_BufferRgb* buf, size_t bytes);
+void AP_BufferRgb_setMotion(struct AP_BufferRgb* buf, bool motion);
+size_t AP_BufferRgb_repaints(struct AP_BufferRgb* buf);
+bool AP_BufferRgb_pending(struct AP_BufferRgb* buf);
+void AP_BufferRgb_refresh(struct AP_BufferRgb* buf);
+size_t AP_BufferRgb_encode(struct AP_BufferRgb* buf, AP_String* out);
+size_t AP_BufferRgb_draw(struct AP_BufferRgb* buf);
+
+// Block glyphs that split a text cell into 2 columns of sub-pixels, the
+// value is the number of sub-pixel rows
+typedef enum {
+    AP_GLYPHS_QUADRANT = 2, // 2x2, U+2596 to U+259F
+    AP_GLYPHS_SEXTANT = 3, // 2x3, U+1FB00 to U+1FB3B
+} AP_Glyphs;
+// Fit every text cell in the rows*cols rectangle starting at cell (row, col)
+// with the glyph and two colours closest to its sub-pixels. src has
+// rows*glyphs pixel rows of 2*cols pixels, rows are stride pixels apart
+void AP_BufferRgb_blitBlocks(
+    struct AP_BufferRgb* buf, AP_Glyphs glyphs, const AP_ColorRgb* src,
+    size_t stride, size_t row, size_t col, size_t rows, size_t cols);
+
+// Text modes draw cells as characters picked by luminance instead of
+// coloured half blocks, which needs a fraction of the bytes
+typedef enum {
+    AP_TEXT_NONE,
+    AP_TEXT_RAMP, // one of " .:-=+*#%@" for 1x2 pixels
+    AP_TEXT_BRAILLE, // braille dots for 2x4 pixels
+} AP_Text;
+#define AP_Text_width(t) ((t) == AP_TEXT_BRAILLE ? 2 : 1)
+#define AP_Text_height(t) ((t) == AP_TEXT_BRAILLE ? 4 : 2)
+// Switch buf to a text mode, which redraws everything on the next draw.
+// Characters get no colour sequences when greys is 0, otherwise one of
+// greys levels of grey (2 to 24) as their foreground colour
+void AP_Buffer_setText(struct AP_Buffer* buf, AP_Text text, int greys);
+// Fill the rows*cols cells starting at cell (row, col) of a buffer in a
+// text mode. src has AP_Text_height rows by AP_Text_width pixels per cell,
+// rows are stride pixels apart
+void AP_Buffer_blitText(
+    struct AP_Buffer* buf, const AP_ColorRgb* src, size_t stride,
+    size_t row, size_t col, size_t rows, size_t cols);
+
+// same as AP_Buffer_blit but converts with AP_rgbTo256 while copying
+void AP_Buffer_blitRgb(
+    struct AP_Buffer* buf, const AP_ColorRgb* src, size_t stride,
+    size_t y, size_t x, size_t h, size_t w);
+// Ordered dithering for AP_Buffer_blitRgb, with a pattern fixed to the
+// screen so that pixels that don't change keep their colour
+void AP_Buffer_setDither(struct AP_Buffer* buf, bool dither);
+// Redefine the colours of the n indices from first with OSC 4 on the next
+// draw. Cells keep their index, so cells on screen take the new colour
+// with it. Thresholds measure distances with the new colours
+void AP_Buffer_setPalette(
+    struct AP_Buffer* buf, const AP_ColorRgb* colors, int first, int n);
+
+// Take over what src has put on the screen, so that drawing can switch
+// between a 256 color and a truecolor buffer without a full redraw
+void AP_Buffer_syncScreen(struct AP_Buffer* buf, struct AP_BufferRgb* src);
+void AP_BufferRgb_syncScreen(struct AP_BufferRgb* buf, struct AP_Buffer* src);
 
 void AP_clearScreen(struct AP_Buffer* buf); // buf can be NULL
 void AP_clearScreenRgb(struct AP_BufferRgb* buf); // buf can be NULL
 void AP_resettextcolor();
 void AP_showcursor(bool show);
 void AP_move(size_t y, size_t x); // move to real text coordinate
+void AP_encodeMove(AP_String* out, size_t y, size_t x);
+void AP_encodeResetColor(AP_String* out);
+// clear the whole screen (CSI 2J)
+void AP_encodeClear(AP_String* out);
+// give every index its default colour again (OSC 104)
+void AP_encodeResetPalette(AP_String* out);
 
 AP_Color AP_rgbTo256(AP_ColorRgb rgb);
+AP_ColorRgb AP_256ToRgb(AP_Color color);
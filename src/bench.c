@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include "bench.h"
+#include "options.h"
+#include "sixel.h"
+
+void BN_run(
+    AP_ColorRgb** frames,
+    size_t height,
+    size_t width,
+    AP_ColorRgb** images,
+    size_t imageHeight,
+    size_t imageWidth)
+{
+    enum {
+        HALF_256, HALF_DITHERED, HALF_RGB,
+        SIXEL_FRAME_PALETTE, SIXEL_STABLE_PALETTE,
+    };
+    struct {
+        const char* name;
+        size_t bytes;
+        uint64_t us;
+    } modes[] = {
+        [HALF_256] = { .name = "half blocks, 256 colors" },
+        [HALF_DITHERED] = { .name = "half blocks, 256 dithered" },
+        [HALF_RGB] = { .name = "half blocks, truecolor" },
+        [SIXEL_FRAME_PALETTE] = { .name = "sixel, palette per frame" },
+        [SIXEL_STABLE_PALETTE] = { .name = "sixel, stable palette" },
+    };
+    // frames are drawn below the status line like in playback
+    struct AP_Buffer* buf = AP_Buffer_new(height + 2, width);
+    struct AP_Buffer* dithered = AP_Buffer_new(height + 2, width);
+    struct AP_BufferRgb* bufRgb = AP_BufferRgb_new(height + 2, width);
+    AP_Buffer_setThreshold(buf, OPTIONS.threshold, OPTIONS.errorLimit);
+    AP_Buffer_setThreshold(dithered, OPTIONS.threshold, OPTIONS.errorLimit);
+    AP_Buffer_setDither(dithered, true);
+    AP_BufferRgb_setThreshold(bufRgb, OPTIONS.threshold, OPTIONS.errorLimit);
+    struct SX_Encoder* sixel = SX_Encoder_new(OPTIONS.sixelColors, false);
+    struct SX_Encoder* stable = SX_Encoder_new(OPTIONS.sixelColors, true);
+
+    AP_String out = { 0 };
+    for (size_t f = 0; f < INFO.nframes; f++) {
+        AP_ColorRgb* frame = frames[f];
+        for (size_t m = 0; m < sizeof(modes) / sizeof(*modes); m++) {
+            out.len = 0;
+            uint64_t start = nowInUs();
+            switch (m) {
+                case HALF_256:
+                case HALF_DITHERED: {
+                    struct AP_Buffer* b = m == HALF_256 ? buf : dithered;
+                    AP_Buffer_blitRgb(b, frame, width, 2, 0, height, width);
+                    AP_Buffer_encode(b, &out);
+                    break;
+                }
+                case HALF_RGB:
+                    AP_BufferRgb_blit(
+                        bufRgb, frame, width, 2, 0, height, width);
+                    AP_BufferRgb_encode(bufRgb, &out);
+                    break;
+                case SIXEL_FRAME_PALETTE:
+                case SIXEL_STABLE_PALETTE:
+                    SX_Encoder_encode(m == SIXEL_FRAME_PALETTE ? sixel : stable,
+                        images[f], imageWidth, imageHeight, imageWidth,
+                        1, 0, &out);
+                    break;
+            }
+            modes[m].us += nowInUs() - start;
+            modes[m].bytes += out.len;
+        }
+    }
+
+    printf("Encoded %zu frames, %zux%zu cells, sixel images %zux%zu, "
+        "%d colors\n", INFO.nframes, width, height / 2,
+        imageWidth, imageHeight, OPTIONS.sixelColors);
+    printf("%-26s %14s %14s\n", "", "bytes/frame", "encode ms");
+    for (size_t m = 0; m < sizeof(modes) / sizeof(*modes); m++) {
+        printf("%-26s %14.1f %14.3f\n", modes[m].name,
+            INFO.nframes ? (double)modes[m].bytes / INFO.nframes : 0.0,
+            INFO.nframes ? modes[m].us / 1000.0 / INFO.nframes : 0.0);
+    }
+    printf("Stable palettes built: %zu\n", SX_Encoder_palettes(stable));
+
+    AP_String_del(&out);
+    SX_Encoder_del(sixel);
+    SX_Encoder_del(stable);
+    AP_BufferRgb_del(bufRgb);
+    AP_Buffer_del(dithered);
+    AP_Buffer_del(buf);
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+#include "ansipixel.h"
+
+// Encodes every frame like playback would, without a terminal or timing,
+// once with each of the backends that draw a whole frame, and prints their
+// bytes and encode time per frame. frames are height by width pixels,
+// images imageHeight by imageWidth for sixel
+void BN_run(
+    AP_ColorRgb** frames, size_t height, size_t width,
+    AP_ColorRgb** images, size_t imageHeight, size_t imageWidth);
@@ -0,0 +1,186 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "events.h"
+
+// what the epoll data of each fd says
+enum { EV_SOURCE_TIMER, EV_SOURCE_INPUT, EV_SOURCE_RESIZE, EV_SOURCE_WATCH };
+
+// input is -1 when it is not a terminal. keys holds bytes read but not
+// decoded yet
+typedef struct {
+    int epoll;
+    int timer;
+    int resize;
+    int input;
+    int watch;
+    struct termios saved;
+    unsigned char keys[64];
+    size_t keysStart, keysLen;
+} EV_Loop;
+#define EV_Loop(l) ((EV_Loop*)(l))
+
+// the terminal settings to restore from a signal handler, input is -1
+// when none were changed
+static struct termios EV_savedTerminal;
+static volatile int EV_savedInput = -1;
+
+void EV_blockResize(void) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGWINCH);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+static void EV_Loop_add(EV_Loop* l, int fd, uint32_t source) {
+    struct epoll_event e = { .events = EPOLLIN, .data.u32 = source };
+    epoll_ctl(l->epoll, EPOLL_CTL_ADD, fd, &e);
+}
+
+struct EV_Loop* EV_Loop_new(int input) {
+    EV_Loop* l = calloc(1, sizeof(*l));
+    l->epoll = epoll_create1(EPOLL_CLOEXEC);
+    l->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    EV_Loop_add(l, l->timer, EV_SOURCE_TIMER);
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGWINCH);
+    l->resize = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    EV_Loop_add(l, l->resize, EV_SOURCE_RESIZE);
+
+    l->input = -1;
+    if (isatty(input) && tcgetattr(input, &l->saved) == 0) {
+        struct termios raw = l->saved;
+        raw.c_lflag &= ~(ICANON | ECHO);
+        raw.c_cc[VMIN] = 0;
+        raw.c_cc[VTIME] = 0;
+        EV_savedTerminal = l->saved;
+        EV_savedInput = input;
+        tcsetattr(input, TCSANOW, &raw);
+        l->input = input;
+        EV_Loop_add(l, input, EV_SOURCE_INPUT);
+    }
+    return (struct EV_Loop*)l;
+}
+
+void EV_Loop_del(struct EV_Loop* loop) {
+    EV_Loop* l = EV_Loop(loop);
+    if (l->input != -1) {
+        EV_savedInput = -1;
+        tcsetattr(l->input, TCSANOW, &l->saved);
+    }
+    close(l->resize);
+    close(l->timer);
+    close(l->epoll);
+    free(l);
+}
+
+void EV_restoreTerminal(void) {
+    if (EV_savedInput != -1) {
+        tcsetattr(EV_savedInput, TCSANOW, &EV_savedTerminal);
+    }
+}
+
+void EV_Loop_watch(struct EV_Loop* loop, int fd) {
+    EV_Loop(loop)->watch = fd;
+    EV_Loop_add(EV_Loop(loop), fd, EV_SOURCE_WATCH);
+}
+
+void EV_Loop_setTimer(struct EV_Loop* loop, uint64_t us) {
+    // a zero it_value disarms the timer, so an absolute time of 0 can't
+    // be set and means the same
+    struct itimerspec t = {
+        .it_value = { us / 1000000, us % 1000000 * 1000 },
+    };
+    timerfd_settime(EV_Loop(loop)->timer, TFD_TIMER_ABSTIME, &t, NULL);
+}
+
+// Decodes the next key of l->keys into key. Arrows come as CSI or SS3
+// sequences, other escape sequences, like late answers to terminal
+// queries, are skipped
+static bool EV_Loop_nextKey(EV_Loop* l, int* key) {
+    while (l->keysLen) {
+        const unsigned char* k = l->keys + l->keysStart;
+        size_t n = l->keysLen;
+        size_t used = 1;
+        *key = k[0];
+        if (k[0] == '\e' && n > 1 && (k[1] == '[' || k[1] == 'O')) {
+            // parameters and intermediates up to the final byte
+            used = 2;
+            while (used < n && (k[used] < 0x40 || k[used] > 0x7e)) {
+                used++;
+            }
+            int final = used < n ? k[used++] : 0;
+            *key = used == 3 && final == 'A' ? EV_KEY_UP :
+                used == 3 && final == 'B' ? EV_KEY_DOWN :
+                used == 3 && final == 'C' ? EV_KEY_RIGHT :
+                used == 3 && final == 'D' ? EV_KEY_LEFT :
+                -1;
+        }
+        l->keysStart += used;
+        l->keysLen -= used;
+        if (*key != -1) {
+            return true;
+        }
+    }
+    return false;
+}
+
+EV_Event EV_Loop_wait(struct EV_Loop* loop) {
+    EV_Loop* l = EV_Loop(loop);
+    for (;;) {
+        int key;
+        if (EV_Loop_nextKey(l, &key)) {
+            return (EV_Event){ .type = EV_KEY, .key = key };
+        }
+
+        struct epoll_event e;
+        int n = epoll_wait(l->epoll, &e, 1, -1);
+        if (n == -1 && errno != EINTR) {
+            // nothing can be waited for, keep the caller going on its clock
+            return (EV_Event){ .type = EV_TIMER };
+        }
+        if (n != 1) {
+            continue;
+        }
+
+        uint64_t count;
+        struct signalfd_siginfo info;
+        switch (e.data.u32) {
+        case EV_SOURCE_TIMER:
+            if (read(l->timer, &count, sizeof(count)) == sizeof(count)) {
+                return (EV_Event){ .type = EV_TIMER };
+            }
+            break;
+        case EV_SOURCE_RESIZE:
+            if (read(l->resize, &info, sizeof(info)) == sizeof(info)) {
+                return (EV_Event){ .type = EV_RESIZE };
+            }
+            break;
+        case EV_SOURCE_WATCH:
+            if (read(l->watch, &count, sizeof(count)) == sizeof(count)) {
+                return (EV_Event){ .type = EV_READY };
+            }
+            break;
+        case EV_SOURCE_INPUT: {
+            l->keysStart = 0;
+            ssize_t r = read(l->input, l->keys, sizeof(l->keys));
+            if (r > 0) {
+                l->keysLen = r;
+            } else if (e.events & (EPOLLHUP | EPOLLERR)) {
+                // the terminal hung up, stop reading it
+                epoll_ctl(l->epoll, EPOLL_CTL_DEL, l->input, NULL);
+            }
+            break;
+        }
+        }
+    }
+}
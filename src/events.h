@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Waits for whatever playback reacts to on one epoll instance: a frame
+// clock (timerfd), keys from the terminal (stdin in raw mode), terminal
+// resizes (SIGWINCH through a signalfd) and a watched eventfd, like the
+// one an OUT_Writer signals when the output drained.
+struct EV_Loop;
+
+typedef enum {
+    EV_TIMER, // the time set with EV_Loop_setTimer has come
+    EV_KEY,
+    EV_RESIZE,
+    EV_READY, // the watched eventfd was signalled
+} EV_Type;
+
+// keys that are not a single byte, after the byte values
+enum {
+    EV_KEY_UP = 256,
+    EV_KEY_DOWN,
+    EV_KEY_RIGHT,
+    EV_KEY_LEFT,
+};
+
+typedef struct {
+    EV_Type type;
+    int key; // byte or EV_KEY_* for EV_KEY
+} EV_Event;
+
+// SIGWINCH has to be blocked in every thread for the signalfd to get it,
+// call before any thread is started
+void EV_blockResize(void);
+
+// Puts input in raw mode (no line buffering or echo, signals still work)
+// and reads keys from it when it is a terminal
+struct EV_Loop* EV_Loop_new(int input);
+// restores the terminal
+void EV_Loop_del(struct EV_Loop* loop);
+// Restores the terminal a loop put in raw mode, from a signal handler
+void EV_restoreTerminal(void);
+// report EV_READY when the eventfd fd is signalled
+void EV_Loop_watch(struct EV_Loop* loop, int fd);
+// Arms the clock for an absolute CLOCK_MONOTONIC time in microseconds, 0
+// disarms it
+void EV_Loop_setTimer(struct EV_Loop* loop, uint64_t us);
+// blocks until the next event
+EV_Event EV_Loop_wait(struct EV_Loop* loop);
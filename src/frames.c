@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "frames.h"
+#include "imageutil.h"
+#include "palette.h"
+
+#define min(x, y) ((x) < (y) ? (x) : (y))
+
+// Pixels of a and b that would be drawn with a different color
+static size_t FR_countDrawnChanges(
+    const AP_ColorRgb* a,
+    const AP_ColorRgb* b,
+    size_t n,
+    bool exact)
+{
+    size_t changed = 0;
+    for (size_t i = 0; i < n; i++) {
+        changed += exact ? a[i] != b[i] :
+            AP_rgbTo256(a[i]) != AP_rgbTo256(b[i]);
+    }
+    return changed;
+}
+
+void FR_denoise(
+    AP_ColorRgb** frames,
+    size_t nframes,
+    size_t pixels,
+    unsigned distance,
+    int colorBits,
+    bool exact,
+    FR_Changes* changes)
+{
+    AP_ColorRgb* average = malloc(pixels * sizeof(*average));
+    AP_ColorRgb* noisy[2] = {
+        malloc(pixels * sizeof(AP_ColorRgb)),
+        malloc(pixels * sizeof(AP_ColorRgb)),
+    };
+    size_t before = 0, after = 0;
+    for (size_t f = 0; f < nframes; f++) {
+        AP_ColorRgb* frame = frames[f];
+        if (changes) {
+            memcpy(noisy[f % 2], frame, pixels * sizeof(*frame));
+            round_color_bits(noisy[f % 2], pixels, colorBits);
+        }
+        if (!f) {
+            memcpy(average, frame, pixels * sizeof(*frame));
+        } else {
+            #pragma omp parallel for
+            for (size_t i = 0; i < pixels; i += 4096) {
+                denoise_temporal(average + i, frame + i, min(4096, pixels - i),
+                    distance);
+            }
+            memcpy(frame, average, pixels * sizeof(*frame));
+        }
+        round_color_bits(frame, pixels, colorBits);
+        if (changes && f) {
+            before += FR_countDrawnChanges(noisy[f % 2], noisy[(f - 1) % 2],
+                pixels, exact);
+            after += FR_countDrawnChanges(frame, frames[f - 1], pixels, exact);
+        }
+    }
+    if (changes && nframes > 1) {
+        changes->noisy = (double)before / (nframes - 1);
+        changes->denoised = (double)after / (nframes - 1);
+    }
+    free(noisy[0]);
+    free(noisy[1]);
+    free(average);
+}
+
+// Rows whose hash matches the row of the frame before are not compared
+bool* FR_findCuts(
+    AP_ColorRgb** frames,
+    size_t nframes,
+    size_t height,
+    size_t width,
+    size_t* cuts)
+{
+    bool* cut = calloc(nframes, sizeof(*cut));
+    uint64_t* hashes = malloc(nframes * height * sizeof(*hashes));
+    #pragma omp parallel for
+    for (size_t f = 0; f < nframes; f++) {
+        hash_rows(frames[f], height, width, hashes + f * height);
+    }
+
+    size_t total = 0;
+    #pragma omp parallel for reduction(+:total)
+    for (size_t f = 0; f < nframes; f++) {
+        size_t changed = 0;
+        for (size_t i = 0; f && i < height; i++) {
+            if (hashes[f * height + i] != hashes[(f - 1) * height + i]) {
+                changed += count_changed(frames[f] + i * width,
+                    frames[f - 1] + i * width, width, FR_CUT_DISTANCE);
+            }
+        }
+        cut[f] = !f || changed >= FR_CUT_CHANGED * height * width;
+        total += cut[f];
+    }
+    free(hashes);
+    *cuts = total;
+    return cut;
+}
+
+// Frames are looked up by a hash of their pixels in an open addressing
+// table of frame indices
+size_t FR_dedup(
+    AP_ColorRgb*** lists,
+    const size_t* pixels,
+    size_t nlists,
+    size_t nframes,
+    size_t* bytes)
+{
+    uint64_t* hashes = malloc(nframes * sizeof(*hashes));
+    #pragma omp parallel for
+    for (size_t f = 0; f < nframes; f++) {
+        uint64_t hash = 0;
+        for (size_t l = 0; l < nlists; l++) {
+            if (lists[l]) {
+                uint64_t h;
+                hash_rows(lists[l][f], 1, pixels[l], &h);
+                hash = (hash ^ h) * 0x100000001b3;
+            }
+        }
+        hashes[f] = hash;
+    }
+
+    size_t size = 1;
+    while (size < 2 * nframes) {
+        size *= 2;
+    }
+    size_t* table = calloc(size, sizeof(*table)); // frame index + 1
+    size_t unique = 0;
+    for (size_t f = 0; f < nframes; f++) {
+        size_t slot = hashes[f] & (size - 1);
+        for (; table[slot]; slot = (slot + 1) & (size - 1)) {
+            size_t g = table[slot] - 1;
+            bool equal = hashes[g] == hashes[f];
+            for (size_t l = 0; equal && l < nlists; l++) {
+                equal = !lists[l] || !memcmp(lists[l][g], lists[l][f],
+                    pixels[l] * sizeof(AP_ColorRgb));
+            }
+            if (equal) {
+                break;
+            }
+        }
+        if (!table[slot]) {
+            table[slot] = f + 1;
+            unique++;
+            continue;
+        }
+        size_t g = table[slot] - 1;
+        for (size_t l = 0; l < nlists; l++) {
+            if (lists[l]) {
+                free(lists[l][f]);
+                lists[l][f] = lists[l][g];
+                *bytes += pixels[l] * sizeof(AP_ColorRgb);
+            }
+        }
+    }
+    free(table);
+    free(hashes);
+    return unique;
+}
+
+// Scenes end where the palette of their first frame stops fitting. The
+// palette of a scene is built from the colors of all its frames with median
+// cut, and pixels are mapped to it through the histogram bin table. Frames
+// that share their pixels after FR_dedup share their indexed pixels as well
+// when they are in the same scene, looked up by pixel pointer in an open
+// addressing table of frame indices
+FR_Scenes FR_quantizeScenes(
+    AP_ColorRgb** frames,
+    size_t nframes,
+    size_t height,
+    size_t width,
+    const bool* cuts)
+{
+    size_t pixels = height * width;
+    struct PL_Palette* palette = PL_Palette_new(FR_SCENE_COLORS);
+    FR_Scenes s = {
+        .indexed = calloc(nframes, sizeof(*s.indexed)),
+        .scenes = calloc(nframes, sizeof(*s.scenes)),
+    };
+
+    double fit = 0;
+    for (size_t f = 0; f < nframes; f++) {
+        PL_Palette_clear(palette);
+        PL_Palette_add(palette, frames[f], width, height, width);
+        if (cuts[f] ||
+            PL_Palette_fit(palette) > fit * FR_SCENE_FACTOR + FR_SCENE_SLACK)
+        {
+            PL_Palette_build(palette);
+            fit = PL_Palette_fit(palette);
+            s.count++;
+        }
+        s.scenes[f] = s.count - 1;
+    }
+
+    // source[f] is the frame whose indexed pixels f uses, f itself when
+    // they are its own. copies[f] counts the frames that use them
+    size_t* source = malloc(nframes * sizeof(*source));
+    size_t* copies = calloc(nframes, sizeof(*copies));
+    size_t size = 1;
+    while (size < 2 * nframes) {
+        size *= 2;
+    }
+    size_t* table = calloc(size, sizeof(*table)); // frame index + 1
+    for (size_t f = 0; f < nframes; f++) {
+        size_t slot = (uintptr_t)frames[f] * 0x9e3779b97f4a7c15 >> 32 &
+            (size - 1);
+        while (table[slot] && frames[table[slot] - 1] != frames[f]) {
+            slot = (slot + 1) & (size - 1);
+        }
+        // the latest frame with these pixels, a new scene quantizes anew
+        size_t g = table[slot] - 1;
+        if (table[slot] && s.scenes[g] == s.scenes[f]) {
+            source[f] = g;
+        } else {
+            table[slot] = f + 1;
+            source[f] = f;
+        }
+        copies[source[f]]++;
+    }
+    free(table);
+
+    s.palettes = calloc(s.count * FR_SCENE_COLORS, sizeof(*s.palettes));
+    double error = 0, xtermError = 0;
+    for (size_t first = 0, last; first < nframes; first = last) {
+        size_t scene = s.scenes[first];
+        PL_Palette_clear(palette);
+        for (last = first; last < nframes && s.scenes[last] == scene; last++) {
+            PL_Palette_add(palette, frames[last], width, height, width);
+        }
+        PL_Palette_build(palette);
+        // maps every bin of the scene, the table is only read from here on
+        PL_Palette_fit(palette);
+        AP_ColorRgb* colors = s.palettes + scene * FR_SCENE_COLORS;
+        for (int k = 0; k < FR_SCENE_COLORS; k++) {
+            colors[k] = k < PL_Palette_size(palette) ?
+                PL_Palette_color(palette, k) : AP_ColorRgb(0, 0, 0);
+        }
+
+        const uint8_t* bins = PL_Palette_table(palette);
+        #pragma omp parallel for reduction(+:error, xtermError)
+        for (size_t f = first; f < last; f++) {
+            if (source[f] != f) {
+                continue;
+            }
+            s.indexed[f] = malloc(pixels * sizeof(AP_Color));
+            for (size_t i = 0; i < pixels; i++) {
+                AP_ColorRgb c = frames[f][i];
+                int k = bins[PL_bin(c)];
+                s.indexed[f][i] = FR_SCENE_FIRST + k;
+                AP_ColorRgb xterm = AP_256ToRgb(AP_rgbTo256(c));
+                for (int ch = 0; ch < 3; ch++) {
+                    int d = ((uint8_t*)&c)[ch] - ((uint8_t*)&colors[k])[ch];
+                    int x = ((uint8_t*)&c)[ch] - ((uint8_t*)&xterm)[ch];
+                    error += (double)copies[f] * d * d;
+                    xtermError += (double)copies[f] * x * x;
+                }
+            }
+        }
+        for (size_t f = first; f < last; f++) {
+            if (source[f] != f) {
+                s.indexed[f] = s.indexed[source[f]];
+                s.sharedBytes += pixels * sizeof(AP_Color);
+            }
+        }
+    }
+    PL_Palette_del(palette);
+    free(source);
+    free(copies);
+
+    s.error = error / (nframes * pixels);
+    s.xtermError = xtermError / (nframes * pixels);
+    return s;
+}
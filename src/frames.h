@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "ansipixel.h"
+
+// Passes over all of the decoded frames before playback: the temporal
+// denoise, finding scene cuts, sharing the pixels of equal frames and
+// fitting palettes to scenes. Frames are arrays of nframes pointers to
+// their pixels
+
+// A frame is a cut when this much of it changed visibly from the frame
+// before, by at least FR_CUT_DISTANCE summed over the channels of a pixel
+#define FR_CUT_CHANGED 0.5
+#define FR_CUT_DISTANCE 48
+
+// scene palettes redefine the 240 colors after the system colors
+#define FR_SCENE_FIRST 16
+#define FR_SCENE_COLORS 240
+// A frame starts a new scene at a cut, or when the palette of the scene fits
+// it this much worse than the first frame of the scene, like a stable
+// sixel palette
+#define FR_SCENE_FACTOR 1.5
+#define FR_SCENE_SLACK 32
+
+// pixels per frame whose drawn color changed from the frame before
+typedef struct {
+    double noisy, denoised;
+} FR_Changes;
+
+// The palettes of FR_quantizeScenes and the frames as indices into them
+typedef struct {
+    AP_Color** indexed; // frames that share pixels share these as well
+    size_t* scenes; // scene of every frame
+    AP_ColorRgb* palettes; // FR_SCENE_COLORS per scene
+    size_t count;
+    double error, xtermError; // mean squared error per pixel
+    size_t sharedBytes; // of indexed pixels shared by equal frames
+} FR_Scenes;
+
+// Runs denoise_temporal with distance over the frames in order, then rounds
+// their colors to colorBits, which loading leaves to it. With changes, the
+// pixels drawn differently from frame to frame before and after are counted
+// into it, compared exactly or as 256 colors
+void FR_denoise(
+    AP_ColorRgb** frames, size_t nframes, size_t pixels, unsigned distance,
+    int colorBits, bool exact, FR_Changes* changes);
+
+// Marks the frames that start a scene: the first one and those where at
+// least FR_CUT_CHANGED of the pixels changed, counting them into cuts
+bool* FR_findCuts(
+    AP_ColorRgb** frames, size_t nframes, size_t height, size_t width,
+    size_t* cuts);
+
+// Lets frames that are equal to an earlier frame in each of nlists lists of
+// frames share its pixels, and frees theirs. Lists can be NULL, the frames
+// of list l have pixels[l] pixels. Returns the number of unique frames and
+// adds the bytes freed to bytes
+size_t FR_dedup(
+    AP_ColorRgb*** lists, const size_t* pixels, size_t nlists,
+    size_t nframes, size_t* bytes);
+
+// Splits frames into scenes that a palette fits, starting at least at cuts,
+// and maps every pixel to the palette of its scene
+FR_Scenes FR_quantizeScenes(
+    AP_ColorRgb** frames, size_t nframes, size_t height, size_t width,
+    const bool* cuts);
@@ -379,3 +379,200 @@ AP_ColorRgb* resize_bicubic(
     return dest;
 }
 
+
+void round_color_bits(AP_ColorRgb* img, size_t n, int bits) {
+    if (bits >= 8) {
+        return;
+    }
+
+    const int levels = (1 << bits) - 1;
+    uint8_t table[256];
+    for (int v = 0; v < 256; v++) {
+        int q = (v * levels + 127) / 255;
+        table[v] = q * 255 / levels;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        AP_ColorRgb_r(img[i]) = table[AP_ColorRgb_r(img[i])];
+        AP_ColorRgb_g(img[i]) = table[AP_ColorRgb_g(img[i])];
+        AP_ColorRgb_b(img[i]) = table[AP_ColorRgb_b(img[i])];
+    }
+}
+
+AP_ColorRgb* downscale_half(const AP_ColorRgb* src, size_t h, size_t w) {
+    size_t dh = (h + 1) / 2;
+    size_t dw = (w + 1) / 2;
+    AP_ColorRgb* dest = malloc(dh*dw*sizeof(*dest));
+    for (size_t i = 0; i < dh; i++) {
+        for (size_t j = 0; j < dw; j++) {
+            int r = 0, g = 0, b = 0, n = 0;
+            for (size_t y = 2*i; y < min(2*i + 2, h); y++) {
+                for (size_t x = 2*j; x < min(2*j + 2, w); x++) {
+                    r += AP_ColorRgb_r(src[y*w + x]);
+                    g += AP_ColorRgb_g(src[y*w + x]);
+                    b += AP_ColorRgb_b(src[y*w + x]);
+                    n++;
+                }
+            }
+            dest[i*dw + j] = AP_ColorRgb(r / n, g / n, b / n);
+        }
+    }
+    return dest;
+}
+
+void upscale_double(
+    const AP_ColorRgb* src,
+    AP_ColorRgb* dest,
+    size_t h,
+    size_t w)
+{
+    size_t sw = (w + 1) / 2;
+    for (size_t i = 0; i < h; i++) {
+        const AP_ColorRgb* row = src + (i / 2) * sw;
+        for (size_t j = 0; j < w; j++) {
+            dest[i*w + j] = row[j / 2];
+        }
+    }
+}
+
+// Source pixel x covers [x*dw, (x+1)*dw) and dest pixel j covers
+// [j*w, (j+1)*w) in units of 1/(w*dw) of the row, so the overlaps are whole
+// numbers that add up to w for every dest pixel. Without scaling up, a
+// source pixel overlaps at most two dest pixels. Rows are weighted the same
+// way, summing the horizontally resized source rows into the dest row and
+// the one after it. The sums of a dest pixel reach 255*h*w, which fits 32
+// bits for images of up to 16 million pixels
+void resize_area(
+    const AP_ColorRgb* src,
+    size_t h,
+    size_t w,
+    AP_ColorRgb* dest,
+    size_t dh,
+    size_t dw)
+{
+    uint32_t* row = malloc(3*(dw + 1)*sizeof(*row));
+    uint32_t* sums = calloc(3*dw, sizeof(*sums));
+    uint32_t* next = calloc(3*dw, sizeof(*next));
+    // multiplying is much faster than dividing by the total weight h*w
+    double scale = 1.0 / (h * w);
+    // the first dest pixel and its weight are the same for every row
+    uint32_t* cols = malloc(2*w*sizeof(*cols));
+    for (size_t x = 0; x < w; x++) {
+        size_t j = x*dw / w;
+        cols[2*x] = j;
+        cols[2*x + 1] = min((j + 1)*w, (x + 1)*dw) - x*dw;
+    }
+    size_t i = 0;
+    for (size_t y = 0; y < h; y++) {
+        memset(row, 0, 3*(dw + 1)*sizeof(*row));
+        const AP_ColorRgb* line = src + y*w;
+        for (size_t x = 0; x < w; x++) {
+            uint32_t a = cols[2*x + 1];
+            uint32_t b = dw - a;
+            uint32_t* r = row + 3*cols[2*x];
+            r[0] += a * AP_ColorRgb_r(line[x]);
+            r[1] += a * AP_ColorRgb_g(line[x]);
+            r[2] += a * AP_ColorRgb_b(line[x]);
+            r[3] += b * AP_ColorRgb_r(line[x]);
+            r[4] += b * AP_ColorRgb_g(line[x]);
+            r[5] += b * AP_ColorRgb_b(line[x]);
+        }
+
+        uint32_t a = min((i + 1)*h, (y + 1)*dh) - y*dh;
+        uint32_t b = dh - a;
+        for (size_t k = 0; k < 3*dw; k++) {
+            sums[k] += a * row[k];
+            next[k] += b * row[k];
+        }
+        if ((y + 1)*dh >= (i + 1)*h) {
+            for (size_t k = 0; k < dw; k++) {
+                dest[i*dw + k] = AP_ColorRgb(
+                    (uint8_t)(sums[3*k] * scale + 0.5),
+                    (uint8_t)(sums[3*k + 1] * scale + 0.5),
+                    (uint8_t)(sums[3*k + 2] * scale + 0.5));
+            }
+            uint32_t* done = sums;
+            sums = next;
+            next = done;
+            memset(next, 0, 3*dw*sizeof(*next));
+            i++;
+        }
+    }
+    free(cols);
+    free(row);
+    free(sums);
+    free(next);
+}
+
+void resize_nearest(
+    const AP_Color* src,
+    size_t h,
+    size_t w,
+    AP_Color* dest,
+    size_t dh,
+    size_t dw)
+{
+    for (size_t i = 0; i < dh; i++) {
+        const AP_Color* row = src + (2*i + 1) * h / (2*dh) * w;
+        for (size_t j = 0; j < dw; j++) {
+            dest[i*dw + j] = row[(2*j + 1) * w / (2*dw)];
+        }
+    }
+}
+
+void hash_rows(const AP_ColorRgb* img, size_t h, size_t w, uint64_t* hashes) {
+    for (size_t i = 0; i < h; i++) {
+        uint64_t hash = 0xcbf29ce484222325;
+        for (size_t j = 0; j < w; j++) {
+            hash = (hash ^ img[i*w + j]) * 0x100000001b3;
+        }
+        hashes[i] = hash;
+    }
+}
+
+size_t count_changed(
+    const AP_ColorRgb* a,
+    const AP_ColorRgb* b,
+    size_t n,
+    int distance)
+{
+    size_t changed = 0;
+    for (size_t i = 0; i < n; i++) {
+        int d = abs(AP_ColorRgb_r(a[i]) - AP_ColorRgb_r(b[i])) +
+            abs(AP_ColorRgb_g(a[i]) - AP_ColorRgb_g(b[i])) +
+            abs(AP_ColorRgb_b(a[i]) - AP_ColorRgb_b(b[i]));
+        changed += d >= distance;
+    }
+    return changed;
+}
+
+void denoise_temporal(
+    AP_ColorRgb* average,
+    const AP_ColorRgb* img,
+    size_t n,
+    int distance)
+{
+    for (size_t i = 0; i < n; i++) {
+        int c[3] = {
+            AP_ColorRgb_r(img[i]), AP_ColorRgb_g(img[i]), AP_ColorRgb_b(img[i]),
+        };
+        int a[3] = {
+            AP_ColorRgb_r(average[i]),
+            AP_ColorRgb_g(average[i]),
+            AP_ColorRgb_b(average[i]),
+        };
+        int d = abs(c[0] - a[0]) + abs(c[1] - a[1]) + abs(c[2] - a[2]);
+        if (d >= distance) {
+            average[i] = img[i];
+            continue;
+        }
+        // weight of the new pixel out of 256, from a quarter for no change
+        // to all of it at distance
+        int weight = 64 + 192 * d / distance;
+        for (int k = 0; k < 3; k++) {
+            int step = (c[k] - a[k]) * weight;
+            a[k] += (step + (step < 0 ? -128 : 128)) / 256;
+        }
+        average[i] = AP_ColorRgb(a[0], a[1], a[2]);
+    }
+}
@@ -7,3 +7,35 @@ AP_ColorRgb* resize_bicubic(
     AP_ColorRgb** src,
     size_t oldHeight, size_t oldWidth,
     size_t newHeight, size_t newWidth);
+
+// Area average of the h by w src into the dh by dw dest, for any factor
+// that doesn't scale up. Every source pixel adds to the dest pixels it
+// overlaps with integer weights, so it is exact and needs one pass
+void resize_area(
+    const AP_ColorRgb* src, size_t h, size_t w,
+    AP_ColorRgb* dest, size_t dh, size_t dw);
+// nearest neighbour resize of color indices, which can't be averaged
+void resize_nearest(
+    const AP_Color* src, size_t h, size_t w,
+    AP_Color* dest, size_t dh, size_t dw);
+
+// round every channel to the nearest of (1 << bits) evenly spaced levels
+void round_color_bits(AP_ColorRgb* img, size_t n, int bits);
+
+// 2x2 box average, the result is (h + 1) / 2 by (w + 1) / 2
+AP_ColorRgb* downscale_half(const AP_ColorRgb* src, size_t h, size_t w);
+// nearest neighbour 2x upscale of a downscale_half result into a h by w dest
+void upscale_double(
+    const AP_ColorRgb* src, AP_ColorRgb* dest, size_t h, size_t w);
+
+// one FNV-1a hash per row of the h by w img
+void hash_rows(const AP_ColorRgb* img, size_t h, size_t w, uint64_t* hashes);
+// pixels of a and b whose channels differ by distance or more in total
+size_t count_changed(
+    const AP_ColorRgb* a, const AP_ColorRgb* b, size_t n, int distance);
+// Motion adaptive recursive average: moves every pixel of average towards
+// the pixel of img, slowly for small changes and all the way for changes of
+// distance or more summed over the channels, so noise settles while motion
+// doesn't leave trails
+void denoise_temporal(
+    AP_ColorRgb* average, const AP_ColorRgb* img, size_t n, int distance);
@@ -0,0 +1,458 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "kitty.h"
+#include "output.h"
+
+#define APC_START "\e_G"
+#define APC_END "\e\\"
+#define KG_IMAGE_ID 1
+#define KG_QUERY_ID 31
+// base64 characters per chunk of a direct transfer, the protocol limit
+#define KG_CHUNK 4096
+// Objects the terminal may still have to read. Frames are only queued a few
+// deep, so an object this many frames old was read or never will be
+#define KG_SHM_KEEP 16
+
+// serial counts frames, names[serial % KG_SHM_KEEP] is the object of it
+typedef struct {
+    bool shm;
+    size_t serial;
+    char names[KG_SHM_KEEP][64];
+    uint8_t* rgb;
+    size_t rgbCapacity;
+    char* base64;
+    uint64_t checksum;
+} KG_Encoder;
+#define KG_Encoder(e) ((KG_Encoder*)(e))
+
+typedef struct {
+    enum { KG_NORMAL, KG_ESC, KG_APC, KG_APC_ESC } state;
+    AP_String command;
+    // a direct transfer spread over several chunks
+    bool pending;
+    size_t pendingSize;
+    AP_String payload;
+    KG_DecoderStats stats;
+} KG_Decoder;
+#define KG_Decoder(d) ((KG_Decoder*)(d))
+
+static const char KG_BASE64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// out needs room for 4 * ((len + 2) / 3) characters, returns that length
+static size_t KG_base64Encode(const uint8_t* data, size_t len, char* out) {
+    size_t o = 0;
+    size_t i = 0;
+    for (; i + 3 <= len; i += 3) {
+        uint32_t v = data[i] << 16 | data[i + 1] << 8 | data[i + 2];
+        out[o++] = KG_BASE64[v >> 18];
+        out[o++] = KG_BASE64[v >> 12 & 0x3f];
+        out[o++] = KG_BASE64[v >> 6 & 0x3f];
+        out[o++] = KG_BASE64[v & 0x3f];
+    }
+    if (i < len) {
+        uint32_t v = data[i] << 16 | (i + 1 < len ? data[i + 1] << 8 : 0);
+        out[o++] = KG_BASE64[v >> 18];
+        out[o++] = KG_BASE64[v >> 12 & 0x3f];
+        out[o++] = i + 1 < len ? KG_BASE64[v >> 6 & 0x3f] : '=';
+        out[o++] = '=';
+    }
+    return o;
+}
+
+// decodes in place, returns the decoded length or -1 on invalid input
+static long KG_base64Decode(char* data, size_t len) {
+    static int8_t values[256];
+    if (!values['B']) {
+        memset(values, -1, sizeof(values));
+        for (int i = 0; i < 64; i++) {
+            values[(uint8_t)KG_BASE64[i]] = i;
+        }
+    }
+
+    size_t o = 0;
+    uint32_t v = 0;
+    int bits = 0;
+    for (size_t i = 0; i < len && data[i] != '='; i++) {
+        int8_t d = values[(uint8_t)data[i]];
+        if (d < 0) {
+            return -1;
+        }
+        v = v << 6 | d;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            data[o++] = v >> bits;
+        }
+    }
+    return o;
+}
+
+uint64_t KG_checksum(const uint8_t* rgb, size_t len) {
+    uint64_t h = 0xcbf29ce484222325;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ rgb[i]) * 0x100000001b3;
+    }
+    return h;
+}
+
+static void KG_toRgb(
+    const AP_ColorRgb* img,
+    size_t stride,
+    size_t h,
+    size_t w,
+    uint8_t* rgb)
+{
+    for (size_t i = 0; i < h; i++) {
+        const AP_ColorRgb* row = img + i * stride;
+        for (size_t j = 0; j < w; j++) {
+            AP_ColorRgb p = row[j];
+            *rgb++ = AP_ColorRgb_r(p);
+            *rgb++ = AP_ColorRgb_g(p);
+            *rgb++ = AP_ColorRgb_b(p);
+        }
+    }
+}
+
+struct KG_Encoder* KG_Encoder_new(bool shm) {
+    KG_Encoder* e = calloc(1, sizeof(*e));
+    e->shm = shm;
+    return (struct KG_Encoder*)e;
+}
+
+void KG_Encoder_del(struct KG_Encoder* encoder) {
+    KG_Encoder* e = KG_Encoder(encoder);
+    for (size_t i = 0; i < KG_SHM_KEEP; i++) {
+        if (e->names[i][0]) {
+            shm_unlink(e->names[i]);
+        }
+    }
+    free(e->rgb);
+    free(e->base64);
+    free(e);
+}
+
+// returns false if the object could not be created
+static bool KG_Encoder_writeShm(
+    KG_Encoder* e,
+    const AP_ColorRgb* img,
+    size_t stride,
+    size_t h,
+    size_t w)
+{
+    char* name = e->names[e->serial % KG_SHM_KEEP];
+    if (name[0]) {
+        shm_unlink(name);
+    }
+    snprintf(name, sizeof(e->names[0]), "/ansipixel-%d-%zu",
+        (int)getpid(), e->serial);
+
+    size_t size = h * w * 3;
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd == -1) {
+        name[0] = 0;
+        return false;
+    }
+    uint8_t* data = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        shm_unlink(name);
+        name[0] = 0;
+        return false;
+    }
+
+    KG_toRgb(img, stride, h, w, data);
+    e->checksum += KG_checksum(data, size);
+    munmap(data, size);
+    return true;
+}
+
+size_t KG_Encoder_encode(
+    struct KG_Encoder* encoder,
+    const AP_ColorRgb* img,
+    size_t stride,
+    size_t h,
+    size_t w,
+    size_t row,
+    size_t col,
+    size_t rows,
+    size_t cols,
+    AP_String* out)
+{
+    KG_Encoder* e = KG_Encoder(encoder);
+    size_t start = out->len;
+    size_t size = h * w * 3;
+
+    // replace image and placement, scaled to the cells, without moving the
+    // cursor or getting a reply
+    char keys[160];
+    int keysLen = snprintf(keys, sizeof(keys),
+        APC_START "a=T,f=24,s=%zu,v=%zu,i=%d,p=1,c=%zu,r=%zu,C=1,q=2",
+        w, h, KG_IMAGE_ID, cols, rows);
+    AP_encodeMove(out, row, col);
+
+    if (e->shm && KG_Encoder_writeShm(e, img, stride, h, w)) {
+        char* name = e->names[e->serial % KG_SHM_KEEP];
+        char encoded[96];
+        size_t encodedLen = KG_base64Encode(
+            (const uint8_t*)name, strlen(name), encoded);
+        char transfer[48];
+        int transferLen = snprintf(transfer, sizeof(transfer),
+            ",t=s,S=%zu;", size);
+        AP_String_append(out, keys, keysLen);
+        AP_String_append(out, transfer, transferLen);
+        AP_String_append(out, encoded, encodedLen);
+        AP_String_append(out, APC_END, sizeof(APC_END) - 1);
+        e->serial++;
+        return out->len - start;
+    }
+    e->shm = false;
+
+    if (size > e->rgbCapacity) {
+        e->rgb = realloc(e->rgb, size);
+        e->base64 = realloc(e->base64, 4 * ((size + 2) / 3));
+        e->rgbCapacity = size;
+    }
+    KG_toRgb(img, stride, h, w, e->rgb);
+    e->checksum += KG_checksum(e->rgb, size);
+    size_t len = KG_base64Encode(e->rgb, size, e->base64);
+
+    // the first chunk carries the keys, the others only whether more follow
+    for (size_t i = 0; i < len; i += KG_CHUNK) {
+        size_t n = len - i < KG_CHUNK ? len - i : KG_CHUNK;
+        bool more = i + n < len;
+        if (i == 0) {
+            AP_String_append(out, keys, keysLen);
+            AP_String_append(out, more ? ",m=1;" : ";", more ? 5 : 1);
+        } else {
+            AP_String_append(out, APC_START, sizeof(APC_START) - 1);
+            AP_String_append(out, more ? "m=1;" : "m=0;", 4);
+        }
+        AP_String_append(out, e->base64 + i, n);
+        AP_String_append(out, APC_END, sizeof(APC_END) - 1);
+    }
+    e->serial++;
+    return out->len - start;
+}
+
+bool KG_Encoder_shm(struct KG_Encoder* e) {
+    return KG_Encoder(e)->shm;
+}
+
+uint64_t KG_Encoder_checksum(struct KG_Encoder* e) {
+    return KG_Encoder(e)->checksum;
+}
+
+void KG_encodeDelete(AP_String* out) {
+    char sequence[48];
+    int len = snprintf(sequence, sizeof(sequence),
+        APC_START "a=d,d=I,i=%d,q=2" APC_END, KG_IMAGE_ID);
+    AP_String_append(out, sequence, len);
+}
+
+bool KG_querySupport(int in, int out, bool shm, int timeoutMs) {
+    // a=q checks that an image could be loaded without showing it
+    char name[64] = "";
+    char payload[96] = "AAAA";
+    if (shm) {
+        snprintf(name, sizeof(name), "/ansipixel-%d-query", (int)getpid());
+        int fd = shm_open(name, O_CREAT | O_RDWR, 0600);
+        if (fd == -1) {
+            return false;
+        }
+        bool ok = ftruncate(fd, 3) == 0;
+        close(fd);
+        if (!ok) {
+            shm_unlink(name);
+            return false;
+        }
+        payload[KG_base64Encode(
+            (const uint8_t*)name, strlen(name), payload)] = 0;
+    }
+
+    char query[192];
+    snprintf(query, sizeof(query),
+        APC_START "i=%d,s=1,v=1,a=q,t=%c,f=24;%s" APC_END,
+        KG_QUERY_ID, shm ? 's' : 'd', payload);
+    char reply[256];
+    OUT_queryTerminal(in, out, query, reply, sizeof(reply), timeoutMs);
+    if (shm) {
+        // in case the terminal did not read it
+        shm_unlink(name);
+    }
+
+    char ok[32];
+    snprintf(ok, sizeof(ok), APC_START "i=%d;OK", KG_QUERY_ID);
+    return strstr(reply, ok) != NULL;
+}
+
+struct KG_Decoder* KG_Decoder_new() {
+    return (struct KG_Decoder*)calloc(1, sizeof(KG_Decoder));
+}
+
+void KG_Decoder_del(struct KG_Decoder* decoder) {
+    KG_Decoder* d = KG_Decoder(decoder);
+    AP_String_del(&d->command);
+    AP_String_del(&d->payload);
+    free(d);
+}
+
+KG_DecoderStats KG_Decoder_stats(struct KG_Decoder* d) {
+    return KG_Decoder(d)->stats;
+}
+
+static void KG_Decoder_image(KG_Decoder* d, const uint8_t* rgb, size_t len) {
+    d->stats.images++;
+    d->stats.pixelBytes += len;
+    d->stats.checksum += KG_checksum(rgb, len);
+}
+
+static void KG_Decoder_readShm(KG_Decoder* d, char* name, size_t size) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        d->stats.errors++;
+        return;
+    }
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= size && size) {
+        data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    // the terminal owns the object once it is referenced
+    shm_unlink(name);
+    if (data == MAP_FAILED) {
+        d->stats.errors++;
+        return;
+    }
+    KG_Decoder_image(d, data, size);
+    d->stats.shmImages++;
+    munmap(data, size);
+}
+
+static void KG_Decoder_finishDirect(KG_Decoder* d) {
+    d->pending = false;
+    long len = KG_base64Decode(d->payload.data, d->payload.len);
+    if (len < 0 || (size_t)len != d->pendingSize) {
+        d->stats.errors++;
+        return;
+    }
+    KG_Decoder_image(d, (const uint8_t*)d->payload.data, len);
+}
+
+// command is G{key}={value},...;{payload}
+static void KG_Decoder_command(KG_Decoder* d) {
+    AP_String_append(&d->command, "", 1);
+    char* c = d->command.data;
+    if (c[0] != 'G') {
+        return;
+    }
+    c++;
+
+    char* payload = strchr(c, ';');
+    if (payload) {
+        *payload++ = 0;
+    } else {
+        payload = "";
+    }
+    char action = 't', transfer = 'd';
+    size_t format = 32, width = 0, height = 0, more = 0;
+    for (char* key = strtok(c, ","); key; key = strtok(NULL, ",")) {
+        if (key[0] == 0 || key[1] != '=') {
+            d->stats.errors++;
+            return;
+        }
+        char* value = key + 2;
+        switch (key[0]) {
+            case 'a': action = value[0]; break;
+            case 't': transfer = value[0]; break;
+            case 'f': format = strtoul(value, NULL, 10); break;
+            case 's': width = strtoul(value, NULL, 10); break;
+            case 'v': height = strtoul(value, NULL, 10); break;
+            case 'm': more = strtoul(value, NULL, 10); break;
+        }
+    }
+
+    if (d->pending) {
+        AP_String_append(&d->payload, payload, strlen(payload));
+        if (!more) {
+            KG_Decoder_finishDirect(d);
+        }
+        return;
+    }
+    if (action != 'T' && action != 't') {
+        return;
+    }
+    if (format != 24) {
+        d->stats.errors++;
+        return;
+    }
+
+    size_t size = width * height * 3;
+    if (transfer == 's') {
+        long len = KG_base64Decode(payload, strlen(payload));
+        if (len <= 0) {
+            d->stats.errors++;
+            return;
+        }
+        payload[len] = 0;
+        KG_Decoder_readShm(d, payload, size);
+        return;
+    }
+
+    d->pending = true;
+    d->pendingSize = size;
+    d->payload.len = 0;
+    AP_String_append(&d->payload, payload, strlen(payload));
+    if (!more) {
+        KG_Decoder_finishDirect(d);
+    }
+}
+
+void KG_Decoder_feed(struct KG_Decoder* decoder, const char* data, size_t len) {
+    KG_Decoder* d = KG_Decoder(decoder);
+    for (size_t i = 0; i < len; i++) {
+        char c = data[i];
+        switch (d->state) {
+            case KG_NORMAL:
+                if (c == '\e') {
+                    d->state = KG_ESC;
+                }
+                break;
+            case KG_ESC:
+                if (c == '_') {
+                    d->state = KG_APC;
+                    d->command.len = 0;
+                } else if (c != '\e') {
+                    d->state = KG_NORMAL;
+                }
+                break;
+            case KG_APC:
+                if (c == '\e') {
+                    d->state = KG_APC_ESC;
+                } else {
+                    AP_String_append(&d->command, &c, 1);
+                }
+                break;
+            case KG_APC_ESC:
+                if (c == '\\') {
+                    KG_Decoder_command(d);
+                    d->state = KG_NORMAL;
+                } else {
+                    AP_String_append(&d->command, "\e", 1);
+                    AP_String_append(&d->command, &c, 1);
+                    d->state = KG_APC;
+                }
+                break;
+        }
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "ansipixel.h"
+
+// Draws frames as images with the kitty graphics protocol. With shm, the
+// pixels of a frame are put in a POSIX shared memory object and only its
+// name goes through the terminal (t=s), which unlinks it after reading.
+// Otherwise they are sent base64 encoded in chunks (t=d).
+struct KG_Encoder;
+
+struct KG_Encoder* KG_Encoder_new(bool shm);
+// unlinks the shared memory objects the terminal has not read
+void KG_Encoder_del(struct KG_Encoder* e);
+// Append the sequences that show the h*w pixels of img, whose rows are
+// stride pixels apart, scaled to the rows*cols cells at cell (row, col).
+// Every frame replaces the previous image. Returns the bytes appended
+size_t KG_Encoder_encode(
+    struct KG_Encoder* e, const AP_ColorRgb* img, size_t stride,
+    size_t h, size_t w, size_t row, size_t col, size_t rows, size_t cols,
+    AP_String* out);
+// false once shared memory failed and frames are sent directly
+bool KG_Encoder_shm(struct KG_Encoder* e);
+// sum of KG_checksum over the pixels of every encoded frame
+uint64_t KG_Encoder_checksum(struct KG_Encoder* e);
+// append the sequence that removes the image from the screen
+void KG_encodeDelete(AP_String* out);
+
+// asks the terminal whether it can show images sent with shm or directly
+bool KG_querySupport(int in, int out, bool shm, int timeoutMs);
+
+// Stand-in for a terminal: parses the graphics commands out of a byte
+// stream, reads and unlinks shared memory objects like kitty does and
+// checksums the images. Everything else in the stream is skipped
+struct KG_Decoder;
+
+typedef struct {
+    size_t images;
+    size_t shmImages;
+    size_t pixelBytes;
+    size_t errors; // malformed commands, missing objects, wrong sizes
+    uint64_t checksum; // same sum as KG_Encoder_checksum
+} KG_DecoderStats;
+
+struct KG_Decoder* KG_Decoder_new();
+void KG_Decoder_del(struct KG_Decoder* d);
+void KG_Decoder_feed(struct KG_Decoder* d, const char* data, size_t len);
+KG_DecoderStats KG_Decoder_stats(struct KG_Decoder* d);
+
+// FNV-1a of the RGB bytes of one image
+uint64_t KG_checksum(const uint8_t* rgb, size_t len);
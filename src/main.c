@@ -1,29 +1,37 @@
-#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
-#include <pthread.h>
 #include "ansipixel.h"
-#include "cbmp.h"
+#include "bench.h"
+#include "events.h"
+#include "frames.h"
 #include "imageutil.h"
+#include "kitty.h"
+#include "options.h"
+#include "player.h"
+#include "probe.h"
+#include "sixel.h"
 
-struct Info {
-    size_t nframes;
-    float fps;
-    size_t w, h;
-    bool horizontal;
-} INFO;
+struct Info INFO;
 
-void sleepInUs(uint64_t us) {
-    struct timespec ts;
-    ts.tv_sec = us / 1000000;
-    ts.tv_nsec = us % 1000000 * 1000;
+struct Options OPTIONS = {
+    .truecolor = false,
+    .colorBits = 8,
+    .threshold = 0,
+    .errorLimit = 0,
+    .refresh = -1,
+    .sixelColors = 256,
+    .keyframeInterval = -1,
+};
 
-    while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
-}
+struct Stats STATS;
 
 uint64_t nowInUs() {
     struct timespec now;
@@ -31,7 +39,7 @@ uint64_t nowInUs() {
     return (uint64_t)(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
 }
 
-void readInfo(char* dir, long* ratio, size_t* height, size_t* width) {
+void readInfo(char* dir, size_t* height, size_t* width) {
     char name[1024] = {0};
     sprintf(name, "%s/index.txt", dir);
     FILE* findex = fopen(name, "r");
@@ -49,73 +57,435 @@ void readInfo(char* dir, long* ratio, size_t* height, size_t* width) {
 
 
     printf("Frame dimensions: %zux%zu; NFrames: %zu; FPS: %f\n", INFO.w, INFO.h, INFO.nframes, INFO.fps);
-    INFO.horizontal = INFO.w > INFO.h;
-
-    struct winsize w;
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
-    float hsample = (float)INFO.h / w.ws_row / 2;
-    float wsample = (float)INFO.w / w.ws_col;
-    *ratio = INFO.horizontal ?
-        (hsample < wsample ? hsample : wsample) :
-        (hsample > wsample ? hsample : wsample);
-    *width = INFO.w / *ratio;
-    *height = INFO.h / *ratio;
+
+    size_t rows, cols;
+    PY_terminalSize(&rows, &cols);
+    PY_fitFrame(rows, cols, height, width);
 
     printf("Downscale to %zux%zu\n", *width, *height);
 }
 
-void playFrames(
-    struct AP_Buffer* buf,
-    AP_ColorRgb** frames,
-    size_t height,
-    size_t width)
-{
-    size_t f;
-    for (f = 0; f < INFO.nframes; f++) {
-        uint64_t start = nowInUs();
-
-        for (int i = 2; i < height; i++) {
-            for (int j = 0; j < width; j++) {
-                AP_Color c = AP_rgbTo256(frames[f][i * width + j]);
-                AP_Buffer_setPixel(buf, i, j, c);
-            }
-        }
-        AP_Buffer_draw(buf);
-
-        uint64_t end = nowInUs();
-        uint64_t elapsed = end - start;
-        const uint64_t waitTime = 1000000/INFO.fps;
+void usage(char* name) {
+    fprintf(stderr,
+        "Usage: %s [options] [directory or stream]\n"
+        "  -t, --truecolor        play with 24 bit colors\n"
+        "  -b, --color-bits N     round color channels to N bits (1-8)\n"
+        "  -d, --threshold D      skip cells that changed by less than D\n"
+        "                         (perceptual distance, 0-800)\n"
+        "  -e, --error-limit E    redraw skipped cells once their accumulated\n"
+        "                         change reaches E (default 4*D)\n"
+        "  -r, --refresh N        redraw the whole screen every N frames\n"
+        "                         (default every 2 seconds with -d)\n"
+        "  -B, --max-bytes-per-frame N\n"
+        "                         send at most about N bytes per frame, most\n"
+        "                         visible changes first\n"
+        "  -k, --max-kbps K       same as -B with N = K kilobits/s / fps\n"
+        "  -s, --sync MODE        synchronized output: auto (default), on, off\n"
+        "  -g, --glyphs MODE      cell glyphs with truecolor: half (default),\n"
+        "                         quadrant (2x2) or sextant (2x3) blocks\n"
+        "  -T, --text MODE        draw characters by luminance instead of\n"
+        "                         colors: ramp (ASCII) or braille\n"
+        "  -G, --greys N          give -T characters one of N grey levels\n"
+        "  -K, --kitty MODE       draw frames as images with the kitty graphics\n"
+        "                         protocol: auto, shm (shared memory) or direct\n"
+        "      --kitty-standin    decode the images instead of writing them to\n"
+        "                         the terminal, to check -K without one\n"
+        "  -X, --sixel PALETTE    draw frames as sixel images with a palette\n"
+        "                         built every frame or kept while it fits:\n"
+        "                         frame or stable\n"
+        "  -P, --sixel-colors N   colors of the sixel palette (2-256)\n"
+        "      --bench            encode every frame with half blocks and\n"
+        "                         sixel without playing, and compare their\n"
+        "                         bytes and encode time per frame\n"
+        "  -m, --motion           scroll and shift content that moved on screen\n"
+        "                         instead of redrawing it\n"
+        "  -n, --denoise D        average out changes below distance D (summed\n"
+        "                         over the channels, 1-765) over frames\n"
+        "  -D, --dither           ordered dithering of the 256 colors, with a\n"
+        "                         pattern that stays in place on screen\n"
+        "  -p, --palette MODE     colors of the 256 color mode: xterm (default)\n"
+        "                         or scene, 240 colors fitted to each scene\n"
+        "                         and redefined with OSC 4\n"
+        "  -a, --adaptive         lower colors, threshold and resolution when\n"
+        "                         frames can't keep up, raise them again when\n"
+        "                         there is headroom\n"
+        "  -l, --log FILE         write the quality decisions of -a to FILE\n"
+        "  -S, --sink-kbps K      simulate an output of K kilobits/s\n"
+        "  -w, --write-stream FILE\n"
+        "                         encode the frames into FILE instead of\n"
+        "                         playing them, which plays it when given\n"
+        "                         instead of a directory\n"
+        "  -I, --keyframe-interval N\n"
+        "                         frames between full redraws in a stream\n"
+        "                         (default 2 seconds)\n"
+        "      --start SECONDS    start playing a stream at SECONDS\n"
+        "  -f, --fps F            decode only the frames for playing at F fps,\n"
+        "                         or auto for what the terminal can take\n"
+        "      --blend            average the source frames that -f skips\n"
+        "                         into the decoded ones\n"
+        "\n"
+        "Keys during playback:\n"
+        "  space                  pause or resume\n"
+        "  .                      step one frame, pausing\n"
+        "  left, right            seek back or forward %d seconds\n"
+        "  down, up               seek back or forward %d seconds\n"
+        "  -, +                   halve or double the speed (%gx-%gx)\n"
+        "  q                      stop\n",
+        name, PY_SEEK_SECONDS, PY_SEEK_LONG_SECONDS, PY_SPEED_MIN, PY_SPEED_MAX);
+}
 
-        AP_move(0, 0);
-        AP_resettextcolor();
+// long options without a short one
+enum { OPT_KITTY_STANDIN = 256, OPT_BENCH, OPT_START, OPT_BLEND };
 
-        if (elapsed < waitTime) {
-            sleepInUs(waitTime - elapsed);
+int main(int argc, char** argv) {
+    static struct option longOptions[] = {
+        { "truecolor", no_argument, NULL, 't' },
+        { "color-bits", required_argument, NULL, 'b' },
+        { "threshold", required_argument, NULL, 'd' },
+        { "error-limit", required_argument, NULL, 'e' },
+        { "refresh", required_argument, NULL, 'r' },
+        { "max-bytes-per-frame", required_argument, NULL, 'B' },
+        { "max-kbps", required_argument, NULL, 'k' },
+        { "sync", required_argument, NULL, 's' },
+        { "glyphs", required_argument, NULL, 'g' },
+        { "text", required_argument, NULL, 'T' },
+        { "greys", required_argument, NULL, 'G' },
+        { "kitty", required_argument, NULL, 'K' },
+        { "kitty-standin", no_argument, NULL, OPT_KITTY_STANDIN },
+        { "sixel", required_argument, NULL, 'X' },
+        { "sixel-colors", required_argument, NULL, 'P' },
+        { "bench", no_argument, NULL, OPT_BENCH },
+        { "motion", no_argument, NULL, 'm' },
+        { "denoise", required_argument, NULL, 'n' },
+        { "dither", no_argument, NULL, 'D' },
+        { "palette", required_argument, NULL, 'p' },
+        { "adaptive", no_argument, NULL, 'a' },
+        { "log", required_argument, NULL, 'l' },
+        { "sink-kbps", required_argument, NULL, 'S' },
+        { "write-stream", required_argument, NULL, 'w' },
+        { "keyframe-interval", required_argument, NULL, 'I' },
+        { "start", required_argument, NULL, OPT_START },
+        { "fps", required_argument, NULL, 'f' },
+        { "blend", no_argument, NULL, OPT_BLEND },
+        { 0 },
+    };
+    // before the output and OpenMP threads inherit the signal mask
+    EV_blockResize();
+    int opt;
+    while ((opt = getopt_long(argc, argv, "tb:d:e:r:B:k:s:g:T:G:K:X:P:mn:Dp:al:S:w:I:f:", longOptions, NULL)) != -1) {
+        switch (opt) {
+            case 't':
+                OPTIONS.truecolor = true;
+                break;
+            case 'b':
+                OPTIONS.colorBits = atoi(optarg);
+                if (OPTIONS.colorBits < 1 || OPTIONS.colorBits > 8) {
+                    fputs("--color-bits expects a value from 1 to 8\n", stderr);
+                    return 1;
+                }
+                break;
+            case 'd':
+                OPTIONS.threshold = atoi(optarg);
+                break;
+            case 'e':
+                OPTIONS.errorLimit = atoi(optarg);
+                break;
+            case 'r':
+                OPTIONS.refresh = atol(optarg);
+                break;
+            case 'B':
+                OPTIONS.maxBytesPerFrame = strtoull(optarg, NULL, 10);
+                break;
+            case 'k':
+                OPTIONS.maxKbps = atof(optarg);
+                break;
+            case 's':
+                if (!strcmp(optarg, "auto")) {
+                    OPTIONS.sync = SYNC_AUTO;
+                } else if (!strcmp(optarg, "on")) {
+                    OPTIONS.sync = SYNC_ON;
+                } else if (!strcmp(optarg, "off")) {
+                    OPTIONS.sync = SYNC_OFF;
+                } else {
+                    fputs("--sync expects auto, on or off\n", stderr);
+                    return 1;
+                }
+                break;
+            case 'g':
+                if (!strcmp(optarg, "half")) {
+                    OPTIONS.glyphs = 0;
+                } else if (!strcmp(optarg, "quadrant")) {
+                    OPTIONS.glyphs = AP_GLYPHS_QUADRANT;
+                } else if (!strcmp(optarg, "sextant")) {
+                    OPTIONS.glyphs = AP_GLYPHS_SEXTANT;
+                } else {
+                    fputs("--glyphs expects half, quadrant or sextant\n", stderr);
+                    return 1;
+                }
+                break;
+            case 'T':
+                if (!strcmp(optarg, "ramp")) {
+                    OPTIONS.text = AP_TEXT_RAMP;
+                } else if (!strcmp(optarg, "braille")) {
+                    OPTIONS.text = AP_TEXT_BRAILLE;
+                } else {
+                    fputs("--text expects ramp or braille\n", stderr);
+                    return 1;
+                }
+                break;
+            case 'G':
+                OPTIONS.greys = atoi(optarg);
+                if (OPTIONS.greys < 2 || OPTIONS.greys > 24) {
+                    fputs("--greys expects a value from 2 to 24\n", stderr);
+                    return 1;
+                }
+                break;
+            case 'K':
+                if (!strcmp(optarg, "auto")) {
+                    OPTIONS.kitty = KITTY_AUTO;
+                } else if (!strcmp(optarg, "shm")) {
+                    OPTIONS.kitty = KITTY_SHM;
+                } else if (!strcmp(optarg, "direct")) {
+                    OPTIONS.kitty = KITTY_DIRECT;
+                } else {
+                    fputs("--kitty expects auto, shm or direct\n", stderr);
+                    return 1;
+                }
+                break;
+            case OPT_KITTY_STANDIN:
+                OPTIONS.kittyStandin = true;
+                break;
+            case 'X':
+                if (!strcmp(optarg, "frame")) {
+                    OPTIONS.sixel = SIXEL_FRAME;
+                } else if (!strcmp(optarg, "stable")) {
+                    OPTIONS.sixel = SIXEL_STABLE;
+                } else {
+                    fputs("--sixel expects frame or stable\n", stderr);
+                    return 1;
+                }
+                break;
+            case 'P':
+                OPTIONS.sixelColors = atoi(optarg);
+                if (OPTIONS.sixelColors < 2 || OPTIONS.sixelColors > 256) {
+                    fputs("--sixel-colors expects a value from 2 to 256\n",
+                        stderr);
+                    return 1;
+                }
+                break;
+            case OPT_BENCH:
+                OPTIONS.bench = true;
+                break;
+            case 'm':
+                OPTIONS.motion = true;
+                break;
+            case 'n':
+                OPTIONS.denoise = atoi(optarg);
+                if (OPTIONS.denoise < 1 || OPTIONS.denoise > 765) {
+                    fputs("--denoise expects a value from 1 to 765\n", stderr);
+                    return 1;
+                }
+                break;
+            case 'D':
+                OPTIONS.dither = true;
+                break;
+            case 'p':
+                if (!strcmp(optarg, "xterm")) {
+                    OPTIONS.palette = PALETTE_XTERM;
+                } else if (!strcmp(optarg, "scene")) {
+                    OPTIONS.palette = PALETTE_SCENE;
+                } else {
+                    fputs("--palette expects xterm or scene\n", stderr);
+                    return 1;
+                }
+                break;
+            case 'a':
+                OPTIONS.adaptive = true;
+                break;
+            case 'l':
+                OPTIONS.log = optarg;
+                break;
+            case 'S':
+                OPTIONS.sinkKbps = atof(optarg);
+                break;
+            case 'w':
+                OPTIONS.stream = optarg;
+                break;
+            case 'I':
+                OPTIONS.keyframeInterval = atol(optarg);
+                if (OPTIONS.keyframeInterval < 1) {
+                    fputs("--keyframe-interval expects at least 1\n", stderr);
+                    return 1;
+                }
+                break;
+            case OPT_START:
+                OPTIONS.start = atof(optarg);
+                break;
+            case 'f':
+                OPTIONS.fps = !strcmp(optarg, "auto") ? -1 : atof(optarg);
+                if (strcmp(optarg, "auto") && !(OPTIONS.fps > 0)) {
+                    fputs("--fps expects auto or a positive number\n", stderr);
+                    return 1;
+                }
+                break;
+            case OPT_BLEND:
+                OPTIONS.blend = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
         }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 0;
+    }
+    if (OPTIONS.blend && !OPTIONS.fps) {
+        fputs("--blend needs --fps\n", stderr);
+        return 1;
+    }
+    if (OPTIONS.glyphs && !OPTIONS.truecolor) {
+        fputs("--glyphs quadrant and sextant need --truecolor\n", stderr);
+        return 1;
+    }
+    if (OPTIONS.text &&
+        (OPTIONS.truecolor || OPTIONS.glyphs || OPTIONS.adaptive))
+    {
+        fputs("--text can't be combined with -t, -g or -a\n", stderr);
+        return 1;
+    }
 
+    if (OPTIONS.kittyStandin && !OPTIONS.kitty) {
+        OPTIONS.kitty = KITTY_AUTO;
+    }
+    if (OPTIONS.kitty && (OPTIONS.glyphs || OPTIONS.text || OPTIONS.adaptive)) {
+        fputs("--kitty can't be combined with -g, -T or -a\n", stderr);
+        return 1;
+    }
+    if (OPTIONS.sixel && (OPTIONS.glyphs || OPTIONS.text ||
+        OPTIONS.adaptive || OPTIONS.kitty))
+    {
+        fputs("--sixel can't be combined with -g, -T, -a or -K\n", stderr);
+        return 1;
+    }
+    if (OPTIONS.palette == PALETTE_SCENE && (OPTIONS.truecolor ||
+        OPTIONS.text || OPTIONS.adaptive || OPTIONS.kitty || OPTIONS.sixel))
+    {
+        fputs("--palette scene can't be combined with -t, -T, -a, -K or -X\n",
+            stderr);
+        return 1;
+    }
+    if (OPTIONS.dither && (OPTIONS.palette == PALETTE_SCENE ||
+        OPTIONS.text || OPTIONS.kitty || OPTIONS.sixel ||
+        (OPTIONS.truecolor && !OPTIONS.adaptive)))
+    {
+        fputs("--dither is for the 256 color mode with the xterm palette\n",
+            stderr);
+        return 1;
+    }
+    if (OPTIONS.stream && (OPTIONS.adaptive || OPTIONS.kitty ||
+        OPTIONS.sixel || OPTIONS.bench))
+    {
+        fputs("--write-stream can't be combined with -a, -K, -X or --bench\n",
+            stderr);
+        return 1;
+    }
+    // a file instead of a directory is a stream to play
+    struct stat st;
+    if (!OPTIONS.stream && stat(argv[optind], &st) == 0 &&
+        S_ISREG(st.st_mode))
+    {
+        return PY_playStream(argv[optind]);
+    }
+
+    if (OPTIONS.kitty == KITTY_AUTO) {
+        // the stand-in reads shared memory like the terminal would
+        if (OPTIONS.kittyStandin ||
+            KG_querySupport(STDIN_FILENO, STDOUT_FILENO, true, 200))
         {
-            uint64_t end = nowInUs();
-            uint64_t elapsed = end - start;
-            const uint64_t waitTime = 1000000/INFO.fps;
-            printf("%f\n", 1000000.0 / elapsed);
+            OPTIONS.kitty = KITTY_SHM;
+        } else if (KG_querySupport(STDIN_FILENO, STDOUT_FILENO, false, 200)) {
+            OPTIONS.kitty = KITTY_DIRECT;
+        } else {
+            puts("No kitty graphics support, drawing with half blocks");
+            OPTIONS.kitty = KITTY_OFF;
         }
     }
-}
 
-#define min(x, y) ((x) < (y) ? (x): (y))
+    // sub-pixels per cell of the frames for glyphs and braille
+    size_t blockRows = OPTIONS.glyphs ? OPTIONS.glyphs :
+        OPTIONS.text == AP_TEXT_BRAILLE ? AP_Text_height(OPTIONS.text) : 0;
+    size_t blockCols = OPTIONS.glyphs ? 2 :
+        OPTIONS.text == AP_TEXT_BRAILLE ? AP_Text_width(OPTIONS.text) : 0;
 
-int main(int argc, char** argv) {
-    if (argc < 2) {
-        return 0;
-    }
-
-    char* dir = argv[1];
+    char* dir = argv[optind];
     printf("Reading frames from %s directory\n", dir);
     size_t width, height;
-    long ratio;
-    readInfo(dir, &ratio, &height, &width);
+    readInfo(dir, &height, &width);
+
+    // resize_bicubic can't scale up, small frames get fewer cells
+    if (blockRows) {
+        size_t rows = (height + 1) / 2;
+        double wfit = (double)INFO.w / (blockCols * width);
+        double hfit = (double)INFO.h / (blockRows * rows);
+        double fit = wfit < hfit ? wfit : hfit;
+        if (fit < 1) {
+            width *= fit;
+            height = 2 * (size_t)(rows * fit);
+            printf("Downscale to %zux%zu cells for sub-pixels\n",
+                width, height / 2);
+        }
+    }
+    // Images get the pixels the cells cover below the status line, assuming
+    // 8x16 cells when the terminal doesn't tell. Sixel images are drawn at
+    // their size and leave the last row free, so the terminal doesn't scroll
+    // when the cursor moves below them
+    size_t imageHeight = 0, imageWidth = 0;
+    if (OPTIONS.kitty || OPTIONS.sixel || OPTIONS.bench) {
+        struct winsize w;
+        ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+        double cellWidth = w.ws_xpixel && w.ws_col ?
+            (double)w.ws_xpixel / w.ws_col : 8;
+        double cellHeight = w.ws_ypixel && w.ws_row ?
+            (double)w.ws_ypixel / w.ws_row : 16;
+        double wfit = width * cellWidth / INFO.w;
+        size_t rows = height / 2 - (OPTIONS.kitty || height < 4 ? 0 : 1);
+        double hfit = rows * cellHeight / INFO.h;
+        double fit = min(1, min(wfit, hfit));
+        imageWidth = INFO.w * fit > 1 ? INFO.w * fit : 1;
+        imageHeight = INFO.h * fit > 1 ? INFO.h * fit : 1;
+        STATS.imageWidth = imageWidth;
+        STATS.imageHeight = imageHeight;
+    }
+    // frames that would only be dropped are not decoded
+    size_t* sources = NULL;
+    if (OPTIONS.fps) {
+        sources = PR_pickFrames(OPTIONS.fps > 0 ?
+            OPTIONS.fps : PR_fps(dir, height, width));
+    }
+    if (!OPTIONS.errorLimit) {
+        OPTIONS.errorLimit = 4 * OPTIONS.threshold;
+    }
+    if (OPTIONS.maxKbps > 0) {
+        size_t bytes = OPTIONS.maxKbps * 1000 / 8 / INFO.fps;
+        if (!OPTIONS.maxBytesPerFrame || bytes < OPTIONS.maxBytesPerFrame) {
+            OPTIONS.maxBytesPerFrame = bytes ? bytes : 1;
+        }
+    }
+    if (OPTIONS.refresh < 0) {
+        OPTIONS.refresh = OPTIONS.threshold ? 2 * INFO.fps + 0.5 : 0;
+    }
+    if (OPTIONS.keyframeInterval < 0) {
+        OPTIONS.keyframeInterval = 2 * INFO.fps + 0.5;
+    }
 
     AP_ColorRgb** frames = calloc(INFO.nframes, sizeof(*frames));
+    AP_ColorRgb** blockFrames = blockRows ?
+        calloc(INFO.nframes, sizeof(*blockFrames)) : NULL;
+    AP_ColorRgb** halfFrames = OPTIONS.adaptive ?
+        calloc(INFO.nframes, sizeof(*halfFrames)) : NULL;
+    AP_ColorRgb** imageFrames = imageHeight ?
+        calloc(INFO.nframes, sizeof(*imageFrames)) : NULL;
     pthread_mutex_t counter_mutex;
     pthread_mutex_init(&counter_mutex, NULL);
     size_t counter = 0;
@@ -123,7 +493,7 @@ int main(int argc, char** argv) {
     uint64_t startPreprocess = nowInUs();
 
     #pragma omp parallel for
-    for (int f = 0; f < INFO.nframes; f++) {
+    for (size_t f = 0; f < INFO.nframes; f++) {
         pthread_mutex_lock(&counter_mutex);
         counter++;
         size_t localCounter = counter;
@@ -134,38 +504,120 @@ int main(int argc, char** argv) {
         printf("\e[2K\e[GProcessing frame %zu/%zu, FPS: %.3f", counter, INFO.nframes, counter / (timeElapsed / 1000000.f));
         fflush(stdout);
 
-        char name[100] = {0};
-        sprintf(name, "%s/%d.bmp", dir, f+1);
-        BMP* bmp = bopen(name);
-        frames[f] = malloc(height*width*sizeof(*frames[f]));
-
+        // with --blend, the source frames up to the next one played
         AP_ColorRgb* source = malloc(
             INFO.h*INFO.w*sizeof(*source));
-        for (int i = 0; i < INFO.h; i++) {
-            for (int j = 0; j < INFO.w; j++) {
-                unsigned char r, g, b;
-                get_pixel_rgb(bmp, j, INFO.h - i - 1, &r, &g, &b);
-                source[i*INFO.w + j] = AP_ColorRgb(r, g, b);
+        size_t from = sources ? sources[f] : f;
+        size_t to = sources && OPTIONS.blend ? sources[f + 1] : from + 1;
+        PR_readSources(dir, from, to, source);
+        if (imageFrames) {
+            imageFrames[f] = resize_bicubic(
+                &source, INFO.h, INFO.w, imageHeight, imageWidth);
+            round_color_bits(imageFrames[f], imageHeight*imageWidth,
+                OPTIONS.colorBits);
+        }
+        if (blockFrames) {
+            size_t rows = (height + 1) / 2 * blockRows;
+            size_t cols = width * blockCols;
+            blockFrames[f] = resize_bicubic(
+                &source, INFO.h, INFO.w, rows, cols);
+            if (!OPTIONS.denoise) {
+                round_color_bits(blockFrames[f], rows*cols, OPTIONS.colorBits);
             }
         }
         frames[f] = resize_bicubic(&source, INFO.h, INFO.w, height, width);
+        if (!OPTIONS.denoise) {
+            round_color_bits(frames[f], height*width, OPTIONS.colorBits);
+        }
+        if (halfFrames && !OPTIONS.denoise) {
+            halfFrames[f] = downscale_half(frames[f], height, width);
+        }
 
         free(source);
-        bclose(bmp);
     }
+    free(sources);
 
-    AP_clearScreen(NULL);
-    AP_showcursor(false);
-    struct AP_Buffer* buf = AP_Buffer_new(
-        height, width);
+    // the average runs over the frames in order, after loading them
+    if (OPTIONS.denoise) {
+        bool exact = OPTIONS.truecolor || OPTIONS.text;
+        FR_Changes changes = { 0 };
+        FR_denoise(frames, INFO.nframes, height * width, OPTIONS.denoise,
+            OPTIONS.colorBits, exact, &changes);
+        STATS.noisyChanges = changes.noisy;
+        STATS.denoisedChanges = changes.denoised;
+        if (blockFrames) {
+            FR_denoise(blockFrames, INFO.nframes,
+                (height + 1) / 2 * blockRows * width * blockCols,
+                OPTIONS.denoise, OPTIONS.colorBits, exact, NULL);
+        }
+        for (size_t f = 0; halfFrames && f < INFO.nframes; f++) {
+            halfFrames[f] = downscale_half(frames[f], height, width);
+        }
+        printf("\nDenoise: %.1f%% of the pixels change per frame, "
+            "%.1f%% without it\n",
+            100 * STATS.denoisedChanges / (height * width),
+            100 * STATS.noisyChanges / (height * width));
+    }
+
+    if (OPTIONS.bench) {
+        puts("");
+        BN_run(frames, height, width, imageFrames, imageHeight, imageWidth);
+        return 0;
+    }
 
-    playFrames(buf, frames, height, width);
+    PY_Player player = {
+        .buf = NULL,
+        .bufRgb = NULL,
+        .frames = frames,
+        .blockFrames = blockFrames,
+        .blockRows = blockRows,
+        .blockCols = blockCols,
+        .halfFrames = halfFrames,
+        .scratch = halfFrames ? malloc(height*width*sizeof(AP_ColorRgb)) : NULL,
+        .kitty = OPTIONS.kitty ?
+            KG_Encoder_new(OPTIONS.kitty == KITTY_SHM) : NULL,
+        .sixel = OPTIONS.sixel ?
+            SX_Encoder_new(OPTIONS.sixelColors, OPTIONS.sixel == SIXEL_STABLE) :
+            NULL,
+        .imageFrames = imageFrames,
+        .imageHeight = imageHeight,
+        .imageWidth = imageWidth,
+        .cuts = FR_findCuts(frames, INFO.nframes, height, width, &STATS.cuts),
+        .height = height,
+        .width = width,
+    };
+    // frames equal in every resolution share their pixels
+    AP_ColorRgb** lists[] = { frames, blockFrames, halfFrames, imageFrames };
+    size_t pixels[] = {
+        height * width,
+        (height + 1) / 2 * blockRows * width * blockCols,
+        (height + 1) / 2 * ((width + 1) / 2),
+        imageHeight * imageWidth,
+    };
+    STATS.uniqueFrames = FR_dedup(lists, pixels,
+        sizeof(lists) / sizeof(*lists), INFO.nframes, &STATS.dedupBytes);
+    size_t rows, cols;
+    PY_terminalSize(&rows, &cols);
+    PY_Player_fit(&player, rows, cols);
+    PY_Player_createBuffers(&player);
+    if (OPTIONS.palette == PALETTE_SCENE) {
+        puts("");
+        puts("Fitting palettes to scenes");
+        FR_Scenes scenes = FR_quantizeScenes(
+            frames, INFO.nframes, height, width, player.cuts);
+        player.indexedFrames = scenes.indexed;
+        player.scenes = scenes.scenes;
+        player.palettes = scenes.palettes;
+        STATS.scenes = scenes.count;
+        STATS.paletteError = scenes.error;
+        STATS.xtermError = scenes.xtermError;
+        STATS.dedupBytes += scenes.sharedBytes;
+    }
 
-    AP_Buffer_del(buf);
-    AP_resettextcolor();
-    AP_clearScreen(NULL);
-    AP_showcursor(true);
+    if (OPTIONS.stream) {
+        puts("");
+        return PY_Player_encodeStream(&player, OPTIONS.stream) ? 0 : 1;
+    }
 
-    puts("");
-    return 0;
+    return PY_Player_play(&player);
 }
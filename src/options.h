@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "ansipixel.h"
+#include "kitty.h"
+#include "output.h"
+
+// What the modules of the player share: the video being played, the
+// options given on the command line and the statistics printed after
+// playback. main.c defines them and fills in INFO and OPTIONS, the player,
+// probe and bench modules read them and add to STATS
+
+// the video of the directory or stream, PR_pickFrames changes it to the
+// frames played
+struct Info {
+    size_t nframes;
+    float fps;
+    size_t w, h;
+};
+extern struct Info INFO;
+
+struct Options {
+    bool truecolor;
+    int colorBits;
+    unsigned threshold;
+    unsigned errorLimit;
+    long refresh; // frames between full redraws, -1 picks a default
+    size_t maxBytesPerFrame; // 0 is unlimited
+    double maxKbps;
+    enum { SYNC_AUTO, SYNC_ON, SYNC_OFF } sync;
+    int glyphs; // 0 for half blocks, otherwise an AP_Glyphs
+    AP_Text text;
+    int greys;
+    enum { KITTY_OFF, KITTY_AUTO, KITTY_SHM, KITTY_DIRECT } kitty;
+    bool kittyStandin; // decode the output instead of writing it to stdout
+    enum { SIXEL_OFF, SIXEL_FRAME, SIXEL_STABLE } sixel;
+    int sixelColors;
+    bool bench;
+    bool motion;
+    unsigned denoise; // 0 is off
+    bool dither;
+    enum { PALETTE_XTERM, PALETTE_SCENE } palette;
+    bool adaptive;
+    double sinkKbps; // simulated output speed, 0 writes at full speed
+    char* log;
+    char* stream; // file to encode the frames into instead of playing them
+    long keyframeInterval; // frames, -1 picks a default
+    double start; // seconds into a stream to start playing at
+    double fps; // frames per second to decode, 0 for all, -1 to measure
+    bool blend; // average the source frames between decoded ones
+};
+extern struct Options OPTIONS;
+
+struct Stats {
+    size_t frames;
+    size_t dropped; // skipped because their display time had passed
+    size_t late; // finished after their display time had passed
+    size_t held; // skipped because the previous frame had not been written
+    size_t linkSamples; // frame periods the output was busy for
+    size_t linkBytes; // bytes the output accepted in those periods
+    size_t linkMin;
+    size_t bytes;
+    uint64_t us;
+    uint64_t encodeUs;
+    OUT_Stats output;
+    size_t levelChanges;
+    uint64_t kittyChecksum;
+    size_t imageHeight, imageWidth;
+    size_t sixelPalettes;
+    size_t scenes;
+    double paletteError, xtermError; // mean squared error per pixel
+    size_t cuts;
+    size_t repaints;
+    size_t uniqueFrames;
+    size_t dedupBytes; // freed by sharing the pixels of equal frames
+    size_t repeats; // frames that were already on screen
+    size_t seeks;
+    uint64_t seekSumUs, seekMaxUs; // from the key until the target is queued
+    size_t resizes;
+    size_t rescaled; // frames drawn smaller than they were loaded
+    uint64_t rescaleUs;
+    // pixels per frame whose drawn color changed, without and with --denoise
+    double noisyChanges, denoisedChanges;
+    KG_DecoderStats standin;
+    int outputError; // errno of the write that stopped playback, or 0
+};
+extern struct Stats STATS;
+
+#define min(x, y) ((x) < (y) ? (x): (y))
+
+uint64_t nowInUs();
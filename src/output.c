@@ -0,0 +1,477 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "output.h"
+
+#define CSI "\e["
+#define SYNC_BEGIN CSI "?2026h"
+#define SYNC_END CSI "?2026l"
+
+// rangeLen bytes of the file from rangeOffset go before bytes
+typedef struct {
+    AP_String bytes;
+    uint64_t rangeOffset;
+    size_t rangeLen;
+    uint64_t readyUs;
+} OUT_Frame;
+
+// head is only advanced by the writer thread, tail only by the producer.
+// filled counts submitted frames, free counts slots that can be acquired,
+// they only put either side to sleep and are not needed for correctness.
+// submitted and written count bytes and are updated as writes progress.
+// file and fileData are what frame ranges are taken from, see
+// OUT_Writer_setFile. drained is signalled whenever written catches up.
+// error is the errno of the first write that failed for good. From then on
+// frames are not written, their bytes count as written so that nothing
+// waits for them.
+typedef struct {
+    int fd;
+    int drained;
+    size_t depth;
+    bool sync;
+    int file;
+    const char* fileData;
+    OUT_Transfer transfer;
+    OUT_Frame* slots;
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    _Atomic bool stop;
+    _Atomic size_t submitted;
+    _Atomic size_t written;
+    _Atomic int error;
+    size_t rate;
+    uint64_t rateStartUs;
+    size_t rateBytes;
+    sem_t filled;
+    sem_t free;
+    pthread_t thread;
+    pthread_mutex_t statsMutex;
+    OUT_Stats stats;
+} OUT_Writer;
+#define OUT_Writer(w) ((OUT_Writer*)(w))
+
+static bool OUT_writevTracked(
+    int fd, struct iovec* iov, int n, _Atomic size_t* written);
+static bool OUT_handleWriteError(int fd);
+
+static uint64_t OUT_nowInUs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+// writes in small chunks, sleeping so that the average stays at w->rate
+// returns false when fd failed
+static bool OUT_Writer_writeThrottled(
+    OUT_Writer* w,
+    struct iovec* iov,
+    int n)
+{
+    size_t chunk = w->rate / 100 > 64 ? w->rate / 100 : 64;
+    for (int i = 0; i < n; i++) {
+        for (size_t off = 0; off < iov[i].iov_len; off += chunk) {
+            uint64_t now = OUT_nowInUs();
+            uint64_t due = w->rateStartUs + w->rateBytes * 1000000 / w->rate;
+            // an idle link does not save up for a burst
+            if (due + 100000 < now) {
+                w->rateStartUs = now;
+                w->rateBytes = 0;
+                due = now;
+            }
+            if (due > now) {
+                struct timespec ts = {
+                    .tv_sec = due / 1000000,
+                    .tv_nsec = due % 1000000 * 1000,
+                };
+                while (clock_nanosleep(
+                    CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+            }
+
+            size_t len = iov[i].iov_len - off < chunk ?
+                iov[i].iov_len - off : chunk;
+            struct iovec part = { (char*)iov[i].iov_base + off, len };
+            if (!OUT_writevTracked(w->fd, &part, 1, &w->written)) {
+                return false;
+            }
+            w->rateBytes += len;
+        }
+    }
+    return true;
+}
+
+// Sends a range of w->file with w->transfer. When the kernel can't do
+// that for these files, the rest and every later range is written from
+// the mapping. Returns false when fd failed or the file ended early
+static bool OUT_Writer_sendRange(OUT_Writer* w, uint64_t offset, size_t len) {
+    off_t off = offset;
+    while (len && w->transfer != OUT_WRITE) {
+        ssize_t a = w->transfer == OUT_SPLICE ?
+            splice(w->file, &off, w->fd, NULL, len, SPLICE_F_MORE) :
+            sendfile(w->fd, w->file, &off, len);
+        if (a == -1 && (errno == EINVAL || errno == ENOSYS)) {
+            w->transfer = OUT_WRITE;
+        } else if (a == -1) {
+            if (!OUT_handleWriteError(w->fd)) {
+                return false;
+            }
+        } else if (a == 0) {
+            // the file is shorter than it was mapped
+            errno = EIO;
+            return false;
+        } else {
+            atomic_fetch_add(&w->written, a);
+            len -= a;
+        }
+    }
+    if (len) {
+        struct iovec iov = { (char*)w->fileData + off, len };
+        return OUT_writevTracked(w->fd, &iov, 1, &w->written);
+    }
+    return true;
+}
+
+static void* OUT_Writer_run(void* arg) {
+    OUT_Writer* w = arg;
+    while (true) {
+        while (sem_wait(&w->filled) == -1 && errno == EINTR);
+        size_t head = atomic_load_explicit(&w->head, memory_order_relaxed);
+        if (head == atomic_load_explicit(&w->tail, memory_order_acquire)) {
+            // only woken up without a frame when stopping
+            if (atomic_load(&w->stop)) {
+                break;
+            }
+            continue;
+        }
+
+        // One writev per frame, so the terminal gets it in one piece. A
+        // range of the file is spliced or sent in between when it can be
+        OUT_Frame* frame = &w->slots[head % w->depth];
+        struct iovec iov[4] = {
+            { SYNC_BEGIN, sizeof(SYNC_BEGIN) - 1 },
+            { (char*)w->fileData + frame->rangeOffset, frame->rangeLen },
+            { frame->bytes.data, frame->bytes.len },
+            { SYNC_END, sizeof(SYNC_END) - 1 },
+        };
+        struct iovec* parts = w->sync ? iov : iov + 1;
+        int nparts = w->sync ? 4 : 2;
+        size_t frameBytes = 0;
+        for (int i = 0; i < nparts; i++) {
+            frameBytes += parts[i].iov_len;
+        }
+        size_t before = atomic_load(&w->written);
+        bool ok = !atomic_load(&w->error);
+        if (!ok) {
+            // fd failed before, the frame is dropped
+        } else if (w->rate) {
+            ok = OUT_Writer_writeThrottled(w, parts, nparts);
+        } else if (frame->rangeLen && w->transfer != OUT_WRITE) {
+            ok = (!w->sync || OUT_writevTracked(w->fd, iov, 1, &w->written)) &&
+                OUT_Writer_sendRange(w, frame->rangeOffset, frame->rangeLen) &&
+                OUT_writevTracked(
+                    w->fd, iov + 2, w->sync ? 2 : 1, &w->written);
+        } else {
+            ok = OUT_writevTracked(w->fd, parts, nparts, &w->written);
+        }
+        if (!ok) {
+            // count what was not written, so that pending drops to 0
+            if (!atomic_load(&w->error)) {
+                atomic_store(&w->error, errno ? errno : EIO);
+            }
+            atomic_store(&w->written, before + frameBytes);
+        }
+        uint64_t latency = OUT_nowInUs() - frame->readyUs;
+
+        pthread_mutex_lock(&w->statsMutex);
+        if (ok) {
+            w->stats.frames++;
+            w->stats.bytes += frame->rangeLen + frame->bytes.len;
+            w->stats.rangeBytes += frame->rangeLen;
+            w->stats.latencySumUs += latency;
+            if (latency > w->stats.latencyMaxUs) {
+                w->stats.latencyMaxUs = latency;
+            }
+        }
+        w->stats.transfer = w->transfer;
+        pthread_mutex_unlock(&w->statsMutex);
+
+        atomic_store_explicit(&w->head, head + 1, memory_order_release);
+        sem_post(&w->free);
+        if (atomic_load(&w->written) == atomic_load(&w->submitted)) {
+            eventfd_write(w->drained, 1);
+        }
+    }
+    return NULL;
+}
+
+struct OUT_Writer* OUT_Writer_new(int fd, size_t depth, bool sync) {
+    OUT_Writer* w = malloc(sizeof(*w));
+    (*w) = (OUT_Writer){
+        .fd = fd,
+        .drained = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+        .depth = depth,
+        .sync = sync,
+        .slots = calloc(depth, sizeof(OUT_Frame)),
+        .head = 0,
+        .tail = 0,
+        .stop = false,
+        .file = -1,
+    };
+    sem_init(&w->filled, 0, 0);
+    sem_init(&w->free, 0, depth);
+    pthread_mutex_init(&w->statsMutex, NULL);
+    pthread_create(&w->thread, NULL, OUT_Writer_run, w);
+    return (struct OUT_Writer*)w;
+}
+
+int OUT_Writer_del(struct OUT_Writer* writer) {
+    OUT_Writer* w = OUT_Writer(writer);
+    atomic_store(&w->stop, true);
+    sem_post(&w->filled);
+    pthread_join(w->thread, NULL);
+    int error = atomic_load(&w->error);
+
+    for (size_t i = 0; i < w->depth; i++) {
+        AP_String_del(&w->slots[i].bytes);
+    }
+    free(w->slots);
+    sem_destroy(&w->filled);
+    sem_destroy(&w->free);
+    pthread_mutex_destroy(&w->statsMutex);
+    close(w->drained);
+    free(w);
+    return error;
+}
+
+AP_String* OUT_Writer_acquire(struct OUT_Writer* writer) {
+    OUT_Writer* w = OUT_Writer(writer);
+    // backpressure: wait until the writer has finished with a slot
+    while (sem_wait(&w->free) == -1 && errno == EINTR);
+    size_t tail = atomic_load_explicit(&w->tail, memory_order_relaxed);
+    OUT_Frame* frame = &w->slots[tail % w->depth];
+    frame->bytes.len = 0;
+    frame->rangeLen = 0;
+    return &frame->bytes;
+}
+
+OUT_Transfer OUT_Writer_setFile(
+    struct OUT_Writer* writer,
+    int file,
+    const char* data)
+{
+    OUT_Writer* w = OUT_Writer(writer);
+    struct stat st;
+    w->file = file;
+    w->fileData = data;
+    w->transfer = fstat(w->fd, &st) == -1 ? OUT_WRITE :
+        S_ISFIFO(st.st_mode) ? OUT_SPLICE :
+        S_ISSOCK(st.st_mode) || S_ISREG(st.st_mode) ? OUT_SENDFILE :
+        OUT_WRITE;
+    pthread_mutex_lock(&w->statsMutex);
+    w->stats.transfer = w->transfer;
+    pthread_mutex_unlock(&w->statsMutex);
+    return w->transfer;
+}
+
+void OUT_Writer_setRange(
+    struct OUT_Writer* writer,
+    uint64_t offset,
+    size_t len)
+{
+    OUT_Writer* w = OUT_Writer(writer);
+    size_t tail = atomic_load_explicit(&w->tail, memory_order_relaxed);
+    OUT_Frame* frame = &w->slots[tail % w->depth];
+    frame->rangeOffset = offset;
+    frame->rangeLen = len;
+}
+
+
+void OUT_Writer_submit(struct OUT_Writer* writer) {
+    OUT_Writer* w = OUT_Writer(writer);
+    size_t tail = atomic_load_explicit(&w->tail, memory_order_relaxed);
+    OUT_Frame* frame = &w->slots[tail % w->depth];
+    frame->readyUs = OUT_nowInUs();
+    atomic_fetch_add(&w->submitted, frame->rangeLen + frame->bytes.len +
+        (w->sync ? sizeof(SYNC_BEGIN) - 1 + sizeof(SYNC_END) - 1 : 0));
+    atomic_store_explicit(&w->tail, tail + 1, memory_order_release);
+    sem_post(&w->filled);
+}
+
+OUT_Stats OUT_Writer_stats(struct OUT_Writer* writer) {
+    OUT_Writer* w = OUT_Writer(writer);
+    pthread_mutex_lock(&w->statsMutex);
+    OUT_Stats stats = w->stats;
+    pthread_mutex_unlock(&w->statsMutex);
+    return stats;
+}
+
+void OUT_Writer_setRateLimit(
+    struct OUT_Writer* writer,
+    size_t bytesPerSecond)
+{
+    OUT_Writer(writer)->rate = bytesPerSecond;
+}
+
+size_t OUT_Writer_pending(struct OUT_Writer* writer) {
+    OUT_Writer* w = OUT_Writer(writer);
+    return atomic_load(&w->submitted) - atomic_load(&w->written);
+}
+
+int OUT_Writer_failed(struct OUT_Writer* writer) {
+    return atomic_load(&OUT_Writer(writer)->error);
+}
+
+size_t OUT_Writer_written(struct OUT_Writer* writer) {
+    return atomic_load(&OUT_Writer(writer)->written);
+}
+
+int OUT_Writer_drainedFd(struct OUT_Writer* writer) {
+    return OUT_Writer(writer)->drained;
+}
+
+// returns false if fd can't be written to anymore
+static bool OUT_handleWriteError(int fd) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        poll(&(struct pollfd){ .fd = fd, .events = POLLOUT }, 1, -1);
+        return true;
+    }
+    return errno == EINTR;
+}
+
+bool OUT_writeAll(int fd, const char* data, size_t len) {
+    struct iovec iov = { (void*)data, len };
+    return OUT_writevAll(fd, &iov, 1);
+}
+
+bool OUT_writevAll(int fd, struct iovec* iov, int n) {
+    return OUT_writevTracked(fd, iov, n, NULL);
+}
+
+// written, if not NULL, is increased as soon as a part is accepted
+static bool OUT_writevTracked(
+    int fd,
+    struct iovec* iov,
+    int n,
+    _Atomic size_t* written)
+{
+    while (n > 0) {
+        ssize_t a = writev(fd, iov, n);
+        if (a == -1) {
+            if (!OUT_handleWriteError(fd)) {
+                return false;
+            }
+            continue;
+        }
+        if (written) {
+            atomic_fetch_add(written, a);
+        }
+        // skip what was written, iov is modified in place
+        while (n > 0 && (size_t)a >= iov->iov_len) {
+            a -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char*)iov->iov_base + a;
+            iov->iov_len -= a;
+        }
+    }
+    return true;
+}
+
+bool OUT_setNonBlocking(int fd, bool nonBlocking) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1) {
+        return false;
+    }
+    fcntl(fd, F_SETFL,
+        nonBlocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+    return flags & O_NONBLOCK;
+}
+
+size_t OUT_queryTerminal(
+    int in,
+    int out,
+    const char* query,
+    char* reply,
+    size_t size,
+    int timeoutMs)
+{
+    if (!isatty(in) || !isatty(out) || !size) {
+        return 0;
+    }
+
+    struct termios old, raw;
+    if (tcgetattr(in, &old) == -1) {
+        return 0;
+    }
+    raw = old;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(in, TCSANOW, &raw);
+
+    const char attributes[] = CSI "c";
+    struct iovec iov[2] = {
+        { (void*)query, strlen(query) },
+        { (void*)attributes, sizeof(attributes) - 1 },
+    };
+    OUT_writevAll(out, iov, 2);
+
+    size_t len = 0;
+    bool answered = false;
+    reply[0] = 0;
+    uint64_t deadline = OUT_nowInUs() + timeoutMs * 1000;
+    while (!answered && len < size - 1) {
+        uint64_t now = OUT_nowInUs();
+        if (now >= deadline) {
+            break;
+        }
+        struct pollfd p = { .fd = in, .events = POLLIN };
+        if (poll(&p, 1, (deadline - now + 999) / 1000) <= 0) {
+            break;
+        }
+        ssize_t n = read(in, reply + len, size - 1 - len);
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+        reply[len] = 0;
+
+        // device attributes look like CSI ? {attrs} c
+        for (char* r = strstr(reply, CSI "?"); r; r = strstr(r + 1, CSI "?")) {
+            char* params = r + sizeof(CSI "?") - 1;
+            if (params[strspn(params, "0123456789;")] == 'c') {
+                answered = true;
+            }
+        }
+    }
+
+    // drop anything that arrived late
+    tcsetattr(in, TCSAFLUSH, &old);
+    return len;
+}
+
+bool OUT_querySyncSupport(int in, int out, int timeoutMs) {
+    // DECRQM for mode 2026, answered by CSI ? 2026 ; {state} $ y
+    char reply[256];
+    if (!OUT_queryTerminal(
+        in, out, CSI "?2026$p", reply, sizeof(reply), timeoutMs))
+    {
+        return false;
+    }
+    return strstr(reply, CSI "?2026;1$y") || strstr(reply, CSI "?2026;2$y");
+}
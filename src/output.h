@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "ansipixel.h"
+
+// Writes frames to a file descriptor on its own thread, so the next frame
+// can be encoded while the terminal drains the previous one.
+// Frames are handed over through a single producer single consumer queue
+// of depth byte buffers. When all of them are in flight, acquiring blocks.
+struct OUT_Writer;
+
+// How ranges of a file reach fd: spliced into a pipe, sent with sendfile to
+// a socket or regular file, or written from a mapping of the file to a
+// terminal. All of them skip copying the bytes into a frame buffer
+typedef enum { OUT_WRITE, OUT_SPLICE, OUT_SENDFILE } OUT_Transfer;
+
+typedef struct {
+    size_t frames;
+    size_t bytes;
+    size_t rangeBytes; // of bytes, sent from file ranges
+    OUT_Transfer transfer; // OUT_WRITE once the kernel refused the other
+    uint64_t latencySumUs; // from submit until fully written
+    uint64_t latencyMaxUs;
+} OUT_Stats;
+
+// with sync, every frame is wrapped in synchronized update sequences so the
+// terminal never shows a half drawn frame
+struct OUT_Writer* OUT_Writer_new(int fd, size_t depth, bool sync);
+// waits for queued frames to be written, returns OUT_Writer_failed then
+int OUT_Writer_del(struct OUT_Writer* writer);
+// cleared buffer to encode the next frame into, only valid until submit
+AP_String* OUT_Writer_acquire(struct OUT_Writer* writer);
+void OUT_Writer_submit(struct OUT_Writer* writer);
+OUT_Stats OUT_Writer_stats(struct OUT_Writer* writer);
+// simulate a slow link by writing at most bytesPerSecond, 0 is unlimited
+void OUT_Writer_setRateLimit(struct OUT_Writer* writer, size_t bytesPerSecond);
+// bytes submitted that fd has not accepted yet
+size_t OUT_Writer_pending(struct OUT_Writer* writer);
+// bytes fd has accepted so far, failed frames count as accepted
+size_t OUT_Writer_written(struct OUT_Writer* writer);
+// errno of the write that failed for good, 0 while fd accepts frames.
+// Frames submitted after that are dropped
+int OUT_Writer_failed(struct OUT_Writer* writer);
+// eventfd that is signalled when fd has accepted everything submitted
+int OUT_Writer_drainedFd(struct OUT_Writer* writer);
+
+// Lets frames start with ranges of file, which data maps completely and
+// which must not change while the writer uses it. Returns the transfer
+// picked for fd
+OUT_Transfer OUT_Writer_setFile(
+    struct OUT_Writer* writer, int file, const char* data);
+// start the acquired frame with len bytes of the file from offset, before
+// the bytes appended to its buffer
+void OUT_Writer_setRange(
+    struct OUT_Writer* writer, uint64_t offset, size_t len);
+
+// Write all of data, retrying on partial writes. Waits with poll when fd is
+// non-blocking and full. Returns false on other errors
+bool OUT_writeAll(int fd, const char* data, size_t len);
+// same for several buffers in one writev
+bool OUT_writevAll(int fd, struct iovec* iov, int n);
+
+// returns whether fd was non-blocking before
+bool OUT_setNonBlocking(int fd, bool nonBlocking);
+
+// Sends query followed by a primary device attributes request, which every
+// terminal answers, and collects the reply into reply (NUL terminated) until
+// that answer arrives or timeoutMs passed. Returns the reply length, 0 when
+// in and out are not a terminal
+size_t OUT_queryTerminal(
+    int in, int out, const char* query, char* reply, size_t size,
+    int timeoutMs);
+
+// asks the terminal whether it supports synchronized output (DEC private
+// mode 2026), waiting at most timeoutMs for an answer
+bool OUT_querySyncSupport(int in, int out, int timeoutMs);
@@ -0,0 +1,226 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "palette.h"
+
+// count and sum are the histogram, bins lists the used entries so they can
+// be cleared. table maps a bin to its palette color, mapped to the palette
+// that was done for
+typedef struct {
+    int colors;
+    uint32_t count[PL_BINS];
+    uint64_t sum[PL_BINS][3];
+    uint16_t bins[PL_BINS];
+    uint16_t sorted[PL_BINS];
+    size_t nbins;
+    size_t builds;
+    int size;
+    uint8_t palette[256][3];
+    uint8_t table[PL_BINS];
+    uint32_t mapped[PL_BINS];
+} PL_Palette;
+#define PL_Palette(p) ((PL_Palette*)(p))
+
+// bins first..last-1, split along the channel with the largest range
+typedef struct {
+    size_t first, last;
+    uint64_t count;
+    int axis;
+    int range;
+} PL_Box;
+
+struct PL_Palette* PL_Palette_new(int colors) {
+    PL_Palette* p = calloc(1, sizeof(*p));
+    p->colors = colors < 2 ? 2 : colors > 256 ? 256 : colors;
+    p->size = 1;
+    return (struct PL_Palette*)p;
+}
+
+void PL_Palette_del(struct PL_Palette* p) {
+    free(p);
+}
+
+void PL_Palette_clear(struct PL_Palette* palette) {
+    PL_Palette* p = PL_Palette(palette);
+    for (size_t i = 0; i < p->nbins; i++) {
+        int b = p->bins[i];
+        p->count[b] = 0;
+        p->sum[b][0] = p->sum[b][1] = p->sum[b][2] = 0;
+    }
+    p->nbins = 0;
+}
+
+void PL_Palette_add(
+    struct PL_Palette* palette,
+    const AP_ColorRgb* img,
+    size_t stride,
+    size_t h,
+    size_t w)
+{
+    PL_Palette* p = PL_Palette(palette);
+    for (size_t i = 0; i < h; i++) {
+        const AP_ColorRgb* row = img + i * stride;
+        for (size_t j = 0; j < w; j++) {
+            AP_ColorRgb c = row[j];
+            int b = PL_bin(c);
+            if (!p->count[b]++) {
+                p->bins[p->nbins++] = b;
+            }
+            p->sum[b][0] += AP_ColorRgb_r(c);
+            p->sum[b][1] += AP_ColorRgb_g(c);
+            p->sum[b][2] += AP_ColorRgb_b(c);
+        }
+    }
+}
+
+static void PL_Box_measure(const PL_Palette* p, PL_Box* box) {
+    int lo[3] = { 31, 31, 31 };
+    int hi[3] = { 0, 0, 0 };
+    box->count = 0;
+    for (size_t i = box->first; i < box->last; i++) {
+        int b = p->bins[i];
+        int c[3] = { b >> 10, b >> 5 & 31, b & 31 };
+        for (int k = 0; k < 3; k++) {
+            lo[k] = c[k] < lo[k] ? c[k] : lo[k];
+            hi[k] = c[k] > hi[k] ? c[k] : hi[k];
+        }
+        box->count += p->count[b];
+    }
+    box->axis = 0;
+    for (int k = 1; k < 3; k++) {
+        if (hi[k] - lo[k] > hi[box->axis] - lo[box->axis]) {
+            box->axis = k;
+        }
+    }
+    box->range = hi[box->axis] - lo[box->axis];
+}
+
+// Sorts the bins of box along its axis with a counting sort and returns
+// where half of its pixels are on either side. Both halves keep a bin
+static size_t PL_Box_split(PL_Palette* p, const PL_Box* box) {
+    int shift = 10 - 5 * box->axis;
+    size_t start[33] = { 0 };
+    for (size_t i = box->first; i < box->last; i++) {
+        start[(p->bins[i] >> shift & 31) + 1]++;
+    }
+    for (int v = 0; v < 32; v++) {
+        start[v + 1] += start[v];
+    }
+    for (size_t i = box->first; i < box->last; i++) {
+        int b = p->bins[i];
+        p->sorted[box->first + start[b >> shift & 31]++] = b;
+    }
+    memcpy(p->bins + box->first, p->sorted + box->first,
+        (box->last - box->first) * sizeof(*p->bins));
+
+    uint64_t seen = 0;
+    size_t split = box->first;
+    while (split < box->last - 1 && seen < box->count / 2) {
+        seen += p->count[p->bins[split++]];
+    }
+    return split > box->first ? split : box->first + 1;
+}
+
+// median cut: keep splitting the box with the most pixels times range
+void PL_Palette_build(struct PL_Palette* palette) {
+    PL_Palette* p = PL_Palette(palette);
+    PL_Box boxes[256];
+    int n = 0;
+    if (p->nbins) {
+        boxes[n++] = (PL_Box){ .first = 0, .last = p->nbins };
+        PL_Box_measure(p, &boxes[0]);
+    }
+    while (n < p->colors) {
+        int best = -1;
+        uint64_t bestScore = 0;
+        for (int i = 0; i < n; i++) {
+            uint64_t score = boxes[i].count * boxes[i].range;
+            if (score > bestScore) {
+                best = i;
+                bestScore = score;
+            }
+        }
+        if (best == -1) {
+            break;
+        }
+        size_t split = PL_Box_split(p, &boxes[best]);
+        boxes[n] = (PL_Box){ .first = split, .last = boxes[best].last };
+        boxes[best].last = split;
+        PL_Box_measure(p, &boxes[best]);
+        PL_Box_measure(p, &boxes[n]);
+        n++;
+    }
+
+    // every bin gets the color of its box
+    p->builds++;
+    p->size = n ? n : 1;
+    memset(p->palette, 0, sizeof(p->palette[0]));
+    for (int k = 0; k < n; k++) {
+        uint64_t sum[3] = { 0 };
+        for (size_t i = boxes[k].first; i < boxes[k].last; i++) {
+            int b = p->bins[i];
+            sum[0] += p->sum[b][0];
+            sum[1] += p->sum[b][1];
+            sum[2] += p->sum[b][2];
+            p->table[b] = k;
+            p->mapped[b] = p->builds;
+        }
+        for (int c = 0; c < 3; c++) {
+            p->palette[k][c] = (sum[c] + boxes[k].count / 2) / boxes[k].count;
+        }
+    }
+}
+
+double PL_Palette_fit(struct PL_Palette* palette) {
+    PL_Palette* p = PL_Palette(palette);
+    uint64_t error = 0;
+    uint64_t pixels = 0;
+    for (size_t i = 0; i < p->nbins; i++) {
+        int b = p->bins[i];
+        uint32_t n = p->count[b];
+        int mean[3] = {
+            p->sum[b][0] / n, p->sum[b][1] / n, p->sum[b][2] / n,
+        };
+        if (p->mapped[b] != p->builds) {
+            int best = 0;
+            int bestDistance = INT32_MAX;
+            for (int k = 0; k < p->size; k++) {
+                int dr = mean[0] - p->palette[k][0];
+                int dg = mean[1] - p->palette[k][1];
+                int db = mean[2] - p->palette[k][2];
+                int distance = dr * dr + dg * dg + db * db;
+                if (distance < bestDistance) {
+                    best = k;
+                    bestDistance = distance;
+                }
+            }
+            p->table[b] = best;
+            p->mapped[b] = p->builds;
+        }
+        const uint8_t* color = p->palette[p->table[b]];
+        int dr = mean[0] - color[0];
+        int dg = mean[1] - color[1];
+        int db = mean[2] - color[2];
+        error += (uint64_t)n * (dr * dr + dg * dg + db * db);
+        pixels += n;
+    }
+    return pixels ? (double)error / pixels : 0;
+}
+
+const uint8_t* PL_Palette_table(struct PL_Palette* p) {
+    return PL_Palette(p)->table;
+}
+
+int PL_Palette_size(struct PL_Palette* p) {
+    return PL_Palette(p)->size;
+}
+
+AP_ColorRgb PL_Palette_color(struct PL_Palette* palette, int k) {
+    PL_Palette* p = PL_Palette(palette);
+    return AP_ColorRgb(p->palette[k][0], p->palette[k][1], p->palette[k][2]);
+}
+
+size_t PL_Palette_builds(struct PL_Palette* p) {
+    return PL_Palette(p)->builds;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "ansipixel.h"
+
+// Palettes built with median cut over a histogram of colors quantized to
+// 5 bits per channel. The histogram can gather several images before a
+// palette is built. Colors are mapped to the palette with a table indexed
+// by histogram bin, which PL_Palette_fit fills in for the bins it has seen
+struct PL_Palette;
+
+#define PL_BINS (1 << 15)
+
+static inline int PL_bin(AP_ColorRgb p) {
+    return (AP_ColorRgb_r(p) >> 3) << 10 |
+        (AP_ColorRgb_g(p) >> 3) << 5 |
+        AP_ColorRgb_b(p) >> 3;
+}
+
+// colors is the most colors a palette gets (2-256)
+struct PL_Palette* PL_Palette_new(int colors);
+void PL_Palette_del(struct PL_Palette* p);
+void PL_Palette_clear(struct PL_Palette* p); // empty the histogram
+// count the h*w pixels of img, whose rows are stride pixels apart
+void PL_Palette_add(
+    struct PL_Palette* p, const AP_ColorRgb* img, size_t stride,
+    size_t h, size_t w);
+// replace the palette with one built from the histogram
+void PL_Palette_build(struct PL_Palette* p);
+// Map the bins of the histogram that are new to the palette to their
+// nearest color, and return the mean squared error of the histogram
+double PL_Palette_fit(struct PL_Palette* p);
+// palette index of every bin mapped since the palette was built
+const uint8_t* PL_Palette_table(struct PL_Palette* p);
+int PL_Palette_size(struct PL_Palette* p);
+AP_ColorRgb PL_Palette_color(struct PL_Palette* p, int k);
+size_t PL_Palette_builds(struct PL_Palette* p); // palettes built so far
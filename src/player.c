@@ -0,0 +1,1036 @@
+#include <errno.h>
+#include <omp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "events.h"
+#include "frames.h"
+#include "imageutil.h"
+#include "options.h"
+#include "output.h"
+#include "player.h"
+#include "quality.h"
+#include "stream.h"
+
+static PY_Level PY_LEVELS[] = {
+    { true, 0, false },
+    { false, 0, false },
+    { false, 16, false },
+    { false, 32, false },
+    { false, 32, true },
+    { false, 64, true },
+};
+#define PY_NLEVELS (sizeof(PY_LEVELS) / sizeof(*PY_LEVELS))
+
+static bool PY_stdoutWasNonBlocking;
+
+// leave the terminal usable when interrupted, stdout is non-blocking during
+// playback and that is shared with the shell
+static void PY_onSignal(int sig) {
+    EV_restoreTerminal();
+    OUT_setNonBlocking(STDOUT_FILENO, PY_stdoutWasNonBlocking);
+    const char reset[] = "\e[0m\e[?25h\n";
+    write(STDOUT_FILENO, reset, sizeof(reset) - 1);
+    if (OPTIONS.palette == PALETTE_SCENE) {
+        const char palette[] = "\e]104\e\\";
+        write(STDOUT_FILENO, palette, sizeof(palette) - 1);
+    }
+    _exit(128 + sig);
+}
+
+// The playback clock and what the keys asked for. Frame `frame` is due at
+// `us` and the frames after it follow at fps * speed, which seeks, pauses
+// and speed changes start over from
+typedef struct {
+    struct EV_Loop* loop;
+    struct OUT_Writer* writer;
+    size_t frame;
+    uint64_t us;
+    double speed;
+    bool paused;
+    bool redraw; // a seek asks for the next frame drawn in full
+    bool resized; // the terminal changed size
+    uint64_t seekUs; // when the key of that seek came
+} PY_Control;
+
+static PY_Control PY_Control_new(struct OUT_Writer* writer, size_t first) {
+    PY_Control c = {
+        .loop = EV_Loop_new(STDIN_FILENO),
+        .writer = writer,
+        .frame = first,
+        .us = nowInUs(),
+        .speed = 1,
+    };
+    EV_Loop_watch(c.loop, OUT_Writer_drainedFd(writer));
+    return c;
+}
+
+// when frame f is displayed until frame f + 1 is due
+static uint64_t PY_Control_due(const PY_Control* c, size_t f) {
+    return c->us + (int64_t)(((double)f - c->frame) * 1000000.0 /
+        (INFO.fps * c->speed));
+}
+
+// Waits until frame next is due while handling keys, and returns the frame
+// to draw then: next, a frame stepped or seeked to, or INFO.nframes to stop.
+// held is set when the frame before next was skipped because the output
+// was busy. It is tried again if the output drains before next is due
+static size_t PY_Control_wait(PY_Control* c, size_t next, bool held) {
+    for (;;) {
+        uint64_t now = nowInUs();
+        if (!c->paused && now >= PY_Control_due(c, next)) {
+            STATS.held += held;
+            return next;
+        }
+        EV_Loop_setTimer(c->loop, c->paused ? 0 : PY_Control_due(c, next));
+        EV_Event e = EV_Loop_wait(c->loop);
+        now = nowInUs();
+        if (e.type == EV_READY && held && !c->paused &&
+            !OUT_Writer_pending(c->writer))
+        {
+            return next - 1;
+        }
+        // the frame on screen
+        size_t at = next ? next - 1 : 0;
+        if (e.type == EV_RESIZE) {
+            // a paused frame is drawn again at the new size
+            c->resized = true;
+            if (c->paused) {
+                c->frame = at;
+                c->us = now;
+                return at;
+            }
+        }
+        if (e.type != EV_KEY) {
+            continue;
+        }
+
+        long seconds = 0;
+        switch (e.key) {
+        case 'q':
+            return INFO.nframes;
+        case ' ':
+            // resume with the next frame right away
+            c->paused = !c->paused;
+            c->frame = next;
+            c->us = now;
+            break;
+        case '.':
+            c->paused = true;
+            c->frame = next;
+            c->us = now;
+            return next;
+        case '+':
+        case '-':
+            // the next frame stays due when it was
+            c->us = c->paused ? now : PY_Control_due(c, next);
+            c->frame = next;
+            c->speed = e.key == '+' ?
+                (c->speed * 2 < PY_SPEED_MAX ? c->speed * 2 : PY_SPEED_MAX) :
+                (c->speed / 2 > PY_SPEED_MIN ? c->speed / 2 : PY_SPEED_MIN);
+            break;
+        case EV_KEY_LEFT: seconds = -PY_SEEK_SECONDS; break;
+        case EV_KEY_RIGHT: seconds = PY_SEEK_SECONDS; break;
+        case EV_KEY_DOWN: seconds = -PY_SEEK_LONG_SECONDS; break;
+        case EV_KEY_UP: seconds = PY_SEEK_LONG_SECONDS; break;
+        }
+        if (seconds && INFO.nframes) {
+            double target = at + seconds * INFO.fps;
+            c->frame = target < 0 ? 0 : target >= INFO.nframes ?
+                INFO.nframes - 1 : (size_t)target;
+            c->us = now;
+            c->redraw = true;
+            c->seekUs = now;
+            return c->frame;
+        }
+    }
+}
+
+// count a seek whose target was just queued
+static void PY_Control_seeked(PY_Control* c) {
+    uint64_t us = nowInUs() - c->seekUs;
+    STATS.seeks++;
+    STATS.seekSumUs += us;
+    STATS.seekMaxUs = us > STATS.seekMaxUs ? us : STATS.seekMaxUs;
+}
+
+// the status line after every frame, with the speed when it is not 1
+static int PY_formatStatus(
+    char* status, size_t size, const PY_Control* c,
+    double fps, size_t bytes)
+{
+    if (c->paused) {
+        return snprintf(status, size, "%f %zuB paused\n", fps, bytes);
+    } else if (c->speed != 1) {
+        return snprintf(status, size, "%f %zuB %gx\n", fps, bytes, c->speed);
+    }
+    return snprintf(status, size, "%f %zuB\n", fps, bytes);
+}
+
+void PY_terminalSize(size_t* rows, size_t* cols) {
+    struct winsize w;
+    bool tty = ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0 && w.ws_row;
+    *rows = tty ? w.ws_row : 24;
+    *cols = tty ? w.ws_col : 80;
+    // the status line takes a row
+    *rows = *rows < 2 ? 2 : *rows;
+    *cols = *cols < 1 ? 1 : *cols;
+}
+
+void PY_fitFrame(size_t rows, size_t cols, size_t* height, size_t* width) {
+    double fit = min(2.0 * (rows - 1) / INFO.h, (double)cols / INFO.w);
+    fit = min(fit, 1);
+    *height = (size_t)(INFO.h * fit) & ~(size_t)1;
+    *width = INFO.w * fit;
+    *height = *height < 2 ? 2 : *height;
+    *width = *width < 1 ? 1 : *width;
+}
+
+void PY_Player_fit(PY_Player* p, size_t rows, size_t cols) {
+    size_t height, width;
+    PY_fitFrame(rows, cols, &height, &width);
+    double fit = min(1,
+        min((double)height / p->height, (double)width / p->width));
+    p->rows = rows;
+    p->cols = cols;
+    p->drawHeight = (size_t)(p->height * fit) & ~(size_t)1;
+    p->drawWidth = p->width * fit;
+    p->drawHeight = p->drawHeight < 2 ? 2 : p->drawHeight;
+    p->drawWidth = p->drawWidth < 1 ? 1 : p->drawWidth;
+    p->top = 2 + (2 * (rows - 1) - min(p->drawHeight, 2 * (rows - 1))) / 4 * 2;
+    p->left = (cols - min(p->drawWidth, cols)) / 2;
+    p->drawImageHeight = p->imageHeight * fit;
+    p->drawImageWidth = p->imageWidth * fit;
+    p->drawImageHeight = p->drawImageHeight < 1 ? 1 : p->drawImageHeight;
+    p->drawImageWidth = p->drawImageWidth < 1 ? 1 : p->drawImageWidth;
+}
+
+// switch the buffer and settings frames are drawn with
+static void PY_Player_setLevel(PY_Player* p, PY_Level level) {
+    unsigned threshold = level.threshold > OPTIONS.threshold ?
+        level.threshold : OPTIONS.threshold;
+    unsigned errorLimit = threshold == OPTIONS.threshold ?
+        OPTIONS.errorLimit : 4 * threshold;
+    if (level.truecolor) {
+        if (!p->level.truecolor) {
+            AP_BufferRgb_syncScreen(p->bufRgb, p->buf);
+        }
+        AP_BufferRgb_setThreshold(p->bufRgb, threshold, errorLimit);
+    } else {
+        if (p->level.truecolor) {
+            AP_Buffer_syncScreen(p->buf, p->bufRgb);
+        }
+        AP_Buffer_setThreshold(p->buf, threshold, errorLimit);
+    }
+    p->level = level;
+}
+
+typedef struct {
+    int fd;
+    struct KG_Decoder* decoder;
+} PY_Standin;
+
+// reads what the player writes until the pipe is closed
+static void* PY_runStandin(void* arg) {
+    PY_Standin* standin = arg;
+    char data[65536];
+    ssize_t n;
+    while ((n = read(standin->fd, data, sizeof(data))) != 0) {
+        if (n > 0) {
+            KG_Decoder_feed(standin->decoder, data, n);
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+void PY_Player_createBuffers(PY_Player* p) {
+    if (OPTIONS.truecolor) {
+        p->bufRgb = AP_BufferRgb_new(2 * p->rows, p->cols);
+        AP_BufferRgb_setBudget(p->bufRgb, OPTIONS.maxBytesPerFrame);
+        AP_BufferRgb_setMotion(p->bufRgb, OPTIONS.motion);
+    }
+    if (!OPTIONS.truecolor || OPTIONS.adaptive) {
+        p->buf = AP_Buffer_new(2 * p->rows, p->cols);
+        AP_Buffer_setBudget(p->buf, OPTIONS.maxBytesPerFrame);
+        AP_Buffer_setText(p->buf, OPTIONS.text, OPTIONS.greys);
+        AP_Buffer_setMotion(p->buf, OPTIONS.motion);
+        AP_Buffer_setDither(p->buf, OPTIONS.dither);
+    }
+    p->level.truecolor = OPTIONS.truecolor;
+    PY_Player_setLevel(p, (PY_Level){ OPTIONS.truecolor, 0, false });
+}
+
+// Recreates the buffers for the size of the terminal at the same level of
+// the quality ladder. Everything is drawn again with the next frame
+static void PY_Player_resize(PY_Player* p) {
+    size_t rows, cols;
+    PY_terminalSize(&rows, &cols);
+    PY_Player_fit(p, rows, cols);
+    PY_Level level = p->level;
+    if (p->bufRgb) {
+        AP_BufferRgb_del(p->bufRgb);
+        p->bufRgb = NULL;
+    }
+    if (p->buf) {
+        AP_Buffer_del(p->buf);
+        p->buf = NULL;
+    }
+    PY_Player_createBuffers(p);
+    PY_Player_setLevel(p, level);
+    STATS.resizes++;
+}
+
+// the h by w pixels of a frame at dh by dw, rescaled into scaled if the
+// sizes differ
+static const AP_ColorRgb* PY_scaleFrame(
+    const AP_ColorRgb* frame, size_t h, size_t w,
+    AP_ColorRgb* scaled, size_t dh, size_t dw)
+{
+    if (dh == h && dw == w) {
+        return frame;
+    }
+    resize_area(frame, h, w, scaled, dh, dw);
+    return scaled;
+}
+
+// Appends what brings the screen to frame f with the current level to out,
+// and returns the bytes appended. Frames are only rescaled when the
+// terminal shrank, which the copies of PY_Player_encodeStream never see, so
+// they can share the scaled buffers
+static size_t PY_Player_draw(PY_Player* p, size_t f, AP_String* out) {
+    size_t height = p->drawHeight;
+    size_t width = p->drawWidth;
+    size_t row = p->top / 2;
+    bool scale = height != p->height || width != p->width;
+    uint64_t start = scale ? nowInUs() : 0;
+
+    const AP_ColorRgb* frame = p->frames[f];
+    if (p->level.half) {
+        upscale_double(p->halfFrames[f], p->scratch, p->height, p->width);
+        frame = p->scratch;
+    }
+    // block frames are drawn instead when the level can draw them
+    size_t blockStride = p->blockCols * width;
+    const AP_ColorRgb* block =
+        p->blockFrames && (OPTIONS.text || p->level.truecolor) ?
+        PY_scaleFrame(p->blockFrames[f],
+            p->height / 2 * p->blockRows, p->blockCols * p->width,
+            p->scaledBlock, height / 2 * p->blockRows, blockStride) :
+        NULL;
+    if (!p->kitty && !p->sixel && !p->indexedFrames && !block) {
+        frame = PY_scaleFrame(frame, p->height, p->width,
+            p->scaled, height, width);
+    }
+    // kitty scales images to the cells itself
+    const AP_ColorRgb* image = p->sixel ?
+        PY_scaleFrame(p->imageFrames[f], p->imageHeight, p->imageWidth,
+            p->scaledImage, p->drawImageHeight, p->drawImageWidth) :
+        NULL;
+    const AP_Color* indexed = p->indexedFrames ? p->indexedFrames[f] : NULL;
+    if (indexed && scale) {
+        resize_nearest(indexed, p->height, p->width,
+            p->scaledIndexed, height, width);
+        indexed = p->scaledIndexed;
+    }
+    if (scale) {
+        STATS.rescaled++;
+        STATS.rescaleUs += nowInUs() - start;
+    }
+
+    if (p->kitty) {
+        return KG_Encoder_encode(p->kitty, p->imageFrames[f],
+            p->imageWidth, p->imageHeight, p->imageWidth,
+            row, p->left, height / 2, width, out);
+    } else if (p->sixel) {
+        return SX_Encoder_encode(p->sixel, image, p->drawImageWidth,
+            p->drawImageHeight, p->drawImageWidth, row, p->left, out);
+    } else if (OPTIONS.text) {
+        AP_Buffer_blitText(p->buf, block ? block : frame,
+            block ? blockStride : width, row, p->left, height / 2, width);
+        return AP_Buffer_encode(p->buf, out);
+    } else if (p->level.truecolor && block) {
+        AP_BufferRgb_blitBlocks(p->bufRgb, OPTIONS.glyphs,
+            block, blockStride, row, p->left, height / 2, width);
+        return AP_BufferRgb_encode(p->bufRgb, out);
+    } else if (p->level.truecolor) {
+        AP_BufferRgb_blit(
+            p->bufRgb, frame, width, p->top, p->left, height, width);
+        return AP_BufferRgb_encode(p->bufRgb, out);
+    } else if (indexed) {
+        // only the colors that differ from the last scene are sent
+        AP_Buffer_setPalette(p->buf,
+            p->palettes + p->scenes[f] * FR_SCENE_COLORS,
+            FR_SCENE_FIRST, FR_SCENE_COLORS);
+        AP_Buffer_blit(p->buf, indexed, width, p->top, p->left, height, width);
+        return AP_Buffer_encode(p->buf, out);
+    } else {
+        AP_Buffer_blitRgb(
+            p->buf, frame, width, p->top, p->left, height, width);
+        return AP_Buffer_encode(p->buf, out);
+    }
+}
+
+static void PY_Player_playFrames(PY_Player* p) {
+
+    // frames are written on another thread while the next one is encoded
+    bool sync = OPTIONS.sync == SYNC_ON || (OPTIONS.sync == SYNC_AUTO &&
+        OUT_querySyncSupport(STDIN_FILENO, STDOUT_FILENO, 200));
+    int fd = STDOUT_FILENO;
+    int standinPipe[2];
+    PY_Standin standin = { 0 };
+    pthread_t standinThread;
+    if (OPTIONS.kittyStandin && pipe(standinPipe) == 0) {
+        standin = (PY_Standin){ standinPipe[0], KG_Decoder_new() };
+        pthread_create(&standinThread, NULL, PY_runStandin, &standin);
+        fd = standinPipe[1];
+    }
+    struct OUT_Writer* writer = OUT_Writer_new(fd, 2, sync);
+    OUT_Writer_setRateLimit(writer, OPTIONS.sinkKbps * 1000 / 8);
+
+    // frame f is displayed from frameTime(f) until frameTime(f + 1)
+    // deadlines are absolute so that sleeping and slow frames don't drift
+    uint64_t playStart = nowInUs();
+    PY_Control control = PY_Control_new(writer, 0);
+    #define frameTime(f) PY_Control_due(&control, (f))
+
+    // without truecolor the top of the ladder is not available
+    PY_Level* ladder = p->level.truecolor ? PY_LEVELS : PY_LEVELS + 1;
+    int levels = PY_NLEVELS - (ladder - PY_LEVELS);
+    struct QC_Controller* controller = OPTIONS.adaptive ?
+        QC_Controller_new(levels, 0, 1000000 / INFO.fps) : NULL;
+    int level = 0;
+    FILE* log = OPTIONS.log ? fopen(OPTIONS.log, "w") : NULL;
+    if (OPTIONS.log && !log) {
+        perror(OPTIONS.log);
+    }
+    OUT_Stats lastOutput = { 0 };
+
+    size_t sinceRefresh = 0;
+    size_t shown = SIZE_MAX; // last frame drawn at the current level
+    size_t lastWritten = 0;
+    bool busy = false;
+    bool held = false;
+    size_t tried = SIZE_MAX; // frame of the last iteration
+    size_t f;
+    for (f = 0; f < INFO.nframes; f = PY_Control_wait(&control, f + 1, held)) {
+        // nothing reaches the terminal anymore
+        if ((STATS.outputError = OUT_Writer_failed(writer))) {
+            break;
+        }
+        uint64_t start = nowInUs();
+        QC_Sample sample = { 0 };
+        // A frame held back is tried again when the output drains before
+        // the next one is due. Its frame period was measured the first time
+        bool retry = f == tried;
+        tried = f;
+        held = false;
+
+        // bytes the output took during the last frame period while it had
+        // something to write
+        size_t written = OUT_Writer_written(writer);
+        if (busy && !retry) {
+            size_t accepted = written - lastWritten;
+            STATS.linkSamples++;
+            STATS.linkBytes += accepted;
+            if (STATS.linkSamples == 1 || accepted < STATS.linkMin) {
+                STATS.linkMin = accepted;
+            }
+        }
+        if (!retry) {
+            lastWritten = written;
+        }
+        busy = OUT_Writer_pending(writer) > 0;
+
+        // more than one frame behind. Don't encode a frame that is already
+        // stale, the next one is diffed against what is on screen anyway
+        if (start >= frameTime(f + 1)) {
+            STATS.dropped++;
+            sample.overloaded = true;
+            goto measured;
+        }
+
+        // the output has not drained the previous frame. Queueing more
+        // would only make the terminal fall further behind, so skip until
+        // it catches up, or try again when it does before the next frame
+        // is due. Frames are diffed against oldBuffer, which is what the
+        // screen shows once everything queued is written
+        if (busy) {
+            held = true;
+            sample.overloaded = true;
+            goto measured;
+        }
+
+        // a seek draws its target in full, whatever is on screen, and so
+        // does a resize, on a cleared screen with buffers of the new size
+        bool seek = control.redraw;
+        bool resize = control.resized;
+        control.redraw = false;
+        control.resized = false;
+        if (resize) {
+            PY_Player_resize(p);
+        }
+        if (seek || resize) {
+            shown = SIZE_MAX;
+        }
+        if (seek || resize ||
+            (OPTIONS.refresh > 0 && ++sinceRefresh > (size_t)OPTIONS.refresh))
+        {
+            sinceRefresh = 1;
+            if (p->level.truecolor) {
+                AP_BufferRgb_refresh(p->bufRgb);
+            } else {
+                AP_Buffer_refresh(p->buf);
+            }
+        }
+
+        // A frame sharing its pixels with the frame on screen needs no pixel
+        // loop, diff or write, unless cells are still waiting to be sent.
+        // With scene palettes the scene has to match as well
+        bool pending = p->kitty || p->sixel ? false :
+            p->level.truecolor ? AP_BufferRgb_pending(p->bufRgb) :
+            AP_Buffer_pending(p->buf);
+        if (shown != SIZE_MAX && p->frames[f] == p->frames[shown] &&
+            !(p->indexedFrames && p->scenes[f] != p->scenes[shown]) &&
+            !pending)
+        {
+            STATS.repeats++;
+            STATS.frames++;
+            goto measured;
+        }
+
+        AP_String* out = OUT_Writer_acquire(writer);
+        if (resize) {
+            AP_encodeResetColor(out);
+            AP_encodeClear(out);
+        }
+        size_t bytes = PY_Player_draw(p, f, out);
+        STATS.bytes += bytes;
+        STATS.frames++;
+        shown = f;
+
+        uint64_t end = nowInUs();
+        if (end > frameTime(f + 1)) {
+            STATS.late++;
+            sample.overloaded = true;
+        }
+        sample.encodeUs = end - start;
+        STATS.encodeUs += end - start;
+        sample.bytes = bytes;
+
+        char status[64];
+        int statusLen = PY_formatStatus(status, sizeof(status), &control,
+            1000000.0 / (end - start), bytes);
+        AP_encodeMove(out, 0, 0);
+        AP_encodeResetColor(out);
+        AP_String_append(out, status, statusLen);
+        OUT_Writer_submit(writer);
+        if (seek) {
+            PY_Control_seeked(&control);
+        }
+
+    measured:
+        if (controller && !retry) {
+            // average latency of the frames written since the last period,
+            // a whole period if the output was stuck on one
+            OUT_Stats output = OUT_Writer_stats(writer);
+            size_t done = output.frames - lastOutput.frames;
+            if (done) {
+                sample.writeUs = (output.latencySumUs -
+                    lastOutput.latencySumUs) / done;
+            } else if (busy) {
+                sample.writeUs = 1000000 / INFO.fps;
+            }
+            lastOutput = output;
+
+            int next = QC_Controller_update(controller, sample);
+            if (next != level) {
+                STATS.levelChanges++;
+                if (log) {
+                    fprintf(log, "%.3fs frame %zu: level %d -> %d (%s), "
+                        "load %.2f, encode %.3fms, write %.3fms, %zuB\n",
+                        (nowInUs() - playStart) / 1000000.0, f,
+                        level, next, QC_Controller_reason(controller),
+                        QC_Controller_load(controller),
+                        sample.encodeUs / 1000.0, sample.writeUs / 1000.0,
+                        sample.bytes);
+                }
+                level = next;
+                PY_Player_setLevel(p, ladder[level]);
+                shown = SIZE_MAX;
+            }
+        }
+    }
+
+    #undef frameTime
+    EV_Loop_del(control.loop);
+
+    if (controller) {
+        QC_Controller_del(controller);
+    }
+    if (log) {
+        fclose(log);
+    }
+    STATS.output = OUT_Writer_stats(writer);
+    STATS.outputError = OUT_Writer_del(writer);
+    if (standin.decoder) {
+        close(standinPipe[1]);
+        pthread_join(standinThread, NULL);
+        close(standinPipe[0]);
+        STATS.standin = KG_Decoder_stats(standin.decoder);
+        KG_Decoder_del(standin.decoder);
+    }
+    if (p->kitty) {
+        STATS.kittyChecksum = KG_Encoder_checksum(p->kitty);
+    }
+    if (p->sixel) {
+        STATS.sixelPalettes = SX_Encoder_palettes(p->sixel);
+    }
+    STATS.repaints = (p->buf ? AP_Buffer_repaints(p->buf) : 0) +
+        (p->bufRgb ? AP_BufferRgb_repaints(p->bufRgb) : 0);
+    STATS.us = nowInUs() - playStart;
+}
+
+static void PY_printStats() {
+    printf("Mode: %s, color bits: %d, threshold: %u, budget: %zuB\n",
+        OPTIONS.kitty ? "kitty graphics" :
+            OPTIONS.sixel ? "sixel" :
+            OPTIONS.text == AP_TEXT_RAMP ? "ramp text" :
+            OPTIONS.text == AP_TEXT_BRAILLE ? "braille text" :
+            OPTIONS.truecolor ? "truecolor" :
+            OPTIONS.palette == PALETTE_SCENE ? "256 colors, scene palettes" :
+            "256 colors",
+        OPTIONS.colorBits,
+        OPTIONS.threshold,
+        OPTIONS.maxBytesPerFrame);
+    printf("Frames: %zu, bytes/frame: %.1f, fps: %.3f\n",
+        STATS.frames,
+        STATS.frames ? (double)STATS.bytes / STATS.frames : 0.0,
+        STATS.us ? STATS.frames / (STATS.us / 1000000.0) : 0.0);
+    printf("Encode: %.3fms/frame\n",
+        STATS.frames ? STATS.encodeUs / 1000.0 / STATS.frames : 0.0);
+    printf("Dropped: %zu, late: %zu, duration: %.3fs (expected %.3fs)\n",
+        STATS.dropped,
+        STATS.late,
+        STATS.us / 1000000.0,
+        INFO.nframes / INFO.fps);
+    printf("Held back for a slow output: %zu frames\n", STATS.held);
+    if (STATS.linkSamples) {
+        printf("Output accepted while busy: avg %zuB, min %zuB per frame\n",
+            STATS.linkBytes / STATS.linkSamples, STATS.linkMin);
+    }
+    printf("Write latency: avg %.3fms, max %.3fms\n",
+        STATS.output.frames ?
+            STATS.output.latencySumUs / 1000.0 / STATS.output.frames : 0.0,
+        STATS.output.latencyMaxUs / 1000.0);
+    if (STATS.output.rangeBytes) {
+        static const char* transfers[] = {
+            [OUT_WRITE] = "write", [OUT_SPLICE] = "splice",
+            [OUT_SENDFILE] = "sendfile",
+        };
+        printf("Sent from the stream file with %s: %zuB\n",
+            transfers[STATS.output.transfer], STATS.output.rangeBytes);
+    }
+    if (OPTIONS.adaptive) {
+        printf("Quality level changes: %zu\n", STATS.levelChanges);
+    }
+    if (OPTIONS.kitty) {
+        printf("Kitty graphics: %s, image %zux%zu\n",
+            OPTIONS.kitty == KITTY_SHM ? "shared memory" : "direct",
+            STATS.imageWidth, STATS.imageHeight);
+    }
+    if (OPTIONS.sixel) {
+        printf("Sixel: %d colors, %s palette, image %zux%zu, "
+            "palettes sent: %zu\n",
+            OPTIONS.sixelColors,
+            OPTIONS.sixel == SIXEL_STABLE ? "stable" : "per frame",
+            STATS.imageWidth, STATS.imageHeight,
+            STATS.sixelPalettes);
+    }
+    // streams are played without loading frames
+    if (STATS.uniqueFrames) {
+        printf("Scene cuts: %zu, drawn as full repaints: %zu\n",
+            STATS.cuts, STATS.repaints);
+    }
+    if (STATS.uniqueFrames) {
+        printf("Unique frames: %zu of %zu, %.1fMB saved by sharing the "
+            "rest, %zu repeats not drawn\n",
+            STATS.uniqueFrames, INFO.nframes, STATS.dedupBytes / 1e6,
+            STATS.repeats);
+    }
+    if (STATS.seeks) {
+        printf("Seeks: %zu, target queued after avg %.3fms, max %.3fms\n",
+            STATS.seeks, STATS.seekSumUs / 1000.0 / STATS.seeks,
+            STATS.seekMaxUs / 1000.0);
+    }
+    if (STATS.resizes) {
+        printf("Resizes: %zu\n", STATS.resizes);
+    }
+    if (STATS.rescaled) {
+        printf("Frames rescaled for a smaller terminal: %zu, avg %.3fms\n",
+            STATS.rescaled, STATS.rescaleUs / 1000.0 / STATS.rescaled);
+    }
+    if (OPTIONS.denoise && STATS.uniqueFrames) {
+        printf("Denoise: %.0f pixels changed per frame (%.0f without)\n",
+            STATS.denoisedChanges, STATS.noisyChanges);
+    }
+    if (OPTIONS.palette == PALETTE_SCENE) {
+        printf("Scene palettes: %zu, mean squared error %.1f "
+            "(%.1f with the xterm palette)\n",
+            STATS.scenes, STATS.paletteError, STATS.xtermError);
+    }
+    if (OPTIONS.kittyStandin) {
+        printf("Stand-in decoded %zu images (%zu from shared memory), "
+            "%zu errors, checksum %s\n",
+            STATS.standin.images,
+            STATS.standin.shmImages,
+            STATS.standin.errors,
+            STATS.standin.checksum == STATS.kittyChecksum ?
+                "matches" : "differs");
+    }
+}
+
+// Groups of OPTIONS.keyframeInterval frames start with a full redraw and
+// are encoded in parallel with buffers of their own, one group per thread
+// at a time
+bool PY_Player_encodeStream(PY_Player* p, const char* path) {
+    // the buffers clip frames to the terminal, which the stream is made for
+    struct winsize w;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1) {
+        fputs("--write-stream takes the size of the terminal on stdout\n",
+            stderr);
+        return false;
+    }
+    struct VS_Writer* writer = VS_Writer_new(path);
+    if (!writer) {
+        perror(path);
+        return false;
+    }
+    size_t interval = OPTIONS.keyframeInterval;
+    size_t groups = (INFO.nframes + interval - 1) / interval;
+    int threads = omp_get_max_threads();
+    PY_Player* players = malloc(threads * sizeof(*players));
+    AP_String* outs = calloc(threads, sizeof(*outs));
+    size_t* lengths = malloc(threads * interval * sizeof(*lengths));
+
+    uint64_t start = nowInUs();
+    size_t keyframes = 0, keyframeBytes = 0;
+    bool ok = true;
+    for (size_t first = 0; ok && first < groups; first += threads) {
+        size_t n = min(groups - first, (size_t)threads);
+        for (size_t i = 0; i < n; i++) {
+            players[i] = *p;
+            players[i].buf = NULL;
+            players[i].bufRgb = NULL;
+            PY_Player_createBuffers(&players[i]);
+        }
+        #pragma omp parallel for schedule(dynamic)
+        for (size_t i = 0; i < n; i++) {
+            size_t from = (first + i) * interval;
+            size_t to = min(from + interval, INFO.nframes);
+            outs[i].len = 0;
+            for (size_t f = from; f < to; f++) {
+                lengths[i * interval + f - from] =
+                    PY_Player_draw(&players[i], f, &outs[i]);
+            }
+        }
+        for (size_t i = 0; i < n; i++) {
+            size_t from = (first + i) * interval;
+            size_t to = min(from + interval, INFO.nframes);
+            const char* data = outs[i].data;
+            for (size_t f = from; ok && f < to; f++) {
+                size_t len = lengths[i * interval + f - from];
+                ok = VS_Writer_append(writer, data, len, f == from);
+                data += len;
+            }
+            keyframes++;
+            keyframeBytes += lengths[i * interval];
+            if (players[i].bufRgb) {
+                AP_BufferRgb_del(players[i].bufRgb);
+            }
+            if (players[i].buf) {
+                AP_Buffer_del(players[i].buf);
+            }
+        }
+    }
+
+    VS_Header header = {
+        .termRows = p->rows,
+        .termCols = p->cols,
+        .height = p->height,
+        .width = p->width,
+        .truecolor = OPTIONS.truecolor,
+        .text = OPTIONS.text,
+        .glyphs = OPTIONS.glyphs,
+        .scenePalette = OPTIONS.palette == PALETTE_SCENE,
+        .fps = INFO.fps,
+        .keyframeInterval = interval,
+    };
+    ok = VS_Writer_close(writer, header) && ok;
+    if (!ok) {
+        perror(path);
+    } else {
+        struct stat st;
+        stat(path, &st);
+        printf("Encoded %zu frames into %s in %.3fs, %zu keyframes of "
+            "%.1f bytes, %.1f bytes/frame in total\n",
+            INFO.nframes, path, (nowInUs() - start) / 1000000.0,
+            keyframes, keyframes ? (double)keyframeBytes / keyframes : 0.0,
+            INFO.nframes ? (double)st.st_size / INFO.nframes : 0.0);
+    }
+    for (int i = 0; i < threads; i++) {
+        AP_String_del(&outs[i]);
+    }
+    free(outs);
+    free(lengths);
+    free(players);
+    return ok;
+}
+
+// Whether the terminal on stdout can show the frames of a stream, which
+// redraw all of the terminal it was encoded in. A pipe, file or socket
+// takes them for whatever terminal reads them in the end
+static bool PY_streamFits(const VS_Header* header) {
+    struct winsize w;
+    return ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1 ||
+        (w.ws_row >= header->termRows && w.ws_col >= header->termCols);
+}
+
+// Playback starts at OPTIONS.start and frames are sent as they are stored.
+// When frames are skipped, their bytes go out with the next frame, unless
+// there is a keyframe in between to start from. Frames can't be rescaled,
+// after a resize they are drawn again from a keyframe on a cleared screen,
+// and not at all while the terminal is too small for them
+int PY_playStream(const char* path) {
+    struct VS_Reader* reader = VS_Reader_open(path);
+    if (!reader) {
+        if (errno == EINVAL) {
+            fprintf(stderr, "%s is not a stream of version %d\n", path,
+                VS_VERSION);
+        } else {
+            perror(path);
+        }
+        return 1;
+    }
+    const VS_Header* header = VS_Reader_header(reader);
+    if (!PY_streamFits(header)) {
+        fprintf(stderr, "%s needs a terminal of %ux%u cells\n",
+            path, header->termCols, header->termRows);
+        VS_Reader_close(reader);
+        return 1;
+    }
+    INFO.nframes = header->frames;
+    INFO.fps = header->fps;
+    OPTIONS.truecolor = header->truecolor;
+    OPTIONS.text = header->text;
+    OPTIONS.glyphs = header->glyphs;
+    OPTIONS.palette = header->scenePalette ? PALETTE_SCENE : PALETTE_XTERM;
+    size_t first = OPTIONS.start * INFO.fps;
+    first = INFO.nframes && first >= INFO.nframes ? INFO.nframes - 1 : first;
+    printf("Playing %s, %zu frames, keyframe every %u\n",
+        path, INFO.nframes, header->keyframeInterval);
+
+    bool sync = OPTIONS.sync == SYNC_ON || (OPTIONS.sync == SYNC_AUTO &&
+        OUT_querySyncSupport(STDIN_FILENO, STDOUT_FILENO, 200));
+    signal(SIGINT, PY_onSignal);
+    signal(SIGTERM, PY_onSignal);
+    // a closed output is reported after playback
+    signal(SIGPIPE, SIG_IGN);
+    AP_clearScreen(NULL);
+    AP_showcursor(false);
+    PY_stdoutWasNonBlocking = OUT_setNonBlocking(STDOUT_FILENO, true);
+    struct OUT_Writer* writer = OUT_Writer_new(STDOUT_FILENO, 2, sync);
+    OUT_Writer_setRateLimit(writer, OPTIONS.sinkKbps * 1000 / 8);
+    // frames are sent from the file without reading them
+    const char* data = VS_Reader_data(reader);
+    OUT_Writer_setFile(writer, VS_Reader_fd(reader), data);
+
+    uint64_t playStart = nowInUs();
+    PY_Control control = PY_Control_new(writer, first);
+    #define frameTime(f) PY_Control_due(&control, (f))
+
+    // frames from next on have not been sent, seeking replays the deltas
+    // from the keyframe before the first frame
+    size_t next = VS_Reader_keyframe(reader, first);
+    bool held = false;
+    bool fits = true;
+    bool resize = false;
+    bool cleared = true;
+    for (size_t f = first; f < INFO.nframes;
+        f = PY_Control_wait(&control, f + 1, held))
+    {
+        if ((STATS.outputError = OUT_Writer_failed(writer))) {
+            break;
+        }
+        uint64_t start = nowInUs();
+        held = false;
+        if (control.resized) {
+            control.resized = false;
+            fits = PY_streamFits(header);
+            resize = true;
+            cleared = false;
+            STATS.resizes++;
+        }
+        if (start >= frameTime(f + 1) || !fits) {
+            STATS.dropped++;
+            continue;
+        }
+        if (OUT_Writer_pending(writer) > 0) {
+            held = true;
+            continue;
+        }
+        // the range of a frame goes out before its buffer, so the screen
+        // is cleared by a frame of its own, and the frame is tried again
+        // when that was written
+        if (!cleared) {
+            AP_String* out = OUT_Writer_acquire(writer);
+            AP_encodeResetColor(out);
+            AP_encodeClear(out);
+            OUT_Writer_submit(writer);
+            cleared = true;
+            held = true;
+            continue;
+        }
+
+        // The frames from next to f follow each other in the file. A seek
+        // or resize starts over from the keyframe before its target
+        bool seek = control.redraw;
+        control.redraw = false;
+        size_t keyframe = VS_Reader_keyframe(reader, f);
+        next = seek || resize || keyframe > next ? keyframe : next;
+        resize = false;
+        size_t len;
+        const char* from = VS_Reader_frame(reader, next, &len);
+        const char* to = VS_Reader_frame(reader, f, &len) + len;
+        size_t bytes = to - from;
+        next = f + 1;
+        AP_String* out = OUT_Writer_acquire(writer);
+        OUT_Writer_setRange(writer, from - data, bytes);
+        STATS.bytes += bytes;
+        STATS.frames++;
+
+        uint64_t end = nowInUs();
+        if (end > frameTime(f + 1)) {
+            STATS.late++;
+        }
+        STATS.encodeUs += end - start;
+        char status[64];
+        int statusLen = PY_formatStatus(status, sizeof(status), &control,
+            1000000.0 / (end - start + 1), bytes);
+        AP_encodeMove(out, 0, 0);
+        AP_encodeResetColor(out);
+        AP_String_append(out, status, statusLen);
+        OUT_Writer_submit(writer);
+        if (seek) {
+            PY_Control_seeked(&control);
+        }
+    }
+    #undef frameTime
+    EV_Loop_del(control.loop);
+
+    STATS.output = OUT_Writer_stats(writer);
+    STATS.outputError = OUT_Writer_del(writer);
+    STATS.us = nowInUs() - playStart;
+    VS_Reader_close(reader);
+
+    if (OPTIONS.palette == PALETTE_SCENE) {
+        AP_String restore = { 0 };
+        AP_encodeResetPalette(&restore);
+        OUT_writeAll(STDOUT_FILENO, restore.data, restore.len);
+        AP_String_del(&restore);
+    }
+    OUT_setNonBlocking(STDOUT_FILENO, PY_stdoutWasNonBlocking);
+    AP_resettextcolor();
+    AP_clearScreen(NULL);
+    AP_showcursor(true);
+    puts("");
+    PY_printStats();
+    if (STATS.outputError) {
+        fprintf(stderr, "Playback stopped, the output failed: %s\n",
+            strerror(STATS.outputError));
+        return 1;
+    }
+    return 0;
+}
+
+int PY_Player_play(PY_Player* p) {
+    // frames are rescaled into these when the terminal shrinks
+    size_t pixels = p->height * p->width;
+    p->scaled = malloc(pixels * sizeof(*p->scaled));
+    p->scaledBlock = p->blockFrames ?
+        malloc(p->height / 2 * p->blockRows * p->width * p->blockCols *
+            sizeof(*p->scaledBlock)) :
+        NULL;
+    p->scaledImage = p->imageFrames ?
+        malloc(p->imageHeight * p->imageWidth * sizeof(*p->scaledImage)) :
+        NULL;
+    p->scaledIndexed = p->indexedFrames ?
+        malloc(pixels * sizeof(*p->scaledIndexed)) : NULL;
+
+    signal(SIGINT, PY_onSignal);
+    signal(SIGTERM, PY_onSignal);
+    // a closed output is reported after playback
+    signal(SIGPIPE, SIG_IGN);
+    AP_clearScreen(NULL);
+    AP_showcursor(false);
+    PY_stdoutWasNonBlocking = OUT_setNonBlocking(STDOUT_FILENO, true);
+    PY_Player_playFrames(p);
+    if (p->bufRgb) {
+        AP_BufferRgb_del(p->bufRgb);
+    }
+    if (p->buf) {
+        AP_Buffer_del(p->buf);
+    }
+    free(p->scratch);
+    free(p->scaled);
+    free(p->scaledBlock);
+    free(p->scaledImage);
+    free(p->scaledIndexed);
+    if (p->kitty) {
+        if (!KG_Encoder_shm(p->kitty)) {
+            OPTIONS.kitty = KITTY_DIRECT;
+        }
+        KG_Encoder_del(p->kitty);
+        if (!OPTIONS.kittyStandin) {
+            AP_String remove = { 0 };
+            KG_encodeDelete(&remove);
+            OUT_writeAll(STDOUT_FILENO, remove.data, remove.len);
+            AP_String_del(&remove);
+        }
+    }
+    if (p->sixel) {
+        SX_Encoder_del(p->sixel);
+        if (OPTIONS.sixel == SIXEL_STABLE) {
+            AP_String restore = { 0 };
+            SX_encodeRestore(&restore);
+            OUT_writeAll(STDOUT_FILENO, restore.data, restore.len);
+            AP_String_del(&restore);
+        }
+    }
+    if (OPTIONS.palette == PALETTE_SCENE) {
+        AP_String restore = { 0 };
+        AP_encodeResetPalette(&restore);
+        OUT_writeAll(STDOUT_FILENO, restore.data, restore.len);
+        AP_String_del(&restore);
+    }
+    OUT_setNonBlocking(STDOUT_FILENO, PY_stdoutWasNonBlocking);
+
+    AP_resettextcolor();
+    AP_clearScreen(NULL);
+    AP_showcursor(true);
+
+    puts("");
+    PY_printStats();
+    if (STATS.outputError) {
+        fprintf(stderr, "Playback stopped, the output failed: %s\n",
+            strerror(STATS.outputError));
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "ansipixel.h"
+#include "kitty.h"
+#include "sixel.h"
+
+// Plays the loaded frames on the terminal on stdout, or encodes them into a
+// stream file, and plays stream files. Playback follows the clock of the
+// video and the keys, and is set up by OPTIONS
+
+// seeks of the arrow keys, left and right, down and up
+#define PY_SEEK_SECONDS 5
+#define PY_SEEK_LONG_SECONDS 60
+// speeds + and - step between, doubling or halving
+#define PY_SPEED_MIN 0.25
+#define PY_SPEED_MAX 4.0
+
+// Quality ladder for --adaptive, from best to cheapest.
+// Thresholds only apply if they are above --threshold
+typedef struct {
+    bool truecolor;
+    unsigned threshold;
+    bool half; // draw from the frames precomputed at half resolution
+} PY_Level;
+
+// what playback draws with. Without --adaptive only the buffer matching
+// --truecolor exists and halfFrames is NULL.
+// Frames are kept at the size they were loaded at, height by width. The
+// buffers cover the terminal of rows by cols cells and frames are drawn at
+// drawHeight by drawWidth with their top left pixel at top, left, which is
+// smaller when the terminal shrank. They are rescaled into the scaled
+// buffers then, which are big enough for any drawn size
+typedef struct {
+    struct AP_Buffer* buf;
+    struct AP_BufferRgb* bufRgb;
+    // Frames that are equal to an earlier one in every resolution share
+    // its pixels, see FR_dedup
+    AP_ColorRgb** frames;
+    // frames at sub-pixel resolution for --glyphs and braille
+    AP_ColorRgb** blockFrames;
+    size_t blockRows, blockCols; // sub-pixels per cell
+    AP_ColorRgb** halfFrames;
+    AP_ColorRgb* scratch; // a half resolution frame scaled back up
+    // frames at image resolution for --kitty and --sixel
+    struct KG_Encoder* kitty;
+    struct SX_Encoder* sixel;
+    AP_ColorRgb** imageFrames;
+    size_t imageHeight, imageWidth;
+    bool* cuts; // frames that start a scene, found while loading
+    // with --palette scene, frames as indices into the palette of their scene
+    AP_Color** indexedFrames;
+    size_t* scenes;
+    AP_ColorRgb* palettes; // FR_SCENE_COLORS per scene
+    size_t height, width;
+    size_t rows, cols;
+    size_t drawHeight, drawWidth;
+    size_t top, left;
+    size_t drawImageHeight, drawImageWidth;
+    AP_ColorRgb* scaled;
+    AP_ColorRgb* scaledBlock;
+    AP_ColorRgb* scaledImage;
+    AP_Color* scaledIndexed;
+    PY_Level level;
+} PY_Player;
+
+// the size of the terminal on stdout in cells, 80x24 without one
+void PY_terminalSize(size_t* rows, size_t* cols);
+// Largest size of the video that fits below the status line of a terminal
+// of rows by cols cells, with two pixels per cell vertically. Any fraction
+// of the video size fits, it is not scaled up and the height is even so
+// that frames fill whole cells
+void PY_fitFrame(size_t rows, size_t cols, size_t* height, size_t* width);
+
+// Fits the frames to a terminal of rows by cols cells: they are drawn
+// smaller when they don't fit anymore, never larger than they were loaded,
+// and centered below the status line on an even pixel row, with the
+// borders left blank
+void PY_Player_fit(PY_Player* p, size_t rows, size_t cols);
+// Creates the buffers that --truecolor and --adaptive draw with, at the
+// top level of the quality ladder
+void PY_Player_createBuffers(PY_Player* p);
+// encodes the frames into a stream file at path instead of playing them
+bool PY_Player_encodeStream(PY_Player* p, const char* path);
+// Plays the frames of a fitted player with buffers, frees what playback
+// allocated and prints the statistics. Returns the exit status
+int PY_Player_play(PY_Player* p);
+
+// plays a stream made with --write-stream, returns the exit status
+int PY_playStream(const char* path);
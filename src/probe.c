@@ -0,0 +1,207 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "cbmp.h"
+#include "imageutil.h"
+#include "options.h"
+#include "output.h"
+#include "player.h"
+#include "probe.h"
+
+// how long PR_fps writes to the terminal to measure it, and the frames it
+// measures the bytes of a frame at
+#define PR_US 250000
+#define PR_CHUNK 1024
+#define PR_POINTS 4
+#define PR_STEPS { 1, 2, 4, 8 }
+
+void PR_readSources(
+    const char* dir, size_t from, size_t to, AP_ColorRgb* source)
+{
+    size_t n = INFO.h * INFO.w;
+    uint32_t* sums = to - from > 1 ? calloc(3 * n, sizeof(*sums)) : NULL;
+    for (size_t f = from; f < to; f++) {
+        char name[1024] = {0};
+        sprintf(name, "%s/%zu.bmp", dir, f + 1);
+        BMP* bmp = bopen(name);
+        for (size_t i = 0; i < INFO.h; i++) {
+            for (size_t j = 0; j < INFO.w; j++) {
+                unsigned char r, g, b;
+                get_pixel_rgb(bmp, j, INFO.h - i - 1, &r, &g, &b);
+                source[i*INFO.w + j] = AP_ColorRgb(r, g, b);
+            }
+        }
+        bclose(bmp);
+        for (size_t i = 0; sums && i < n; i++) {
+            sums[3*i] += AP_ColorRgb_r(source[i]);
+            sums[3*i + 1] += AP_ColorRgb_g(source[i]);
+            sums[3*i + 2] += AP_ColorRgb_b(source[i]);
+        }
+    }
+    if (sums) {
+        uint32_t k = to - from;
+        for (size_t i = 0; i < n; i++) {
+            source[i] = AP_ColorRgb((sums[3*i] + k/2) / k,
+                (sums[3*i + 1] + k/2) / k, (sums[3*i + 2] + k/2) / k);
+        }
+        free(sums);
+    }
+}
+
+// appends frame drawn with the colors playback uses to out, text modes
+// with the ramp, which sends as much per cell as braille
+static size_t PR_encode(
+    struct AP_Buffer* buf, struct AP_BufferRgb* bufRgb,
+    const AP_ColorRgb* frame, size_t height, size_t width, AP_String* out)
+{
+    if (bufRgb) {
+        AP_BufferRgb_blit(bufRgb, frame, width, 2, 0, height, width);
+        return AP_BufferRgb_encode(bufRgb, out);
+    } else if (OPTIONS.text) {
+        AP_Buffer_blitText(buf, frame, width, 1, 0, height / 2, width);
+    } else {
+        AP_Buffer_blitRgb(buf, frame, width, 2, 0, height, width);
+    }
+    return AP_Buffer_encode(buf, out);
+}
+
+// The bytes of a frame following the one step source frames before it are
+// measured for the steps of PR_STEPS, from PR_POINTS frames spread over the
+// video, and interpolated for the steps between them. The bytes per second
+// the terminal takes are measured by writing a full redraw over and over
+// for PR_US
+double PR_fps(const char* dir, size_t height, size_t width) {
+    static const size_t steps[] = PR_STEPS;
+    enum { NSTEPS = sizeof(steps) / sizeof(*steps) };
+    size_t maxStep = steps[NSTEPS - 1];
+    if (!isatty(STDOUT_FILENO) || INFO.nframes <= maxStep) {
+        return INFO.fps;
+    }
+    size_t rows, cols;
+    PY_terminalSize(&rows, &cols);
+    struct AP_Buffer* buf = NULL;
+    struct AP_BufferRgb* bufRgb = NULL;
+    if (OPTIONS.truecolor) {
+        bufRgb = AP_BufferRgb_new(2 * rows, cols);
+    } else {
+        buf = AP_Buffer_new(2 * rows, cols);
+        AP_Buffer_setText(buf,
+            OPTIONS.text ? AP_TEXT_RAMP : AP_TEXT_NONE, OPTIONS.greys);
+    }
+
+    AP_String full = { 0 };
+    AP_String out = { 0 };
+    double bytes[NSTEPS] = { 0 };
+    AP_ColorRgb* frames[NSTEPS + 1];
+    for (size_t i = 1; i <= PR_POINTS; i++) {
+        size_t f = min(i * INFO.nframes / (PR_POINTS + 1),
+            INFO.nframes - 1 - maxStep);
+        for (int k = 0; k <= NSTEPS; k++) {
+            size_t from = f + (k ? steps[k - 1] : 0);
+            AP_ColorRgb* source = malloc(INFO.h*INFO.w*sizeof(*source));
+            PR_readSources(dir, from, from + 1, source);
+            frames[k] = resize_bicubic(&source, INFO.h, INFO.w, height, width);
+            free(source);
+        }
+        for (int k = 0; k < NSTEPS; k++) {
+            if (bufRgb) {
+                AP_BufferRgb_refresh(bufRgb);
+            } else {
+                AP_Buffer_refresh(buf);
+            }
+            // the first full redraw is what the terminal is measured with
+            out.len = 0;
+            AP_String* first = full.len ? &out : &full;
+            AP_encodeMove(first, 0, 0);
+            PR_encode(buf, bufRgb, frames[0], height, width, first);
+            bytes[k] += PR_encode(buf, bufRgb, frames[k + 1],
+                height, width, &out) / (double)PR_POINTS;
+        }
+        for (int k = 0; k <= NSTEPS; k++) {
+            free(frames[k]);
+        }
+    }
+    if (bufRgb) {
+        AP_BufferRgb_del(bufRgb);
+    } else {
+        AP_Buffer_del(buf);
+    }
+
+    // Writes only wait for the terminal once the kernel buffer is full.
+    // Bytes are counted for PR_US after the first write that waited,
+    // in small writes so that slow terminals are measured as well. A
+    // terminal that takes everything without waiting is fast enough
+    uint64_t begin = nowInUs();
+    uint64_t start = 0, end = begin;
+    size_t counted = 0;
+    size_t off = 0;
+    for (; start ? end - start < PR_US : end - begin < PR_US;
+        off = (off + PR_CHUNK) % full.len)
+    {
+        size_t len = min(PR_CHUNK, full.len - off);
+        uint64_t before = end;
+        if (!OUT_writeAll(STDOUT_FILENO, full.data + off, len)) {
+            break;
+        }
+        end = nowInUs();
+        if (start) {
+            counted += len;
+        } else if (end - before > 1000) {
+            start = end;
+        }
+    }
+    double bytesPerSecond = !start ? INFINITY :
+        counted * 1000000.0 / (end - start);
+    // don't leave an escape sequence unfinished
+    if (off) {
+        OUT_writeAll(STDOUT_FILENO, full.data + off, full.len - off);
+    }
+    AP_resettextcolor();
+    AP_clearScreen(NULL);
+
+    // the smallest step whose frames the terminal keeps up with
+    size_t step = 1;
+    for (; INFO.fps / (step + 1) >= 1; step++) {
+        int k = 0;
+        while (k < NSTEPS - 1 && steps[k + 1] <= step) {
+            k++;
+        }
+        double frameBytes = step >= maxStep ?
+            min(bytes[NSTEPS - 1] * step / maxStep, (double)full.len) :
+            bytes[k] + (bytes[k + 1] - bytes[k]) *
+                (step - steps[k]) / (steps[k + 1] - steps[k]);
+        if (INFO.fps / step * frameBytes <= bytesPerSecond) {
+            break;
+        }
+    }
+    if (!start) {
+        puts("Terminal takes frames as fast as they are written");
+    } else {
+        printf("Terminal takes %.0fkB/s, frames take %.0fB one source "
+            "frame apart and %.0fB %zu apart, decoding every %zu. frame\n",
+            bytesPerSecond / 1000, bytes[0], bytes[NSTEPS - 1], maxStep,
+            step);
+    }
+    AP_String_del(&full);
+    AP_String_del(&out);
+    return INFO.fps / step;
+}
+
+size_t* PR_pickFrames(double fps) {
+    if (fps >= INFO.fps || !INFO.nframes) {
+        return NULL;
+    }
+    double step = INFO.fps / fps;
+    size_t n = ceil(INFO.nframes / step);
+    size_t* sources = malloc((n + 1) * sizeof(*sources));
+    for (size_t i = 0; i < n; i++) {
+        sources[i] = min((size_t)(i * step + 0.5), INFO.nframes - 1);
+    }
+    sources[n] = INFO.nframes;
+    printf("Decoding %zu of %zu frames for %.3f fps\n",
+        n, INFO.nframes, fps);
+    INFO.nframes = n;
+    INFO.fps = fps;
+    return sources;
+}
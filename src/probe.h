@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+#include "ansipixel.h"
+
+// Decoding the source frames of a directory, and picking the ones to decode
+// for --fps from what the terminal on stdout can take
+
+// Decodes source frames from to to (from 0) of dir into source, INFO.h by
+// INFO.w, averaging them when there are more than one
+void PR_readSources(
+    const char* dir, size_t from, size_t to, AP_ColorRgb* source);
+
+// Frames per second to decode for the terminal on stdout, every step-th
+// source frame so that motion stays even. Frames are measured at height by
+// width pixels, drawn like playback does. The fps of the source when stdout
+// is not a terminal
+double PR_fps(const char* dir, size_t height, size_t width);
+
+// Picks the source frames for playing at fps: frame i is source frame
+// sources[i], the one due at the same time, and sources[INFO.nframes] is
+// the number of source frames. INFO is changed to the frames played.
+// NULL when fps is not below the source fps and every frame is played
+size_t* PR_pickFrames(double fps);
@@ -0,0 +1,110 @@
+#include <stdlib.h>
+
+#include "quality.h"
+
+// load is an exponential moving average of the busier of encoding and
+// writing relative to the frame period.
+// A level is dropped after two overloaded periods in a row or when the
+// load gets close to the period. Quality is raised again only after
+// stableFrames periods with plenty of headroom. When a raised level has
+// to be dropped again soon after, stableFrames is doubled so the
+// controller does not keep bouncing between two levels.
+typedef struct {
+    int levels;
+    int level;
+    uint64_t periodUs;
+    double load;
+    int overloadedRun;
+    size_t calm; // periods since the last overload
+    size_t cooldown; // periods left before the next decision
+    size_t stableFrames;
+    size_t sinceRaise;
+    const char* reason;
+} QC_Controller;
+#define QC_Controller(c) ((QC_Controller*)(c))
+
+#define QC_ALPHA 0.2
+#define QC_HIGH_LOAD 0.9
+#define QC_LOW_LOAD 0.5
+#define QC_MAX_STABLE_SECONDS 16
+
+struct QC_Controller* QC_Controller_new(
+    int levels,
+    int start,
+    uint64_t periodUs)
+{
+    size_t second = 1000000 / (periodUs ? periodUs : 1);
+    QC_Controller* c = malloc(sizeof(*c));
+    (*c) = (QC_Controller){
+        .levels = levels,
+        .level = start,
+        .periodUs = periodUs,
+        .load = 0,
+        .overloadedRun = 0,
+        .calm = 0,
+        .cooldown = 0,
+        .stableFrames = second ? second : 1,
+        .sinceRaise = SIZE_MAX,
+        .reason = NULL,
+    };
+    return (struct QC_Controller*)c;
+}
+
+void QC_Controller_del(struct QC_Controller* c) {
+    free(c);
+}
+
+int QC_Controller_update(struct QC_Controller* controller, QC_Sample sample) {
+    QC_Controller* c = QC_Controller(controller);
+    uint64_t busy = sample.encodeUs > sample.writeUs ?
+        sample.encodeUs : sample.writeUs;
+    c->load = (1 - QC_ALPHA) * c->load +
+        QC_ALPHA * (double)busy / c->periodUs;
+    c->overloadedRun = sample.overloaded ? c->overloadedRun + 1 : 0;
+    c->calm = sample.overloaded ? 0 : c->calm + 1;
+    c->sinceRaise += c->sinceRaise != SIZE_MAX;
+    c->reason = NULL;
+
+    // give the last change time to show in the measurements
+    if (c->cooldown) {
+        c->cooldown--;
+        return c->level;
+    }
+
+    size_t second = 1000000 / c->periodUs;
+    if ((c->overloadedRun >= 2 || c->load > QC_HIGH_LOAD) &&
+        c->level < c->levels - 1)
+    {
+        c->reason = c->overloadedRun >= 2 ?
+            "frames overloaded" : "load close to frame period";
+        // the raise that got us here was too optimistic
+        if (c->sinceRaise < 2 * c->stableFrames &&
+            c->stableFrames < QC_MAX_STABLE_SECONDS * second)
+        {
+            c->stableFrames *= 2;
+        }
+        c->level++;
+        c->overloadedRun = 0;
+        c->calm = 0;
+        c->cooldown = second / 2;
+        c->sinceRaise = SIZE_MAX;
+        return c->level;
+    }
+
+    if (c->load < QC_LOW_LOAD && c->calm >= c->stableFrames && c->level > 0) {
+        c->reason = "headroom";
+        c->level--;
+        c->calm = 0;
+        c->cooldown = second / 2;
+        c->sinceRaise = 0;
+    }
+    return c->level;
+}
+
+const char* QC_Controller_reason(struct QC_Controller* c) {
+    return QC_Controller(c)->reason;
+}
+
+double QC_Controller_load(struct QC_Controller* c) {
+    return QC_Controller(c)->load;
+}
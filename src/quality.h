@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Feedback controller that moves along a ladder of quality levels to keep
+// up with the frame deadline. Level 0 is the best quality, higher levels
+// are cheaper to encode and send. What a level means is up to the caller.
+struct QC_Controller;
+
+// measurements of one frame period
+typedef struct {
+    uint64_t encodeUs; // time spent preparing and encoding the frame
+    uint64_t writeUs; // time from the frame being ready until it is written
+    size_t bytes;
+    bool overloaded; // frame was dropped, held back or late
+} QC_Sample;
+
+struct QC_Controller* QC_Controller_new(
+    int levels, int start, uint64_t periodUs);
+void QC_Controller_del(struct QC_Controller* c);
+// feed the measurements of one frame period, returns the level to use next
+int QC_Controller_update(struct QC_Controller* c, QC_Sample sample);
+// why the last update changed the level, NULL if it did not
+const char* QC_Controller_reason(struct QC_Controller* c);
+// smoothed fraction of the frame period spent encoding or writing
+double QC_Controller_load(struct QC_Controller* c);
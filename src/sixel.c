@@ -0,0 +1,238 @@
+#include <omp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "palette.h"
+#include "sixel.h"
+
+#define CSI "\e["
+#define DCS "\eP"
+#define ST "\e\\"
+// A kept palette is rebuilt once it fits a frame this much worse than the
+// frame it was built for. The slack keeps flat frames, which are fit almost
+// perfectly, from rebuilding on every bit of noise
+#define SX_REBUILD_FACTOR 1.5
+#define SX_REBUILD_SLACK 32
+
+// scratch of one thread, which encodes a run of bands into out
+typedef struct {
+    AP_String out;
+    uint8_t* sixels; // 256 rows of width sixels, one row per color
+    uint16_t* last; // last column each color of the band appears in
+    bool present[256];
+    uint8_t order[256]; // colors of the band in order of appearance
+} SX_Group;
+
+// palette has the histogram of the current frame
+typedef struct {
+    bool stable;
+    struct PL_Palette* palette;
+    double fit; // mean squared error of the frame the palette was built for
+    SX_Group* groups;
+    int ngroups;
+    size_t width; // that the groups have room for
+} SX_Encoder;
+#define SX_Encoder(e) ((SX_Encoder*)(e))
+
+struct SX_Encoder* SX_Encoder_new(int colors, bool stable) {
+    SX_Encoder* e = calloc(1, sizeof(*e));
+    e->palette = PL_Palette_new(colors);
+    e->stable = stable;
+    return (struct SX_Encoder*)e;
+}
+
+void SX_Encoder_del(struct SX_Encoder* encoder) {
+    SX_Encoder* e = SX_Encoder(encoder);
+    for (int i = 0; i < e->ngroups; i++) {
+        AP_String_del(&e->groups[i].out);
+        free(e->groups[i].sixels);
+        free(e->groups[i].last);
+    }
+    free(e->groups);
+    PL_Palette_del(e->palette);
+    free(e);
+}
+
+size_t SX_Encoder_palettes(struct SX_Encoder* e) {
+    return PL_Palette_builds(SX_Encoder(e)->palette);
+}
+
+void SX_encodeRestore(AP_String* out) {
+    AP_String_append(out, CSI "?1070h", sizeof(CSI "?1070h") - 1);
+}
+
+static char* SX_writeNumber(char* o, size_t n) {
+    char digits[20];
+    int len = 0;
+    do {
+        digits[len++] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    while (len) {
+        *o++ = digits[--len];
+    }
+    return o;
+}
+
+// runs of more than 3 are shorter repeated
+static char* SX_writeRun(char* o, size_t n, char sixel) {
+    if (n > 3) {
+        *o++ = '!';
+        o = SX_writeNumber(o, n);
+        *o++ = sixel;
+    } else {
+        while (n--) {
+            *o++ = sixel;
+        }
+    }
+    return o;
+}
+
+// Every band draws each of its colors in one pass over the columns, with a
+// carriage return ($) in between and a line feed (-) at the end
+static void SX_Encoder_encodeBands(
+    const SX_Encoder* e,
+    SX_Group* g,
+    const AP_ColorRgb* img,
+    size_t stride,
+    size_t h,
+    size_t w,
+    size_t first,
+    size_t last)
+{
+    const uint8_t* table = PL_Palette_table(e->palette);
+    g->out.len = 0;
+    size_t bands = (h + 5) / 6;
+    for (size_t band = first; band < last; band++) {
+        size_t rows = h - band * 6 < 6 ? h - band * 6 : 6;
+        int n = 0;
+        for (size_t r = 0; r < rows; r++) {
+            const AP_ColorRgb* row = img + (band * 6 + r) * stride;
+            for (size_t x = 0; x < w; x++) {
+                int c = table[PL_bin(row[x])];
+                if (!g->present[c]) {
+                    g->present[c] = true;
+                    g->order[n++] = c;
+                    g->last[c] = 0;
+                }
+                g->sixels[c * w + x] |= 1 << r;
+                if (x > g->last[c]) {
+                    g->last[c] = x;
+                }
+            }
+        }
+
+        for (int k = 0; k < n; k++) {
+            int c = g->order[k];
+            uint8_t* sixels = g->sixels + c * w;
+            size_t end = g->last[c] + 1;
+            // a run is at most 7 characters for 4 or more sixels
+            AP_String_reserve(&g->out, 2 * end + 8);
+            char* o = g->out.data + g->out.len;
+            if (k) {
+                *o++ = '$';
+            }
+            *o++ = '#';
+            o = SX_writeNumber(o, c);
+            size_t x = 0;
+            while (x < end) {
+                uint8_t s = sixels[x];
+                size_t run = 1;
+                while (x + run < end && sixels[x + run] == s) {
+                    run++;
+                }
+                o = SX_writeRun(o, run, '?' + s);
+                memset(sixels + x, 0, run);
+                x += run;
+            }
+            g->out.len = o - g->out.data;
+            g->present[c] = false;
+        }
+        if (band + 1 < bands) {
+            AP_String_append(&g->out, "-", 1);
+        }
+    }
+}
+
+size_t SX_Encoder_encode(
+    struct SX_Encoder* encoder,
+    const AP_ColorRgb* img,
+    size_t stride,
+    size_t h,
+    size_t w,
+    size_t row,
+    size_t col,
+    AP_String* out)
+{
+    SX_Encoder* e = SX_Encoder(encoder);
+    size_t start = out->len;
+
+    PL_Palette_clear(e->palette);
+    PL_Palette_add(e->palette, img, stride, h, w);
+    bool send = !e->stable || !PL_Palette_builds(e->palette);
+    if (!send && PL_Palette_fit(e->palette) >
+        e->fit * SX_REBUILD_FACTOR + SX_REBUILD_SLACK)
+    {
+        send = true;
+    }
+    if (send) {
+        PL_Palette_build(e->palette);
+        e->fit = PL_Palette_fit(e->palette);
+    }
+
+    AP_encodeMove(out, row, col);
+    if (send && e->stable) {
+        AP_String_append(out, CSI "?1070l", sizeof(CSI "?1070l") - 1);
+    }
+    // keep the background under the image, 1:1 pixels
+    char header[64];
+    int headerLen = snprintf(header, sizeof(header),
+        DCS "0;1;0q\"1;1;%zu;%zu", w, h);
+    AP_String_append(out, header, headerLen);
+    if (send) {
+        for (int k = 0; k < PL_Palette_size(e->palette); k++) {
+            AP_ColorRgb c = PL_Palette_color(e->palette, k);
+            char color[32];
+            int colorLen = snprintf(color, sizeof(color), "#%d;2;%d;%d;%d", k,
+                (AP_ColorRgb_r(c) * 100 + 127) / 255,
+                (AP_ColorRgb_g(c) * 100 + 127) / 255,
+                (AP_ColorRgb_b(c) * 100 + 127) / 255);
+            AP_String_append(out, color, colorLen);
+        }
+    }
+
+    // one run of bands per thread, joined in order
+    size_t bands = (h + 5) / 6;
+    int threads = omp_get_max_threads();
+    int ngroups = bands < (size_t)threads ? (int)bands : threads;
+    if (ngroups > e->ngroups || w > e->width) {
+        size_t width = w > e->width ? w : e->width;
+        int count = ngroups > e->ngroups ? ngroups : e->ngroups;
+        e->groups = realloc(e->groups, count * sizeof(*e->groups));
+        for (int i = 0; i < count; i++) {
+            SX_Group* g = &e->groups[i];
+            if (i >= e->ngroups) {
+                *g = (SX_Group){ 0 };
+            }
+            free(g->sixels);
+            free(g->last);
+            g->sixels = calloc(256 * width, sizeof(*g->sixels));
+            g->last = calloc(256, sizeof(*g->last));
+        }
+        e->ngroups = count;
+        e->width = width;
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < ngroups; i++) {
+        SX_Encoder_encodeBands(e, &e->groups[i], img, stride, h, w,
+            bands * i / ngroups, bands * (i + 1) / ngroups);
+    }
+    for (int i = 0; i < ngroups; i++) {
+        AP_String_append(out, e->groups[i].out.data, e->groups[i].out.len);
+    }
+    AP_String_append(out, ST, sizeof(ST) - 1);
+    return out->len - start;
+}
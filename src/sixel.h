@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "ansipixel.h"
+
+// Draws frames as sixel images. Every frame is quantized to a palette built
+// with median cut over a 15 bit color histogram, then encoded in bands of
+// six pixel rows with run length encoding. Bands are encoded in parallel.
+struct SX_Encoder;
+
+// colors is the palette size (2-256). With stable, a palette is kept for
+// the following frames while it still fits them, and is only sent again
+// when it is rebuilt. That needs color registers shared between images,
+// which the encoder turns on with DECRST 1070
+struct SX_Encoder* SX_Encoder_new(int colors, bool stable);
+void SX_Encoder_del(struct SX_Encoder* e);
+// Append the sixel image of the h*w pixels of img, whose rows are stride
+// pixels apart, with its top left at cell (row, col). Returns the bytes
+// appended
+size_t SX_Encoder_encode(
+    struct SX_Encoder* e, const AP_ColorRgb* img, size_t stride,
+    size_t h, size_t w, size_t row, size_t col, AP_String* out);
+// palettes built so far
+size_t SX_Encoder_palettes(struct SX_Encoder* e);
+// append the sequence that gives every image its own color registers again
+void SX_encodeRestore(AP_String* out);
@@ -0,0 +1,204 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stream.h"
+
+// entries of the frames appended so far, written as the index on close
+typedef struct {
+    FILE* file;
+    uint64_t offset;
+    VS_Entry* entries;
+    size_t frames, capacity;
+    bool failed;
+} VS_Writer;
+#define VS_Writer(w) ((VS_Writer*)(w))
+
+// keyframes lists the frames of the index flagged VS_KEYFRAME, in order
+typedef struct {
+    int fd;
+    const char* data;
+    size_t size;
+    const VS_Header* header;
+    const VS_Entry* entries;
+    size_t* keyframes;
+    size_t nkeyframes;
+} VS_Reader;
+#define VS_Reader(r) ((VS_Reader*)(r))
+
+struct VS_Writer* VS_Writer_new(const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        return NULL;
+    }
+    VS_Writer* w = calloc(1, sizeof(*w));
+    w->file = file;
+    w->offset = sizeof(VS_Header);
+    VS_Header empty = { 0 };
+    w->failed = fwrite(&empty, sizeof(empty), 1, file) != 1;
+    return (struct VS_Writer*)w;
+}
+
+bool VS_Writer_append(
+    struct VS_Writer* writer,
+    const char* data,
+    size_t len,
+    bool keyframe)
+{
+    VS_Writer* w = VS_Writer(writer);
+    if (w->frames == w->capacity) {
+        w->capacity = w->capacity ? 2 * w->capacity : 1024;
+        w->entries = realloc(w->entries, w->capacity * sizeof(*w->entries));
+    }
+    w->entries[w->frames++] = (VS_Entry){
+        .offset = w->offset,
+        .length = len,
+        .flags = keyframe ? VS_KEYFRAME : 0,
+    };
+    w->offset += len;
+    if (len && fwrite(data, len, 1, w->file) != 1) {
+        w->failed = true;
+    }
+    return !w->failed;
+}
+
+bool VS_Writer_close(struct VS_Writer* writer, VS_Header header) {
+    VS_Writer* w = VS_Writer(writer);
+    memcpy(header.magic, VS_MAGIC, sizeof(header.magic));
+    header.version = VS_VERSION;
+    header.frames = w->frames;
+    // the index is aligned for reading it in place
+    static const char zeros[sizeof(uint64_t)];
+    size_t padding = -w->offset % sizeof(uint64_t);
+    header.index = w->offset + padding;
+    bool ok = !w->failed &&
+        (!padding || fwrite(zeros, padding, 1, w->file) == 1) &&
+        (!w->frames ||
+            fwrite(w->entries, sizeof(*w->entries), w->frames, w->file) ==
+                w->frames) &&
+        fseek(w->file, 0, SEEK_SET) == 0 &&
+        fwrite(&header, sizeof(header), 1, w->file) == 1;
+    ok = fclose(w->file) == 0 && ok;
+    free(w->entries);
+    free(w);
+    return ok;
+}
+
+// Checks that the index is inside the file, that the frames follow the
+// header and each other without gaps up to the index like VS_Writer lays
+// them out, that the frame rate can be played and that playback can start
+// at frame 0
+static bool VS_Reader_validate(VS_Reader* r) {
+    const VS_Header* h = r->header;
+    if (r->size < sizeof(*h) || memcmp(h->magic, VS_MAGIC, 4) ||
+        h->version != VS_VERSION || h->index < sizeof(*h) ||
+        h->index % sizeof(uint64_t) ||
+        h->index > r->size ||
+        h->frames > (r->size - h->index) / sizeof(VS_Entry) ||
+        !isfinite(h->fps) || h->fps <= 0)
+    {
+        return false;
+    }
+    r->entries = (const VS_Entry*)(r->data + h->index);
+    uint64_t end = sizeof(*h);
+    for (size_t f = 0; f < h->frames; f++) {
+        const VS_Entry* e = &r->entries[f];
+        if (e->offset != end || e->length > h->index - e->offset) {
+            return false;
+        }
+        end = e->offset + e->length;
+    }
+    return !h->frames || r->entries[0].flags & VS_KEYFRAME;
+}
+
+struct VS_Reader* VS_Reader_open(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return NULL;
+    }
+    if ((size_t)st.st_size < sizeof(VS_Header)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    VS_Reader* r = calloc(1, sizeof(*r));
+    r->fd = fd;
+    r->data = data;
+    r->size = st.st_size;
+    r->header = data;
+    if (!VS_Reader_validate(r)) {
+        munmap(data, r->size);
+        close(fd);
+        free(r);
+        errno = EINVAL;
+        return NULL;
+    }
+    // frames are read in order
+    madvise(data, r->size, MADV_SEQUENTIAL);
+
+    r->keyframes = malloc((r->header->frames + 1) * sizeof(*r->keyframes));
+    for (size_t f = 0; f < r->header->frames; f++) {
+        if (r->entries[f].flags & VS_KEYFRAME) {
+            r->keyframes[r->nkeyframes++] = f;
+        }
+    }
+    return (struct VS_Reader*)r;
+}
+
+void VS_Reader_close(struct VS_Reader* reader) {
+    VS_Reader* r = VS_Reader(reader);
+    munmap((void*)r->data, r->size);
+    close(r->fd);
+    free(r->keyframes);
+    free(r);
+}
+
+const VS_Header* VS_Reader_header(struct VS_Reader* r) {
+    return VS_Reader(r)->header;
+}
+
+int VS_Reader_fd(struct VS_Reader* r) {
+    return VS_Reader(r)->fd;
+}
+
+const char* VS_Reader_data(struct VS_Reader* r) {
+    return VS_Reader(r)->data;
+}
+
+const char* VS_Reader_frame(struct VS_Reader* reader, size_t f, size_t* len) {
+    VS_Reader* r = VS_Reader(reader);
+    *len = r->entries[f].length;
+    return r->data + r->entries[f].offset;
+}
+
+size_t VS_Reader_keyframe(struct VS_Reader* reader, size_t f) {
+    VS_Reader* r = VS_Reader(reader);
+    // binary search for the last keyframe that is not after f
+    size_t lo = 0, hi = r->nkeyframes;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (r->keyframes[mid] <= f) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return r->nkeyframes ? r->keyframes[lo] : 0;
+}
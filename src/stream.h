@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Pre-encoded video: for every frame, the bytes that bring the screen from
+// the previous frame to it, as AP_Buffer_encode made them. Keyframes are
+// full redraws that don't depend on what is on screen, so playback can
+// start at any of them. Layout, in host byte order:
+//   VS_Header
+//   the bytes of every frame, one after the other
+//   VS_Entry per frame, at header.index (8 byte aligned)
+struct VS_Writer;
+struct VS_Reader;
+
+#define VS_MAGIC "APVS"
+#define VS_VERSION 1
+
+// The terminal and mode the frames were encoded for. They redraw all of
+// the termRows by termCols cells and need a terminal at least as large
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t termRows, termCols;
+    uint32_t height, width; // pixels of the frames, 2 rows per text row
+    uint8_t truecolor;
+    uint8_t text; // AP_Text
+    uint8_t glyphs; // 0 for half blocks, otherwise an AP_Glyphs
+    uint8_t scenePalette; // frames redefine colors 16-255 with OSC 4
+    float fps;
+    uint32_t keyframeInterval; // frames
+    uint64_t frames;
+    uint64_t index;
+} VS_Header;
+
+#define VS_KEYFRAME 1
+
+typedef struct {
+    uint64_t offset; // from the start of the file
+    uint32_t length;
+    uint32_t flags;
+} VS_Entry;
+
+// Creates path and reserves room for the header. NULL with errno set when
+// the file can't be created
+struct VS_Writer* VS_Writer_new(const char* path);
+// append the next frame
+bool VS_Writer_append(
+    struct VS_Writer* w, const char* data, size_t len, bool keyframe);
+// Writes the index and header, whose frames and index are filled in, and
+// frees w. Returns false when any write failed
+bool VS_Writer_close(struct VS_Writer* w, VS_Header header);
+
+// Maps path. NULL with errno set when it can't be read or is not a stream
+// of this version (EINVAL)
+struct VS_Reader* VS_Reader_open(const char* path);
+void VS_Reader_close(struct VS_Reader* r);
+const VS_Header* VS_Reader_header(struct VS_Reader* r);
+// The file, open until close, and its mapping. Frames are at their offset
+// from the mapping in the file, for sending them without reading them
+int VS_Reader_fd(struct VS_Reader* r);
+const char* VS_Reader_data(struct VS_Reader* r);
+// bytes of frame f, len gets their length
+const char* VS_Reader_frame(struct VS_Reader* r, size_t f, size_t* len);
+// the last keyframe at or before frame f
+size_t VS_Reader_keyframe(struct VS_Reader* r, size_t f);